@@ -49,7 +49,7 @@ static void D_addResourceScriptToZip(ziparchive_t *zip, const char *filename)
       I_Error("D_addResourceScript: unable to load resource %s\n", srcpath.constPtr());
 
    Zip_AddFile(zip, filename, reinterpret_cast<byte *>(text), 
-               static_cast<uint32_t>(strlen(text)), ZIP_FILE_TEXT, true);
+               static_cast<uint32_t>(strlen(text)), ZIP_FILE_TEXT, true, true);
 }
 
 //
@@ -0,0 +1,162 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//    Verification of written archives
+//
+//-----------------------------------------------------------------------------
+
+#include <atomic>
+#include <chrono>
+
+#include "z_zone.h"
+
+#include "d_verify.h"
+#include "m_collection.h"
+#include "m_parallel.h"
+#include "v_psx.h"
+#include "w_zip.h"
+
+//
+// D_isPatchLump
+//
+// True if the named archive entry should hold a patch_t-format graphic.
+//
+static bool D_isPatchLump(const char *name)
+{
+   static const char *patchDirs[] = { "sprites/", "textures/" };
+
+   for(size_t i = 0; i < earrlen(patchDirs); i++)
+   {
+      if(!strncmp(name, patchDirs[i], strlen(patchDirs[i])))
+         return true;
+   }
+
+   // graphics/ holds patches apart from a few full screens
+   if(!strncmp(name, "graphics/", 9))
+      return !V_IsRawScreen(name + 9);
+
+   return false;
+}
+
+//
+// D_VerifyArchive
+//
+// The archive is reopened with the same reader used for input, and its
+// entries are checked in parallel when the file could be mapped into memory.
+// Every problem is recorded, but only the first entry in directory order with
+// one is reported, so the result is the same for any number of threads.
+//
+bool D_VerifyArchive(const char *filename)
+{
+   FILE *f;
+
+   printf("D_VerifyArchive: verifying '%s'\n", filename);
+
+   if(!(f = fopen(filename, "rb")))
+   {
+      printf("D_VerifyArchive: cannot open '%s'\n", filename);
+      return false;
+   }
+
+   ZipFile zip;
+   if(!zip.readFromFile(f)) // zip now owns f
+   {
+      printf("D_VerifyArchive: '%s' is not a valid zip\n", filename);
+      return false;
+   }
+
+   auto   start    = std::chrono::steady_clock::now();
+   size_t numLumps = static_cast<size_t>(zip.getNumLumps());
+
+   PODCollection<const char *> errors;
+   errors.resize(numLumps);
+
+   std::atomic<size_t> numPatches(0);
+
+   auto verifyLump = [&] (size_t i)
+   {
+      ZipLump &lump   = zip.getLump(static_cast<int>(i));
+      auto     buffer = emalloc(byte *, lump.size ? lump.size : 1);
+
+      if(!(errors[i] = lump.verify(buffer)) && D_isPatchLump(lump.name))
+      {
+         errors[i] = V_ValidatePatch(buffer, lump.size);
+         ++numPatches;
+      }
+
+      efree(buffer);
+   };
+
+   // an unmapped zip can only be read from one thread at a time
+   if(zip.isMapped())
+      M_ParallelFor(numLumps, verifyLump);
+   else
+   {
+      for(size_t i = 0; i < numLumps; i++)
+         verifyLump(i);
+   }
+
+   std::chrono::duration<double> elapsed = 
+      std::chrono::steady_clock::now() - start;
+
+   uint64_t total = 0, compressed = 0;
+   size_t   numBad = 0, firstBad = numLumps;
+
+   for(size_t i = 0; i < numLumps; i++)
+   {
+      ZipLump &lump = zip.getLump(static_cast<int>(i));
+
+      total      += lump.size;
+      compressed += lump.compressed;
+
+      if(errors[i])
+      {
+         if(!numBad++)
+            firstBad = i;
+      }
+   }
+
+   double seconds = elapsed.count();
+   double mbytes  = total / (1024.0 * 1024.0);
+
+   printf("D_VerifyArchive: %u entries (%u patches), %.2f MB from %.2f MB "
+          "compressed in %.3f s", static_cast<unsigned int>(numLumps),
+          static_cast<unsigned int>(numPatches.load()), mbytes, 
+          compressed / (1024.0 * 1024.0), seconds);
+   if(seconds > 0.0)
+      printf(" (%.1f MB/s)", mbytes / seconds);
+   printf("\n");
+
+   if(numBad)
+   {
+      printf("D_VerifyArchive: %u bad entries; first is '%s': %s\n",
+             static_cast<unsigned int>(numBad), 
+             zip.getLump(static_cast<int>(firstBad)).name, errors[firstBad]);
+      return false;
+   }
+
+   printf("D_VerifyArchive: all entries are good\n");
+   return true;
+}
+
+// EOF
+
@@ -0,0 +1,38 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//    Verification of written archives
+//
+//-----------------------------------------------------------------------------
+
+#ifndef D_VERIFY_H__
+#define D_VERIFY_H__
+
+// Read back every entry of the archive at filename, checking that it inflates
+// to data matching its CRC, and that the graphics which should be patches are
+// well formed. Returns false if anything is wrong.
+bool D_VerifyArchive(const char *filename);
+
+#endif
+
+// EOF
+
@@ -264,32 +264,17 @@ static void D_dumpSectorFlags(const char *filename, void *sectors, size_t size)
    b += 4
 
 //
-// D_AddOneMapToZip
+// D_buildMapWad
 //
-// What a goddamn pain in the ass.
+// What a goddamn pain in the ass. Reads in a map wad and puts it back
+// together as a PWAD in memory, returning a zone buffer of len bytes.
 //
-static void D_addOneMapToZip(ziparchive_t *zip, const char *name, const qstring &filename)
+static byte *D_buildMapWad(const qstring &filename, uint32_t &len)
 {
    WadDirectory dir;
 
    if(!dir.addNewFile(filename.constPtr()))
-      I_Error("D_addOneMapToZip: cannot open file %s\n", filename.constPtr());
-
-   // does the user want to write out vanilla-compatible maps?
-   int arg;
-   if((arg = M_CheckParm("-vanillamaps")))
-   {
-      qstring outPath;
-      filename.extractFileBase(outPath);
-
-      if(arg < myargc - 1 && myargv[arg + 1][0] != '-')
-      {
-         qstring dir(myargv[arg + 1]);
-         outPath = dir.pathConcatenate(outPath.constPtr());
-      }
-
-      D_TranslateLevelToVanilla(dir, outPath); 
-   }
+      I_Error("D_buildMapWad: cannot open file %s\n", filename.constPtr());
 
    WadNamespaceIterator wni { dir, lumpinfo_t::ns_global };
 
@@ -301,7 +286,7 @@ static void D_addOneMapToZip(ziparchive_t *zip, const char *name, const qstring
       sizeNeeded += wni.current()->size;
 
    if(!sizeNeeded)
-      I_Error("D_addOneMapToZip: zero-size wad file %s\n", filename.constPtr());
+      I_Error("D_buildMapWad: zero-size wad file %s\n", filename.constPtr());
 
    auto buffer = ecalloc(byte *, 1, sizeNeeded);
 
@@ -345,7 +330,43 @@ static void D_addOneMapToZip(ziparchive_t *zip, const char *name, const qstring
       }
    }
 
-   Zip_AddFile(zip, name, buffer, (uint32_t)sizeNeeded, ZIP_FILE_BINARY, true);
+   len = (uint32_t)sizeNeeded;
+   return buffer;
+}
+
+//
+// D_addOneMapToZip
+//
+// Add a map wad to the zip. The wad is only read in and rebuilt once the
+// archive is ready to write it out.
+//
+static void D_addOneMapToZip(ziparchive_t *zip, const char *name, const qstring &filename)
+{
+   // does the user want to write out vanilla-compatible maps?
+   int arg;
+   if((arg = M_CheckParm("-vanillamaps")))
+   {
+      WadDirectory dir;
+
+      if(!dir.addNewFile(filename.constPtr()))
+         I_Error("D_addOneMapToZip: cannot open file %s\n", filename.constPtr());
+
+      qstring outPath;
+      filename.extractFileBase(outPath);
+
+      if(arg < myargc - 1 && myargv[arg + 1][0] != '-')
+      {
+         qstring dir(myargv[arg + 1]);
+         outPath = dir.pathConcatenate(outPath.constPtr());
+      }
+
+      D_TranslateLevelToVanilla(dir, outPath); 
+   }
+
+   Zip_AddFile(zip, name, [filename] (uint32_t &len)
+   {
+      return D_buildMapWad(filename, len);
+   }, true);
 }
 
 //=============================================================================
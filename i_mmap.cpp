@@ -0,0 +1,111 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//    Read-only memory mapping of files.
+//
+//-----------------------------------------------------------------------------
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "z_zone.h"
+#include "i_mmap.h"
+
+//
+// MappedFile::map
+//
+// Map the whole of f. Returns false if it can't be mapped, such as when it is
+// empty or a pipe; the caller should fall back to reading it normally.
+//
+bool MappedFile::map(FILE *f)
+{
+   unmap();
+
+#ifdef _WIN32
+   HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(f)));
+   LARGE_INTEGER fsize;
+
+   if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fsize) ||
+      !fsize.QuadPart || static_cast<ULONGLONG>(fsize.QuadPart) > SIZE_MAX)
+      return false;
+
+   HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+   if(!mapping)
+      return false;
+
+   void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+   if(!view)
+   {
+      CloseHandle(mapping);
+      return false;
+   }
+
+   data   = static_cast<const byte *>(view);
+   size   = static_cast<size_t>(fsize.QuadPart);
+   handle = mapping;
+#else
+   struct stat st;
+   int fd = fileno(f);
+
+   if(fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0)
+      return false;
+
+   void *view = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, 
+                     MAP_SHARED, fd, 0);
+   if(view == MAP_FAILED)
+      return false;
+
+   data = static_cast<const byte *>(view);
+   size = static_cast<size_t>(st.st_size);
+#endif
+
+   return true;
+}
+
+//
+// MappedFile::unmap
+//
+void MappedFile::unmap()
+{
+   if(!data)
+      return;
+
+#ifdef _WIN32
+   UnmapViewOfFile(data);
+   CloseHandle(static_cast<HANDLE>(handle));
+#else
+   munmap(const_cast<byte *>(data), size);
+#endif
+
+   data   = NULL;
+   size   = 0;
+   handle = NULL;
+}
+
+// EOF
+
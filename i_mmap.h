@@ -0,0 +1,60 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//    Read-only memory mapping of files.
+//
+//-----------------------------------------------------------------------------
+
+#ifndef I_MMAP_H__
+#define I_MMAP_H__
+
+#include "doomtype.h"
+#include "z_zone.h"
+
+//
+// MappedFile
+//
+// The whole of an open file, mapped read-only into memory. The mapping stays
+// valid until the object is destroyed, even if the file is closed first.
+//
+class MappedFile : public ZoneObject
+{
+protected:
+   const byte *data;
+   size_t      size;
+   void       *handle; // platform mapping object, if any
+
+public:
+   MappedFile() : ZoneObject(), data(NULL), size(0), handle(NULL) {}
+   ~MappedFile() { unmap(); }
+
+   bool map(FILE *f);
+   void unmap();
+
+   const byte *getData() const { return data; }
+   size_t      getSize() const { return size; }
+};
+
+#endif
+
+// EOF
+
@@ -24,6 +24,13 @@
 //
 //-----------------------------------------------------------------------------
 
+#ifdef _MSC_VER
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 #include "z_zone.h"
 #include "i_system.h"
 
@@ -123,5 +130,39 @@ void I_ErrorVA(const char *error, va_list args)
       I_FatalError(I_ERR_ABORT, "I_ErrorVA: double faulted\n");
 }
 
+//
+// I_ClaimStdout
+//
+// Hand standard output over to binary data, such as an archive being piped
+// into another program. The original descriptor is duplicated for the data,
+// and stdout is pointed at stderr, so that console messages printed from then
+// on can't end up mixed in with it. Returns the same stream on every call,
+// or NULL if it couldn't be set up.
+//
+FILE *I_ClaimStdout()
+{
+   static FILE *out;
+
+   if(out)
+      return out;
+
+   fflush(stdout);
+
+#ifdef _MSC_VER
+   int fd = _dup(_fileno(stdout));
+   if(fd < 0 || _dup2(_fileno(stderr), _fileno(stdout)))
+      return NULL;
+   _setmode(fd, _O_BINARY);
+   out = _fdopen(fd, "wb");
+#else
+   int fd = dup(STDOUT_FILENO);
+   if(fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+      return NULL;
+   out = fdopen(fd, "wb");
+#endif
+
+   return out;
+}
+
 // EOF
 
@@ -42,6 +42,9 @@ void I_ErrorVA(const char *error, va_list args);
 // haleyjd 05/21/10
 void I_FatalError(int code, const char *error, ...);
 
+// Take over stdout for binary output; console messages go to stderr instead.
+FILE *I_ClaimStdout();
+
 #endif
 
 // EOF
@@ -29,6 +29,18 @@
 #include "m_buffer.h"
 #include "m_swap.h"
 
+#ifndef _MSC_VER
+#include <sys/uio.h>
+#include <unistd.h>
+#define OUTBUFFER_WRITEV
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__)
+#define OUTBUFFER_PWRITEV
+#endif
+#else
+#include <mutex>
+#endif
+
 //=============================================================================
 //
 // BufferedFileBase
@@ -177,15 +189,26 @@ void BufferedFileBase::SwapShort(int16_t &x)
 // OutBuffer::CreateFile
 //
 // Opens a file for buffered binary output with the given filename. The buffer
-// size is determined by the len parameter.
+// size is determined by the len parameter. A filename of "-" means stdout,
+// which may well be a pipe, so nothing may seek within it.
 //
 bool OutBuffer::CreateFile(const char *filename, size_t pLen, int pEndian)
 {
-   if(!(f = fopen(filename, "wb")))
+   if(!strcmp(filename, "-"))
+      f = I_ClaimStdout();
+   else
+      f = fopen(filename, "wb");
+
+   if(!f)
       return false;
 
+   // we do our own buffering, so stdio's would only add another copy
+   setvbuf(f, NULL, _IONBF, 0);
+
    InitBuffer(pLen, pEndian);
 
+   fpos = 0;
+
    ownFile = true;
 
    return true;
@@ -202,18 +225,33 @@ bool OutBuffer::Flush()
 {
    if(idx)
    {
-      if(fwrite(buffer, sizeof(byte), idx, f) < idx)
-      {
-         if(throwing)
-            throw BufferedIOException("fwrite did not write the requested amount");
+      if(!WriteFile(buffer, idx))
          return false;
-      }
       idx = 0;
    }
 
    return true;
 }
 
+//
+// OutBuffer::WriteFile
+//
+// Protected method. Write data straight to the file, bypassing the buffer.
+//
+bool OutBuffer::WriteFile(const void *data, size_t size)
+{
+   if(fwrite(data, sizeof(byte), size, f) < size)
+   {
+      if(throwing)
+         throw BufferedIOException("fwrite did not write the requested amount");
+      return false;
+   }
+
+   fpos += static_cast<long>(size);
+
+   return true;
+}
+
 //
 // OutBuffer::Close
 //
@@ -270,6 +308,239 @@ bool OutBuffer::Write(const void *data, size_t size)
    return true;
 }
 
+//
+// OutBuffer::WriteVector
+//
+// Write several pieces of data in order. Anything which fits in the space left
+// in the buffer is simply copied there, but larger amounts are written to the
+// file directly from where they are, together with whatever is pending in the
+// buffer, using a single gathering write where the platform has one.
+//
+bool OutBuffer::WriteVector(const piece_t *pieces, size_t count)
+{
+   size_t total = 0;
+
+   for(size_t i = 0; i < count; i++)
+      total += pieces[i].size;
+
+   if(total <= len - idx)
+   {
+      for(size_t i = 0; i < count; i++)
+         Write(pieces[i].data, pieces[i].size);
+      return true;
+   }
+
+#ifdef OUTBUFFER_WRITEV
+   static const size_t MAXVECS = 16;
+   iovec vecs[MAXVECS];
+   size_t numvecs = 0;
+   size_t bytes   = 0;
+
+   // take the pending contents of the buffer along
+   if(idx)
+   {
+      vecs[numvecs].iov_base = buffer;
+      vecs[numvecs].iov_len  = idx;
+      bytes += idx;
+      ++numvecs;
+   }
+
+   for(size_t i = 0; i <= count; i++)
+   {
+      // send off a batch once the array is full or there's nothing left
+      if(i == count || numvecs == MAXVECS)
+      {
+         iovec *vec = vecs;
+
+         fpos += static_cast<long>(bytes);
+
+         while(numvecs)
+         {
+            ssize_t res = writev(fileno(f), vec, static_cast<int>(numvecs));
+
+            if(res < 0)
+            {
+               if(throwing)
+                  throw BufferedIOException("writev failed");
+               return false;
+            }
+
+            // advance past whatever was written; writes may come up short
+            size_t amt = static_cast<size_t>(res);
+            while(numvecs && amt >= vec->iov_len)
+            {
+               amt -= vec->iov_len;
+               ++vec;
+               --numvecs;
+            }
+            if(numvecs)
+            {
+               vec->iov_base = static_cast<byte *>(vec->iov_base) + amt;
+               vec->iov_len -= amt;
+            }
+         }
+
+         bytes = 0;
+      }
+
+      if(i < count && pieces[i].size)
+      {
+         vecs[numvecs].iov_base = const_cast<void *>(pieces[i].data);
+         vecs[numvecs].iov_len  = pieces[i].size;
+         bytes += pieces[i].size;
+         ++numvecs;
+      }
+   }
+
+   idx = 0;
+#else
+   if(!Flush())
+      return false;
+
+   for(size_t i = 0; i < count; i++)
+   {
+      if(pieces[i].size && !WriteFile(pieces[i].data, pieces[i].size))
+         return false;
+   }
+#endif
+
+   return true;
+}
+
+#ifdef _MSC_VER
+// Positional writes have to seek the shared file pointer.
+static std::mutex writeAtLock;
+#endif
+
+//
+// OutBuffer::WriteVectorAt
+//
+// Write several pieces of data in order, starting at an absolute position in
+// the file. Neither the buffer nor the current position are affected, and
+// different threads may write at different positions at the same time. The
+// caller is responsible for keeping those writes apart from each other and
+// from anything still waiting in the buffer.
+//
+bool OutBuffer::WriteVectorAt(long pos, const piece_t *pieces, size_t count)
+{
+#ifdef OUTBUFFER_PWRITEV
+   static const size_t MAXVECS = 16;
+   iovec vecs[MAXVECS];
+   
+   while(count)
+   {
+      size_t numvecs = 0;
+
+      while(count && numvecs < MAXVECS)
+      {
+         vecs[numvecs].iov_base = const_cast<void *>(pieces->data);
+         vecs[numvecs].iov_len  = pieces->size;
+         ++numvecs;
+         ++pieces;
+         --count;
+      }
+
+      iovec *vec = vecs;
+      while(numvecs)
+      {
+         ssize_t res = pwritev(fileno(f), vec, static_cast<int>(numvecs), pos);
+
+         if(res < 0)
+         {
+            if(throwing)
+               throw BufferedIOException("pwritev failed");
+            return false;
+         }
+
+         // advance past whatever was written; writes may come up short
+         size_t amt = static_cast<size_t>(res);
+         pos += static_cast<long>(amt);
+         while(numvecs && amt >= vec->iov_len)
+         {
+            amt -= vec->iov_len;
+            ++vec;
+            --numvecs;
+         }
+         if(numvecs)
+         {
+            vec->iov_base = static_cast<byte *>(vec->iov_base) + amt;
+            vec->iov_len -= amt;
+         }
+      }
+   }
+#elif defined(OUTBUFFER_WRITEV)
+   for(size_t i = 0; i < count; i++)
+   {
+      const byte *data = static_cast<const byte *>(pieces[i].data);
+      size_t      size = pieces[i].size;
+
+      while(size)
+      {
+         ssize_t res = pwrite(fileno(f), data, size, pos);
+
+         if(res < 0)
+         {
+            if(throwing)
+               throw BufferedIOException("pwrite failed");
+            return false;
+         }
+
+         data += res;
+         size -= static_cast<size_t>(res);
+         pos  += static_cast<long>(res);
+      }
+   }
+#else
+   std::lock_guard<std::mutex> guard(writeAtLock);
+
+   long oldpos = ftell(f);
+
+   if(fseek(f, pos, SEEK_SET))
+   {
+      if(throwing)
+         throw BufferedIOException("fseek failed");
+      return false;
+   }
+
+   for(size_t i = 0; i < count; i++)
+   {
+      if(fwrite(pieces[i].data, sizeof(byte), pieces[i].size, f) < pieces[i].size)
+      {
+         if(throwing)
+            throw BufferedIOException("fwrite did not write the requested amount");
+         return false;
+      }
+   }
+
+   fseek(f, oldpos, SEEK_SET);
+#endif
+
+   return true;
+}
+
+//
+// OutBuffer::SkipTo
+//
+// Continue writing at the given position, such as at the end of data which
+// was written out with WriteVectorAt.
+//
+bool OutBuffer::SkipTo(long pos)
+{
+   if(!Flush())
+      return false;
+
+   if(fseek(f, pos, SEEK_SET))
+   {
+      if(throwing)
+         throw BufferedIOException("fseek failed");
+      return false;
+   }
+
+   fpos = pos;
+
+   return true;
+}
+
 //
 // OutBuffer::WriteUint32
 //
@@ -109,12 +109,32 @@ public:
 //
 class OutBuffer : public BufferedFileBase
 {
+protected:
+   long fpos; // amount of data handed to the file so far
+
+   bool WriteFile(const void *data, size_t size);
+
 public:
+   // One piece of data for WriteVector
+   struct piece_t
+   {
+      const void *data;
+      size_t      size;
+   };
+
+   OutBuffer() : BufferedFileBase(), fpos(0) {}
+
    bool CreateFile(const char *filename, size_t pLen, int pEndian);
    bool Flush();
    void Close();
 
+   // Current position in the output, including data not yet flushed
+   long GetPosition() const { return fpos + static_cast<long>(idx); }
+
    bool Write(const void *data, size_t size);
+   bool WriteVector(const piece_t *pieces, size_t count);
+   bool WriteVectorAt(long pos, const piece_t *pieces, size_t count);
+   bool SkipTo(long pos);
    bool WriteSint32(int32_t  num);
    bool WriteUint32(uint32_t num);
    bool WriteSint16(int16_t  num);
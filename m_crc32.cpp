@@ -0,0 +1,557 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//   CRC-32 calculation, as used by zip archives.
+//
+//   The implementation is chosen at runtime. Slicing-by-16 tables are used
+//   everywhere as the portable path; on x86 processors with PCLMULQDQ the
+//   bulk of each buffer is folded with carry-less multiplication, and on
+//   ARMv8 processors with the CRC32 extension the dedicated instructions
+//   are used instead.
+//
+//-----------------------------------------------------------------------------
+
+#include "z_zone.h"
+
+#include "i_system.h"
+#include "m_crc32.h"
+
+// zlib's crc32 is the reference for the unit test
+#include "zlib/zlib.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CRC32_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32_TARGET_PCLMUL
+#else
+#include <cpuid.h>
+#define CRC32_TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#endif
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32_ARMV8
+#if defined(__clang__)
+#define CRC32_TARGET_ARMCRC __attribute__((target("crc")))
+#else
+#define CRC32_TARGET_ARMCRC __attribute__((target("+crc")))
+#endif
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+// All engines work on the inverted "register" form of the CRC; the inversion
+// on the way in and out is done once, by M_CRC32Update.
+typedef uint32_t (*crc32func_t)(uint32_t crc, const byte *data, size_t len);
+
+//=============================================================================
+//
+// Portable Implementation
+//
+
+#define CRC32_IEEE_POLY 0xEDB88320
+
+// crc32Tables[0] is the classic byte-at-a-time table; crc32Tables[n] gives the
+// effect of a byte followed by n zero bytes.
+static uint32_t crc32Tables[16][256];
+
+//
+// M_crc32BuildTables
+//
+static void M_crc32BuildTables()
+{
+   for(uint32_t i = 0; i < 256; i++)
+   {
+      uint32_t val = i;
+
+      for(int j = 0; j < 8; j++)
+      {
+         if(val & 1)
+            val = (val >> 1) ^ CRC32_IEEE_POLY;
+         else
+            val >>= 1;
+      }
+
+      crc32Tables[0][i] = val;
+   }
+
+   for(uint32_t i = 0; i < 256; i++)
+   {
+      for(int t = 1; t < 16; t++)
+      {
+         uint32_t prev = crc32Tables[t - 1][i];
+         crc32Tables[t][i] = (prev >> 8) ^ crc32Tables[0][prev & 0xff];
+      }
+   }
+}
+
+//
+// M_crc32Bytes
+//
+// One byte at a time, for short runs and leftovers.
+//
+static inline uint32_t M_crc32Bytes(uint32_t crc, const byte *data, size_t len)
+{
+   while(len--)
+      crc = crc32Tables[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+   return crc;
+}
+
+//
+// M_crc32Slice8
+//
+// Slicing-by-8: eight table lookups per eight bytes, all independent.
+//
+static uint32_t M_crc32Slice8(uint32_t crc, const byte *data, size_t len)
+{
+   while(len >= 8)
+   {
+      crc ^= (uint32_t)data[0]       | ((uint32_t)data[1] <<  8) |
+             ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+
+      crc = crc32Tables[7][ crc        & 0xff] ^
+            crc32Tables[6][(crc >>  8) & 0xff] ^
+            crc32Tables[5][(crc >> 16) & 0xff] ^
+            crc32Tables[4][ crc >> 24        ] ^
+            crc32Tables[3][data[4]] ^
+            crc32Tables[2][data[5]] ^
+            crc32Tables[1][data[6]] ^
+            crc32Tables[0][data[7]];
+
+      data += 8;
+      len  -= 8;
+   }
+
+   return M_crc32Bytes(crc, data, len);
+}
+
+//
+// M_crc32Slice16
+//
+// Slicing-by-16: as above, but with twice the work in flight per step.
+//
+static uint32_t M_crc32Slice16(uint32_t crc, const byte *data, size_t len)
+{
+   while(len >= 16)
+   {
+      crc ^= (uint32_t)data[0]       | ((uint32_t)data[1] <<  8) |
+             ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+
+      crc = crc32Tables[15][ crc        & 0xff] ^
+            crc32Tables[14][(crc >>  8) & 0xff] ^
+            crc32Tables[13][(crc >> 16) & 0xff] ^
+            crc32Tables[12][ crc >> 24        ] ^
+            crc32Tables[11][data[ 4]] ^
+            crc32Tables[10][data[ 5]] ^
+            crc32Tables[ 9][data[ 6]] ^
+            crc32Tables[ 8][data[ 7]] ^
+            crc32Tables[ 7][data[ 8]] ^
+            crc32Tables[ 6][data[ 9]] ^
+            crc32Tables[ 5][data[10]] ^
+            crc32Tables[ 4][data[11]] ^
+            crc32Tables[ 3][data[12]] ^
+            crc32Tables[ 2][data[13]] ^
+            crc32Tables[ 1][data[14]] ^
+            crc32Tables[ 0][data[15]];
+
+      data += 16;
+      len  -= 16;
+   }
+
+   return M_crc32Slice8(crc, data, len);
+}
+
+//=============================================================================
+//
+// x86 PCLMULQDQ Implementation
+//
+// Folding with carry-less multiplication as described in Intel's "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction", using the
+// bit-reflected constants for the zip polynomial. Four 128-bit lanes are
+// folded forward 64 bytes at a time, reduced to one lane, folded 16 bytes at
+// a time, and finally Barrett-reduced to 32 bits.
+//
+
+#ifdef CRC32_X86
+
+static const uint64_t crc32K1K2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+static const uint64_t crc32K3K4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+static const uint64_t crc32K5[2]   = { 0x0163cd6124ULL, 0x0000000000ULL };
+static const uint64_t crc32Poly[2] = { 0x01db710641ULL, 0x01f7011641ULL };
+
+//
+// M_crc32FoldPCLMUL
+//
+// len must be at least 64 and a multiple of 16.
+//
+CRC32_TARGET_PCLMUL
+static uint32_t M_crc32FoldPCLMUL(uint32_t crc, const byte *data, size_t len)
+{
+   __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+   x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+   x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+   x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+   x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+
+   x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+   x0 = _mm_loadu_si128((const __m128i *)crc32K1K2);
+
+   data += 64;
+   len  -= 64;
+
+   // fold 64 bytes at a time
+   while(len >= 64)
+   {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+      y5 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+      y6 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+      y7 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+      y8 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+      data += 64;
+      len  -= 64;
+   }
+
+   // fold the four lanes into one
+   x0 = _mm_loadu_si128((const __m128i *)crc32K3K4);
+
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+   // fold 16 bytes at a time
+   while(len >= 16)
+   {
+      x2 = _mm_loadu_si128((const __m128i *)data);
+
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+      data += 16;
+      len  -= 16;
+   }
+
+   // fold 128 bits down to 64
+   x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+   x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+   x1 = _mm_srli_si128(x1, 8);
+   x1 = _mm_xor_si128(x1, x2);
+
+   x0 = _mm_loadl_epi64((const __m128i *)crc32K5);
+
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_and_si128(x1, x3);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+
+   // Barrett reduction to 32 bits
+   x0 = _mm_loadu_si128((const __m128i *)crc32Poly);
+
+   x2 = _mm_and_si128(x1, x3);
+   x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+   x2 = _mm_and_si128(x2, x3);
+   x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+
+   return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+//
+// M_crc32PCLMUL
+//
+static uint32_t M_crc32PCLMUL(uint32_t crc, const byte *data, size_t len)
+{
+   if(len >= 64)
+   {
+      size_t chunk = len & ~(size_t)15;
+
+      crc   = M_crc32FoldPCLMUL(crc, data, chunk);
+      data += chunk;
+      len  -= chunk;
+   }
+
+   return M_crc32Slice16(crc, data, len);
+}
+
+//
+// M_crc32HavePCLMUL
+//
+static bool M_crc32HavePCLMUL()
+{
+   const unsigned int pclmul = 1u << 1;
+   const unsigned int sse41  = 1u << 19;
+   unsigned int ecx;
+
+#if defined(_MSC_VER)
+   int regs[4];
+   __cpuid(regs, 1);
+   ecx = static_cast<unsigned int>(regs[2]);
+#else
+   unsigned int eax, ebx, edx;
+   if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+      return false;
+#endif
+
+   return (ecx & pclmul) && (ecx & sse41);
+}
+
+#endif // CRC32_X86
+
+//=============================================================================
+//
+// ARMv8 CRC32 Implementation
+//
+
+#ifdef CRC32_ARMV8
+
+//
+// M_crc32ARMv8
+//
+CRC32_TARGET_ARMCRC
+static uint32_t M_crc32ARMv8(uint32_t crc, const byte *data, size_t len)
+{
+   // align to 8 bytes
+   while(len && (reinterpret_cast<uintptr_t>(data) & 7))
+   {
+      crc = __crc32b(crc, *data++);
+      --len;
+   }
+
+   while(len >= 32)
+   {
+      const uint64_t *data64 = reinterpret_cast<const uint64_t *>(data);
+
+      crc = __crc32d(crc, data64[0]);
+      crc = __crc32d(crc, data64[1]);
+      crc = __crc32d(crc, data64[2]);
+      crc = __crc32d(crc, data64[3]);
+
+      data += 32;
+      len  -= 32;
+   }
+
+   while(len >= 8)
+   {
+      crc = __crc32d(crc, *reinterpret_cast<const uint64_t *>(data));
+      data += 8;
+      len  -= 8;
+   }
+
+   while(len--)
+      crc = __crc32b(crc, *data++);
+
+   return crc;
+}
+
+//
+// M_crc32HaveARMv8
+//
+static bool M_crc32HaveARMv8()
+{
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+   return true;
+#elif defined(__linux__) && defined(HWCAP_CRC32)
+   return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+   return false;
+#endif
+}
+
+#endif // CRC32_ARMV8
+
+//=============================================================================
+//
+// Engine Selection
+//
+
+struct crc32engine_t
+{
+   const char  *name;
+   crc32func_t  func;
+};
+
+//
+// M_crc32SelectEngine
+//
+static crc32engine_t M_crc32SelectEngine()
+{
+   crc32engine_t engine = { "slicing-by-16", M_crc32Slice16 };
+
+   M_crc32BuildTables();
+
+#ifdef CRC32_X86
+   if(M_crc32HavePCLMUL())
+   {
+      engine.name = "PCLMULQDQ";
+      engine.func = M_crc32PCLMUL;
+   }
+#endif
+#ifdef CRC32_ARMV8
+   if(M_crc32HaveARMv8())
+   {
+      engine.name = "ARMv8 CRC32";
+      engine.func = M_crc32ARMv8;
+   }
+#endif
+
+   return engine;
+}
+
+//
+// M_crc32Engine
+//
+// Select the engine the first time it is needed; this is safe even if that
+// happens on several threads at once.
+//
+static const crc32engine_t &M_crc32Engine()
+{
+   static const crc32engine_t engine = M_crc32SelectEngine();
+   return engine;
+}
+
+//=============================================================================
+//
+// Interface
+//
+
+//
+// M_CRC32Update
+//
+// Calculates a running CRC32 for the provided block of data.
+//
+uint32_t M_CRC32Update(uint32_t crc, const void *data, size_t len)
+{
+   const crc32engine_t &engine = M_crc32Engine();
+
+   return ~engine.func(~crc, static_cast<const byte *>(data), len);
+}
+
+//
+// M_CRC32EngineName
+//
+const char *M_CRC32EngineName()
+{
+   return M_crc32Engine().name;
+}
+
+#ifndef NO_UNIT_TESTS
+
+//
+// M_CRC32UnitTest
+//
+// Check every implementation available on this machine against zlib, over a
+// range of lengths and alignments, and when split into several updates.
+//
+void M_CRC32UnitTest()
+{
+   static const size_t bufferSize = 4096 + 16;
+   byte *buffer = emalloc(byte *, bufferSize);
+
+   uint32_t seed = 0x12345678;
+   for(size_t i = 0; i < bufferSize; i++)
+   {
+      seed = seed * 1103515245 + 12345;
+      buffer[i] = (byte)(seed >> 16);
+   }
+
+   crc32engine_t engines[4];
+   int numEngines = 0;
+
+   M_crc32Engine(); // make sure tables are built
+
+   engines[numEngines++] = { "slicing-by-8",  M_crc32Slice8  };
+   engines[numEngines++] = { "slicing-by-16", M_crc32Slice16 };
+#ifdef CRC32_X86
+   if(M_crc32HavePCLMUL())
+      engines[numEngines++] = { "PCLMULQDQ", M_crc32PCLMUL };
+#endif
+#ifdef CRC32_ARMV8
+   if(M_crc32HaveARMv8())
+      engines[numEngines++] = { "ARMv8 CRC32", M_crc32ARMv8 };
+#endif
+
+   for(int e = 0; e < numEngines; e++)
+   {
+      for(size_t align = 0; align < 16; align += 3)
+      {
+         for(size_t len = 0; len <= 4096; len += (len < 300 ? 1 : 97))
+         {
+            const byte *data = buffer + align;
+            uint32_t expect =
+               (uint32_t)crc32(0, data, static_cast<uInt>(len));
+            uint32_t whole  = ~engines[e].func(~0u, data, len);
+            uint32_t split  = engines[e].func(~0u, data, len / 3);
+
+            split = ~engines[e].func(split, data + len / 3, len - len / 3);
+
+            if(whole != expect || split != expect)
+            {
+               I_Error("M_CRC32UnitTest: %s failed on %u bytes at +%u: "
+                       "%08x, %08x != %08x\n", engines[e].name,
+                       (unsigned int)len, (unsigned int)align, whole, split,
+                       expect);
+            }
+         }
+      }
+
+      printf("M_CRC32UnitTest: %s passed\n", engines[e].name);
+   }
+
+   efree(buffer);
+}
+
+#endif
+
+// EOF
+
@@ -0,0 +1,53 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//   CRC-32 calculation, as used by zip archives.
+//
+//-----------------------------------------------------------------------------
+
+#ifndef M_CRC32_H__
+#define M_CRC32_H__
+
+#include "doomtype.h"
+
+// Continue a running CRC-32 over len more bytes of data. Start with crc == 0;
+// the result is the same as that of zlib's crc32().
+uint32_t M_CRC32Update(uint32_t crc, const void *data, size_t len);
+
+// Calculate the CRC-32 of a single block of data.
+inline uint32_t M_CRC32HashData(const void *data, size_t len)
+{
+   return M_CRC32Update(0, data, len);
+}
+
+// Name of the implementation selected for this machine
+const char *M_CRC32EngineName();
+
+#ifndef NO_UNIT_TESTS
+// Unit test function
+void M_CRC32UnitTest();
+#endif
+
+#endif
+
+// EOF
+
@@ -34,6 +34,13 @@
 //
 //-----------------------------------------------------------------------------
 
+#ifdef _MSC_VER
+#include <process.h>
+#define M_getpid _getpid
+#else
+#define M_getpid getpid
+#endif
+
 #include "z_zone.h"
 
 #include "d_dehtbl.h"
@@ -517,5 +524,36 @@ bool M_FindCanonicalForm(const qstring &indir, const char *fn, qstring &out)
    return res;
 }
 
+//
+// M_TempFileName
+//
+// Make a name, unique to this process, for a file to be written out beside
+// path and then moved over it with M_ReplaceFile once complete.
+//
+void M_TempFileName(const char *path, qstring &out)
+{
+   out.clear();
+   out << path << "." << (int)M_getpid() << ".tmp";
+}
+
+//
+// M_ReplaceFile
+//
+// Move the file at src to dest, replacing any file already there.
+//
+bool M_ReplaceFile(const char *src, const char *dest)
+{
+   if(!rename(src, dest))
+      return true;
+
+#ifdef _WIN32
+   // rename will not overwrite an existing file on Windows
+   if(!remove(dest) && !rename(src, dest))
+      return true;
+#endif
+
+   return false;
+}
+
 // EOF
 
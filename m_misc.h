@@ -63,6 +63,9 @@ char *M_SafeFilePath(const char *pbasepath, const char *newcomponent);
 
 bool M_FindCanonicalForm(const qstring &indir, const char *fn, qstring &out);
 
+void M_TempFileName(const char *path, qstring &out);
+bool M_ReplaceFile(const char *src, const char *dest);
+
 #endif
 
 // EOF
@@ -0,0 +1,264 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//   Worker threads and dependency-aware task scheduling.
+//
+//-----------------------------------------------------------------------------
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "z_zone.h"
+
+#include "i_system.h"
+#include "m_parallel.h"
+
+//=============================================================================
+//
+// Job Count
+//
+
+static int numJobs = 1;
+
+//
+// M_GetNumJobs
+//
+int M_GetNumJobs()
+{
+   return numJobs;
+}
+
+//
+// M_SetNumJobs
+//
+// Set the number of threads to use. Zero or less means one per hardware
+// thread, as far as the implementation is able to tell us.
+//
+void M_SetNumJobs(int jobs)
+{
+   if(jobs <= 0)
+   {
+      jobs = static_cast<int>(std::thread::hardware_concurrency());
+      if(jobs <= 0)
+         jobs = 1;
+   }
+
+   numJobs = jobs;
+}
+
+//=============================================================================
+//
+// Parallel Loops
+//
+
+//
+// M_ParallelFor
+//
+// Work items are handed out through a shared atomic counter, so whichever
+// thread is free claims the next index. The caller joins in as well, which
+// means progress never depends on a helper thread actually being scheduled.
+//
+void M_ParallelFor(size_t count, const std::function<void (size_t)> &fn)
+{
+   size_t numThreads = static_cast<size_t>(numJobs);
+
+   if(numThreads > count)
+      numThreads = count;
+
+   if(numThreads <= 1)
+   {
+      for(size_t i = 0; i < count; i++)
+         fn(i);
+      return;
+   }
+
+   std::atomic<size_t> next(0);
+
+   auto worker = [&] ()
+   {
+      size_t i;
+      while((i = next.fetch_add(1)) < count)
+         fn(i);
+   };
+
+   PODCollection<std::thread *> helpers;
+   for(size_t t = 1; t < numThreads; t++)
+      helpers.add(new std::thread(worker));
+
+   worker();
+
+   for(std::thread *thread : helpers)
+   {
+      thread->join();
+      delete thread;
+   }
+}
+
+//=============================================================================
+//
+// TaskGraph
+//
+
+//
+// TaskGraph::addTask
+//
+// Add a new task to the graph and return its index. onDone, if provided, is
+// called after func returns; the scheduler never runs two onDone callbacks
+// at the same time, so they may safely touch shared output structures.
+//
+int TaskGraph::addTask(const char *name, taskfunc_t func, taskfunc_t onDone)
+{
+   task_t task;
+
+   task.name    = name;
+   task.func    = func;
+   task.onDone  = onDone;
+   task.numDeps = 0;
+
+   tasks.add(task);
+
+   return static_cast<int>(tasks.getLength() - 1);
+}
+
+//
+// TaskGraph::addDependency
+//
+// Do not allow "task" to start until "dependsOn" has completed. Tasks may
+// only depend on tasks added before them, which rules out cycles.
+//
+void TaskGraph::addDependency(int task, int dependsOn)
+{
+   if(task < 0 || task >= static_cast<int>(tasks.getLength()) ||
+      dependsOn < 0 || dependsOn >= task)
+   {
+      I_Error("TaskGraph::addDependency: invalid dependency %d -> %d\n",
+              task, dependsOn);
+   }
+
+   tasks[dependsOn].dependents.add(task);
+   tasks[task].numDeps++;
+}
+
+//
+// TaskGraph::run
+//
+// Execute all tasks using up to numThreads threads, including the calling
+// thread. Ready tasks are always started lowest index first, so a serial
+// run matches the order in which the tasks were added.
+//
+void TaskGraph::run(int numThreads)
+{
+   std::mutex              lock;
+   std::mutex              doneLock;
+   std::condition_variable ready;
+   PODCollection<bool>     runnable;
+   size_t                  numTasks  = tasks.getLength();
+   size_t                  remaining = numTasks;
+   size_t                  scanStart = 0;
+
+   if(!numTasks)
+      return;
+
+   runnable.resize(numTasks);
+   for(size_t i = 0; i < numTasks; i++)
+      runnable[i] = (tasks[i].numDeps == 0);
+
+   auto worker = [&] ()
+   {
+      std::unique_lock<std::mutex> guard(lock);
+
+      for(;;)
+      {
+         // find the lowest-numbered runnable task
+         size_t t = numTasks;
+         for(size_t i = scanStart; i < numTasks; i++)
+         {
+            if(runnable[i])
+            {
+               t = i;
+               break;
+            }
+         }
+
+         if(t == numTasks)
+         {
+            if(!remaining)
+               break;
+            ready.wait(guard);
+            continue;
+         }
+
+         runnable[t] = false;
+         while(scanStart < numTasks && !runnable[scanStart] &&
+               tasks[scanStart].numDeps <= 0)
+            ++scanStart;
+
+         guard.unlock();
+
+         task_t &task = tasks[t];
+         task.func();
+
+         if(task.onDone)
+         {
+            std::lock_guard<std::mutex> doneGuard(doneLock);
+            task.onDone();
+         }
+
+         guard.lock();
+
+         // release dependents
+         task.numDeps = -1; // finished
+         for(int dep : task.dependents)
+         {
+            if(--tasks[dep].numDeps == 0)
+               runnable[dep] = true;
+         }
+
+         if(!--remaining)
+         {
+            ready.notify_all();
+            break;
+         }
+         ready.notify_all();
+      }
+   };
+
+   if(numThreads > static_cast<int>(numTasks))
+      numThreads = static_cast<int>(numTasks);
+
+   PODCollection<std::thread *> helpers;
+   for(int i = 1; i < numThreads; i++)
+      helpers.add(new std::thread(worker));
+
+   worker();
+
+   for(std::thread *thread : helpers)
+   {
+      thread->join();
+      delete thread;
+   }
+}
+
+// EOF
+
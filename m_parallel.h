@@ -0,0 +1,78 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//   Worker threads and dependency-aware task scheduling.
+//
+//-----------------------------------------------------------------------------
+
+#ifndef M_PARALLEL_H__
+#define M_PARALLEL_H__
+
+#include <functional>
+
+#include "m_collection.h"
+
+// Number of threads work may be spread across (set by -jobs; 1 == serial)
+int  M_GetNumJobs();
+void M_SetNumJobs(int jobs);
+
+// Run fn(i) for every i in [0, count), spread across up to M_GetNumJobs()
+// threads. The calling thread takes part, so this is safe to call from code
+// which is itself running on a worker thread. Returns once every call is done.
+void M_ParallelFor(size_t count, const std::function<void (size_t)> &fn);
+
+//
+// TaskGraph
+//
+// A small scheduler for coarse-grained jobs with dependencies. Tasks are run
+// exactly once each, never before every task they depend upon has finished.
+// When run with a single thread, tasks execute in the order they were added.
+//
+class TaskGraph
+{
+public:
+   typedef std::function<void ()> taskfunc_t;
+
+protected:
+   struct task_t
+   {
+      const char *name;      // name, for diagnostics
+      taskfunc_t  func;      // work to perform
+      taskfunc_t  onDone;    // optional callback run after func, serialized
+      PODCollection<int> dependents; // tasks waiting on this one
+      int         numDeps;   // number of unfinished dependencies
+   };
+
+   Collection<task_t> tasks;
+
+public:
+   TaskGraph() : tasks() {}
+
+   int  addTask(const char *name, taskfunc_t func, taskfunc_t onDone = nullptr);
+   void addDependency(int task, int dependsOn);
+   void run(int numThreads);
+};
+
+#endif
+
+// EOF
+
@@ -27,12 +27,15 @@
 #include "z_zone.h"
 
 #include "d_scripts.h"
+#include "d_verify.h"
 #include "d_wads.h"
 #include "i_system.h"
 #include "m_argv.h"
+#include "m_parallel.h"
 #include "m_qstr.h"
 #include "main.h"
 #include "s_sfxgen.h"
+#include "v_loading.h"
 #include "v_psx.h"
 #include "w_formats.h"
 #include "zip_write.h"
@@ -60,6 +63,12 @@ ziparchive_t gZipArchive; // zip file (ie. pke archive)
 static qstring baseinputdir; // root input directory; ex: J:\PSXDOOM
 static qstring outputname;   // name of output file
 static qstring resourcedir;  // directory with resources to inject as lumps
+static bool    streamoutput; // if true, write output entries as they're made
+static bool    updateoutput; // if true, reuse entries from the old output
+static bool    pipeoutput;   // if true, output goes to stdout
+static qstring tunefile;     // settings saved by -autotune
+static bool    autotune;     // if true, find the best settings for each entry
+static bool    verifyoutput; // if true, check the output once it is written
 
 //
 // D_ExtractMovie
@@ -128,6 +137,8 @@ static const char *usagestr =
 "-input <dirpath> [-output <filename>]\n"
 "  Generates a psxdoom.wad or psxdoom.pke output file, given the path to the\n"
 "  PSXDOOM directory on a disc or mounted disc image of PlayStation DOOM.\n"
+"  A filename of - writes the archive to stdout, for piping into another\n"
+"  program; messages then go to stderr.\n"
 "\n"
 "-sfxfmt <format>\n"
 "  Set the sound effect output format:\n"
@@ -143,7 +154,68 @@ static const char *usagestr =
 "  Write out vanilla-compatible WAD files containing each map.\n"
 "\n"
 "-res <directory>\n"
-"  Sets the external resource directory.\n";
+"  Sets the external resource directory.\n"
+"\n"
+"-jobs <count>\n"
+"  Run independent conversion steps on up to <count> threads at once. Use 0\n"
+"  to run one thread per processor. Default is 1. Output is identical\n"
+"  regardless of this setting.\n"
+"\n"
+"-fast | -store\n"
+"  Compress output quickly rather than as well as possible, or don't compress\n"
+"  it at all. Useful when the output is only needed for testing.\n"
+"\n"
+"-ultra\n"
+"  Compress as hard as possible, for release builds. Much slower; reports how\n"
+"  much smaller the output came out than with zlib's best setting.\n"
+"\n"
+"-autotune\n"
+"  Try several compression settings on every entry and keep the smallest\n"
+"  result. A table of the settings which did best for each kind of entry is\n"
+"  printed at the end, and saved to the -tunefile if one is given.\n"
+"\n"
+"-tunefile <file>\n"
+"  Compress each kind of entry with the settings saved in <file> by an\n"
+"  earlier -autotune run.\n"
+"\n"
+"-complevel <0-9>\n"
+"  Use the given zlib compression level for every compressed entry. 0 stores\n"
+"  entries instead.\n"
+"\n"
+"-fusedcrc\n"
+"  Calculate the checksum of each compressed entry while it is being\n"
+"  compressed, rather than in a separate pass over its data.\n"
+"\n"
+"-stream\n"
+"  Write each entry to the output file as soon as it has been converted,\n"
+"  instead of holding everything in memory until the end. Conversion steps\n"
+"  which produce output will then run one at a time.\n"
+"\n"
+"-pwrite [-pwriteorder]\n"
+"  When compressing on more than one thread, let each thread write entries\n"
+"  into the output file as soon as they are ready, rather than writing them\n"
+"  all in order from one thread. Entries will then be laid out in the file\n"
+"  in whatever order they finish, unless -pwriteorder is also given.\n"
+"\n"
+"-align <bytes>\n"
+"  Align the data of uncompressed entries to a multiple of the given power of\n"
+"  two within the output file, so that it can be memory-mapped, and leave\n"
+"  flats and PLAYPAL uncompressed. 4096 suits most platforms.\n"
+"\n"
+"-update\n"
+"  Reuse compressed entries from an existing output file wherever the data\n"
+"  has not changed, instead of compressing everything again. The existing\n"
+"  file is only replaced once the new one has been completely written.\n"
+"\n"
+"-cachedir <directory>\n"
+"  Save tables worked out from the game's palettes, such as COLORMAP, in an\n"
+"  existing directory, and load them from there on later runs over a disc\n"
+"  with the same palettes instead of working them out again.\n"
+"\n"
+"-verify\n"
+"  Read the output file back once it has been written, checking every entry\n"
+"  against its checksum and every graphic for well-formed patch data.\n"
+"  Reports the first bad entry found, if any.\n";
 
 //
 // D_PrintUsage
@@ -201,6 +273,77 @@ static void D_CheckForParameters()
          s_sfxfmt = SFX_FMT_WAV;
    }
 
+   // compression policy
+   if(M_CheckParm("-fast"))
+      Zip_SetCompressMode(ZIP_COMPRESS_FAST);
+   if(M_CheckParm("-store"))
+      Zip_SetCompressMode(ZIP_COMPRESS_STORE);
+   if(M_CheckParm("-ultra"))
+      Zip_SetCompressMode(ZIP_COMPRESS_ULTRA);
+   if((p = M_CheckParm("-complevel")) && p < myargc - 1)
+      Zip_SetCompressLevel(atoi(myargv[p + 1]));
+
+   // compression settings tuned for the data
+   if((p = M_CheckParm("-tunefile")) && p < myargc - 1)
+   {
+      tunefile = myargv[p + 1];
+      Zip_LoadTuning(tunefile.constPtr());
+   }
+   if(M_CheckParm("-autotune"))
+   {
+      autotune = true;
+      Zip_SetAutotune(true);
+   }
+
+   // checksum during compression
+   if(M_CheckParm("-fusedcrc"))
+      Zip_SetFusedCRC(true);
+
+   // write output while converting
+   if(M_CheckParm("-stream"))
+      streamoutput = true;
+
+   // write entries out of order
+   if(M_CheckParm("-pwrite"))
+   {
+      if(M_CheckParm("-pwriteorder"))
+         Zip_SetWriteMode(ZIP_WRITE_POSITIONAL_ORDERED);
+      else
+         Zip_SetWriteMode(ZIP_WRITE_POSITIONAL);
+   }
+
+   // aligned stored entries
+   if((p = M_CheckParm("-align")) && p < myargc - 1)
+      Zip_SetAlignment(atoi(myargv[p + 1]));
+
+   // rebuild over previous output
+   if(M_CheckParm("-update"))
+      updateoutput = true;
+
+   // check the output afterward
+   if(M_CheckParm("-verify"))
+      verifyoutput = true;
+
+   // nothing can be seeked to or read back in a pipe
+   if(pipeoutput)
+   {
+      if(M_CheckParm("-pwrite"))
+         I_Error("D_CheckForParameters: -pwrite cannot write to stdout\n");
+      if(updateoutput)
+         I_Error("D_CheckForParameters: -update cannot write to stdout\n");
+      if(verifyoutput)
+         I_Error("D_CheckForParameters: -verify cannot write to stdout\n");
+      Zip_SetDataDescriptors(true);
+   }
+
+   // derived table cache
+   if((p = M_CheckParm("-cachedir")) && p < myargc - 1)
+      V_SetTableCacheDir(myargv[p + 1]);
+
+   // number of worker threads
+   if((p = M_CheckParm("-jobs")) && p < myargc - 1)
+      M_SetNumJobs(atoi(myargv[p + 1]));
+
    // set resource directory
    D_setResourceDir();
 }
@@ -234,18 +377,6 @@ static void D_Init()
    // Load PSX wad files from input directory
    printf("D_LoadInputFiles: Loading PSX wad files...\n");
    D_LoadInputFiles(baseinputdir);
-
-   // Load PLAYPAL
-   printf("V_LoadPLAYPAL: Decompressing palettes.\n");
-   V_LoadPLAYPAL(psxIWAD);
-
-   // Generate COLORMAP from palette 0
-   printf("V_GenerateCOLORMAP: Generating colormap data.\n");
-   V_GenerateCOLORMAP();
-
-   // Load LIGHTS
-   printf("V_LoadLIGHTS: Converting LIGHTS to palette.\n");
-   V_LoadLIGHTS(psxIWAD);
 }
 
 //
@@ -263,7 +394,12 @@ static void D_OpenOutputFile()
    switch(gOutputFormat)
    {
    case W_FORMAT_ZIP:
-      Zip_Create(&gZipArchive, outputname.constPtr());
+      if(updateoutput && Zip_SetUpdateSource(outputname.constPtr()))
+         printf("D_OpenOutputFile: updating existing output file\n");
+      if(streamoutput)
+         Zip_CreateStream(&gZipArchive, outputname.constPtr());
+      else
+         Zip_Create(&gZipArchive, outputname.constPtr());
       break;
    default:
       I_Error("D_OpenOutputFile: unsupported output format value %d\n", 
@@ -274,6 +410,82 @@ static void D_OpenOutputFile()
    printf("D_OpenOutputFile: output directed to %s\n", outputname.constPtr());
 }
 
+//
+// Zip Transformation Stages
+//
+// Each stage that produces output gathers its entries into a private archive,
+// so that stages may run at the same time. The archives are spliced onto
+// gZipArchive strictly in this order, which keeps the output identical no
+// matter how the stages were actually scheduled.
+//
+// When the output is being streamed, holding entries back would defeat the
+// purpose, so instead the output stages write straight into gZipArchive and
+// are made to run one after another in this order.
+//
+enum zipstage_e
+{
+   ZSTAGE_SOUNDS,
+   ZSTAGE_SPRITES,
+   ZSTAGE_TEXTURES,
+   ZSTAGE_FLATS,
+   ZSTAGE_GRAPHICS,
+   ZSTAGE_PLAYPAL,
+   ZSTAGE_COLORMAP,
+   ZSTAGE_LIGHTS,
+   ZSTAGE_MAPS,
+   ZSTAGE_SCRIPTS,
+   ZSTAGE_NUMSTAGES
+};
+
+static ziparchive_t stageArchives[ZSTAGE_NUMSTAGES];
+static bool         stageDone[ZSTAGE_NUMSTAGES];
+static int          nextStage;
+static int          lastStageTask = -1;
+
+//
+// D_commitZipStage
+//
+// Called when a stage has finished. Any completed stages at the head of the
+// order are moved into the output archive. The task scheduler never runs two
+// of these at once.
+//
+static void D_commitZipStage(int stage)
+{
+   stageDone[stage] = true;
+
+   while(nextStage < ZSTAGE_NUMSTAGES && stageDone[nextStage])
+   {
+      Zip_AppendArchive(&gZipArchive, &stageArchives[nextStage]);
+      ++nextStage;
+   }
+}
+
+//
+// D_addZipStage
+//
+// Add an output stage to the task graph.
+//
+static int D_addZipStage(TaskGraph &graph, const char *name, zipstage_e stage,
+                         std::function<void (ziparchive_t *)> func)
+{
+   if(gZipArchive.stream)
+   {
+      int task = graph.addTask(name, [func] () { func(&gZipArchive); });
+
+      if(lastStageTask >= 0)
+         graph.addDependency(task, lastStageTask);
+
+      return (lastStageTask = task);
+   }
+
+   ziparchive_t *zip = &stageArchives[stage];
+
+   Zip_Create(zip, gZipArchive.filename);
+
+   return graph.addTask(name, [func, zip] () { func(zip); },
+                        [stage] () { D_commitZipStage(stage); });
+}
+
 //
 // D_TransformToZip
 //
@@ -281,31 +493,101 @@ static void D_OpenOutputFile()
 //
 static void D_TransformToZip()
 {
+   TaskGraph graph;
+
+   // progress bars from simultaneous stages would be garbled together
+   if(M_GetNumJobs() > 1)
+      V_SetLoadingQuiet(true);
+
+   // Load PLAYPAL
+   int loadPal = graph.addTask("V_LoadPLAYPAL", [] () {
+      printf("V_LoadPLAYPAL: Decompressing palettes.\n");
+      V_LoadPLAYPAL(psxIWAD);
+   });
+
+   // Tables derived from the palette may have been saved by an earlier run
+   int loadCache = graph.addTask("V_LoadTableCache", [] () {
+      V_LoadTableCache();
+   });
+   graph.addDependency(loadCache, loadPal);
+
+   // Generate COLORMAP from palette 0
+   int genColormap = graph.addTask("V_GenerateCOLORMAP", [] () {
+      printf("V_GenerateCOLORMAP: Generating colormap data.\n");
+      V_GenerateCOLORMAP();
+   });
+   graph.addDependency(genColormap, loadCache);
+
+   // Load LIGHTS
+   int loadLights = graph.addTask("V_LoadLIGHTS", [] () {
+      printf("V_LoadLIGHTS: Converting LIGHTS to palette.\n");
+      V_LoadLIGHTS(psxIWAD);
+   });
+
+   // Translucency tables for 4:3 scaling
+   int tranMaps = graph.addTask("V_InitTranMaps", [] () {
+      V_InitTranMaps();
+   });
+   graph.addDependency(tranMaps, loadCache);
+
+   // Save the derived tables for later runs
+   int saveCache = graph.addTask("V_SaveTableCache", [] () {
+      V_SaveTableCache();
+   });
+   graph.addDependency(saveCache, genColormap);
+   graph.addDependency(saveCache, tranMaps);
+
    // sounds
-   S_ProcessSoundsForZip(baseinputdir, &gZipArchive);
+   D_addZipStage(graph, "sounds", ZSTAGE_SOUNDS, [] (ziparchive_t *zip) {
+      S_ProcessSoundsForZip(baseinputdir, zip);
+   });
 
    // sprites
-   V_ConvertSpritesToZip(psxIWAD, &gZipArchive);
+   int sprites = D_addZipStage(graph, "sprites", ZSTAGE_SPRITES, 
+      [] (ziparchive_t *zip) { V_ConvertSpritesToZip(psxIWAD, zip); });
+   graph.addDependency(sprites, tranMaps);
 
    // textures
-   V_ConvertTexturesToZip(psxIWAD, &gZipArchive);
+   int textures = D_addZipStage(graph, "textures", ZSTAGE_TEXTURES, 
+      [] (ziparchive_t *zip) { V_ConvertTexturesToZip(psxIWAD, zip); });
+   graph.addDependency(textures, tranMaps);
 
    // flats
-   V_ConvertFlatsToZip(psxIWAD, &gZipArchive);
+   int flats = D_addZipStage(graph, "flats", ZSTAGE_FLATS,
+      [] (ziparchive_t *zip) { V_ConvertFlatsToZip(psxIWAD, zip); });
+   graph.addDependency(flats, tranMaps);
 
    // graphics
-   V_ConvertGraphicsToZip(psxIWAD, &gZipArchive);
+   int graphics = D_addZipStage(graph, "graphics", ZSTAGE_GRAPHICS,
+      [] (ziparchive_t *zip) { V_ConvertGraphicsToZip(psxIWAD, zip); });
+   graph.addDependency(graphics, tranMaps);
 
    // palettes and color lumps
-   V_ConvertPLAYPALToZip(&gZipArchive);
-   V_ConvertCOLORMAPToZip(&gZipArchive);
-   V_ConvertLIGHTSToZip(&gZipArchive);
+   int outPal = D_addZipStage(graph, "PLAYPAL", ZSTAGE_PLAYPAL, 
+      [] (ziparchive_t *zip) { V_ConvertPLAYPALToZip(zip); });
+   graph.addDependency(outPal, loadPal);
+
+   int outColormap = D_addZipStage(graph, "COLORMAP", ZSTAGE_COLORMAP,
+      [] (ziparchive_t *zip) { V_ConvertCOLORMAPToZip(zip); });
+   graph.addDependency(outColormap, genColormap);
+
+   int outLights = D_addZipStage(graph, "LIGHTS", ZSTAGE_LIGHTS,
+      [] (ziparchive_t *zip) { V_ConvertLIGHTSToZip(zip); });
+   graph.addDependency(outLights, loadLights);
 
    // maps
-   D_AddMapsToZip(&gZipArchive, baseinputdir);
+   D_addZipStage(graph, "maps", ZSTAGE_MAPS, [] (ziparchive_t *zip) {
+      D_AddMapsToZip(zip, baseinputdir);
+   });
 
    // scripts
-   D_ProcessScriptsForZip(&gZipArchive);
+   D_addZipStage(graph, "scripts", ZSTAGE_SCRIPTS, [] (ziparchive_t *zip) {
+      D_ProcessScriptsForZip(zip);
+   });
+
+   graph.run(M_GetNumJobs());
+
+   V_SetLoadingQuiet(false);
 }
 
 //
@@ -338,12 +620,60 @@ static void D_CloseOutputFile()
       printf("Writing output... ");
       Zip_Write(&gZipArchive);
       printf("\nSuccessfully created output file '%s'\n", gZipArchive.filename);
+      Zip_PrintStats();
+      if(autotune && !tunefile.empty())
+      {
+         if(Zip_SaveTuning(tunefile.constPtr()))
+            printf("Saved tuning to '%s'\n", tunefile.constPtr());
+      }
+      break;
+   default:
+      break;
+   }
+}
+
+//
+// D_VerifyOutput
+//
+// Read back the finished output file if asked to, and make sure it is sound.
+//
+static void D_VerifyOutput()
+{
+   if(!verifyoutput)
+      return;
+
+   switch(gOutputFormat)
+   {
+   case W_FORMAT_ZIP:
+      if(!D_VerifyArchive(outputname.constPtr()))
+         I_Error("D_VerifyOutput: output file '%s' is bad\n", outputname.constPtr());
       break;
    default:
       break;
    }
 }
 
+//
+// D_CheckPipeOutput
+//
+// "-output -" sends the archive to stdout, so it can be piped straight into
+// another program. Console output has to be moved out of its way before
+// anything at all is printed.
+//
+static void D_CheckPipeOutput()
+{
+   int p;
+
+   if(!(p = M_CheckParm("-output")) || p >= myargc - 1 || 
+      strcmp(myargv[p + 1], "-"))
+      return;
+
+   if(!I_ClaimStdout())
+      I_Error("D_CheckPipeOutput: cannot redirect stdout\n");
+
+   pipeoutput = true;
+}
+
 //
 // Main Program
 //
@@ -353,6 +683,9 @@ int main(int argc, char **argv)
    myargc = argc;
    myargv = argv;
 
+   // must come before any output
+   D_CheckPipeOutput();
+
    // perform initialization
    D_Init();
 
@@ -365,6 +698,9 @@ int main(int argc, char **argv)
    // close output
    D_CloseOutputFile();
 
+   // check output
+   D_VerifyOutput();
+
    return 0;
 }
 
@@ -98,9 +98,6 @@ struct sfx_t
 {
    u8            *data;  // the actual contents of entry
    unsigned int   len;   // length of data
-   u8            *pcm;   // rendered PCM data
-   unsigned int   nsamp; // length of PCM data in samples
-   size_t         total; // total size of PCM data
 };
 
 static sfx_t sfx[256];
@@ -120,96 +117,93 @@ const static int f[5][2] =
 //
 // S_renderPCMDMX
 //
-// Decompress PlayStation ADPCM to DMX PCM format 0x03.
+// Decompress a sound's PlayStation ADPCM to DMX PCM format 0x03, returning a
+// new buffer of total bytes.
 //
-static void S_renderPCMDMX()
+static u8 *S_renderPCMDMX(const sfx_t &snd, size_t &total)
 {
    s16 s_1, s_2;
 
-   for(int i = 0; i < 256; i++)
-   {
-      if(!sfx[i].data || !sfx[i].len)
-         continue;
+   // each block of 16 bytes gives 28 samples of output data.
+   unsigned int nsamp = snd.len / 16 * 28;
 
-      // each block of 16 bytes gives 28 samples of output data.
-      sfx[i].nsamp = sfx[i].len / 16 * 28;
+   // we'll make single channel u8 pcm data
+   total   = 8 + 32 + nsamp;
+   u8 *pcm = ecalloc(u8 *, 1, total);
 
-      // we'll make single channel u8 pcm data
-      sfx[i].total = 8 + 32 + sfx[i].nsamp;
-      sfx[i].pcm = ecalloc(u8 *, 1, sfx[i].total);
+   // haleyjd: write in DMX header
+   pcm[0] = 0x03; // format 0x03
+   pcm[2] = 0x11; // sample rate 11025 Hz
+   pcm[3] = 0x2B;
+   
+   // number of samples + pad bytes
+   uint32_t paddedlen = nsamp + 32;
+   pcm[4] = (u8)((paddedlen >>  0) & 0xff);
+   pcm[5] = (u8)((paddedlen >>  8) & 0xff);
+   pcm[6] = (u8)((paddedlen >> 16) & 0xff);
+   pcm[7] = (u8)((paddedlen >> 24) & 0xff);
 
-      // haleyjd: write in DMX header
-      sfx[i].pcm[0] = 0x03; // format 0x03
-      sfx[i].pcm[2] = 0x11; // sample rate 11025 Hz
-      sfx[i].pcm[3] = 0x2B;
-      
-      // number of samples + pad bytes
-      uint32_t paddedlen = sfx[i].nsamp + 32;
-      sfx[i].pcm[4] = (u8)((paddedlen >>  0) & 0xff);
-      sfx[i].pcm[5] = (u8)((paddedlen >>  8) & 0xff);
-      sfx[i].pcm[6] = (u8)((paddedlen >> 16) & 0xff);
-      sfx[i].pcm[7] = (u8)((paddedlen >> 24) & 0xff);
+   // set predictor values
+   s_1 = 0;
+   s_2 = 0;
 
-      // set predictor values
-      s_1 = 0;
-      s_2 = 0;
+   u8 *pos;
+   u8 *outpos = pcm + 24;
 
-      u8 *pos;
-      u8 *outpos = sfx[i].pcm + 24;
+   for(pos = snd.data; pos < snd.data + snd.len; pos += 16)
+   {
+      // first byte of data: two nibbles, predict weight and shift factor
+      int predict_weight = pos[0] >> 4;
+      int shift_factor   = pos[0] & 15;
 
-      for(pos = sfx[i].data; pos < sfx[i].data + sfx[i].len; pos += 16)
-      {
-         // first byte of data: two nibbles, predict weight and shift factor
-         int predict_weight = pos[0] >> 4;
-         int shift_factor   = pos[0] & 15;
+      // second byte of data is flags, we use those elsewhere
+      // 4: set loop start point
+      // 1: stop (2 = halt, not 2 = loop)
 
-         // second byte of data is flags, we use those elsewhere
-         // 4: set loop start point
-         // 1: stop (2 = halt, not 2 = loop)
+      // remaining bytes are dpcm values for 28 samples in nibbles
 
-         // remaining bytes are dpcm values for 28 samples in nibbles
+      for(int j = 2; j < 16; j++)
+      {
+         s32 samp = pos[j] & 15; // low nibble
 
-         for(int j = 2; j < 16; j++)
+         for(int k = 0; k < 2; k++)
          {
-            s32 samp = pos[j] & 15; // low nibble
-
-            for(int k = 0; k < 2; k++)
-            {
-               samp <<= 12; // convert to 16.16
+            samp <<= 12; // convert to 16.16
 
-               if(samp & 0x8000) 
-                  samp |= 0xffff0000; // sign extend
+            if(samp & 0x8000) 
+               samp |= 0xffff0000; // sign extend
 
-               samp >>= shift_factor; // apply shift
+            samp >>= shift_factor; // apply shift
 
-               samp += s_1 * f[predict_weight][0] >> 6;
-               samp += s_2 * f[predict_weight][1] >> 6; // add weighted previous two samples
+            samp += s_1 * f[predict_weight][0] >> 6;
+            samp += s_2 * f[predict_weight][1] >> 6; // add weighted previous two samples
 
-               // clip
-               if(samp > 32767)
-                  samp = 32767;
-               else if(samp < -32768)
-                  samp = -32768;
+            // clip
+            if(samp > 32767)
+               samp = 32767;
+            else if(samp < -32768)
+               samp = -32768;
 
-               s_2 = s_1;
-               s_1 = (s16)samp; // shift time fowards 1 sample
-               
-               // haleyjd: transform to unsigned 8-bit vanilla format
-               *outpos++ = (u8)((samp + 32768) >> 8);
+            s_2 = s_1;
+            s_1 = (s16)samp; // shift time fowards 1 sample
+            
+            // haleyjd: transform to unsigned 8-bit vanilla format
+            *outpos++ = (u8)((samp + 32768) >> 8);
 
-               // second iteration: high nibble
-               samp = pos[j] >> 4;
-            }
+            // second iteration: high nibble
+            samp = pos[j] >> 4;
          }
       }
+   }
 
-      // go back in and populate the DMX padding bytes on either side of the samples
-      u8 fs = sfx[i].pcm[24];
-      u8 ls = sfx[i].pcm[24+sfx[i].nsamp-1];
+   // go back in and populate the DMX padding bytes on either side of the samples
+   u8 fs = pcm[24];
+   u8 ls = pcm[24+nsamp-1];
 
-      memset(sfx[i].pcm + 8, fs, 16);
-      memset(sfx[i].pcm + 24 + sfx[i].nsamp, ls, 16);
-   }
+   memset(pcm + 8, fs, 16);
+   memset(pcm + 24 + nsamp, ls, 16);
+
+   return pcm;
 }
 
 #define putshort(b, s) \
@@ -258,76 +252,73 @@ static s16 *S_putWAVEHeader(u8 *buffer, unsigned int nsamp)
 //
 // S_renderPCMWAV
 //
-// Decompress PlayStation ADPCM to Microsoft WAVE-format PCM.
+// Decompress a sound's PlayStation ADPCM to Microsoft WAVE-format PCM,
+// returning a new buffer of total bytes.
 //
-static void S_renderPCMWAV()
+static u8 *S_renderPCMWAV(const sfx_t &snd, size_t &total)
 {
    s16 s_1, s_2;
 
-   for(int i = 0; i < 256; i++)
-   {
-      if(!sfx[i].data || !sfx[i].len)
-         continue;
+   // each block of 16 bytes gives 28 samples of output data.
+   unsigned int nsamp = snd.len / 16 * 28;
 
-      // each block of 16 bytes gives 28 samples of output data.
-      sfx[i].nsamp = sfx[i].len / 16 * 28;
+   // we'll make single channel s16 pcm data
+   total   = 44 + sizeof(s16) * nsamp;
+   u8 *pcm = ecalloc(u8 *, 1, total);
 
-      // we'll make single channel s16 pcm data
-      sfx[i].total = 44 + sizeof(s16) * sfx[i].nsamp;
-      sfx[i].pcm   = ecalloc(u8 *, 1, sfx[i].total);
+   s16 *outpos = S_putWAVEHeader(pcm, nsamp);
 
-      s16 *outpos = S_putWAVEHeader(sfx[i].pcm, sfx[i].nsamp);
+   // set predictor values
+   s_1 = 0;
+   s_2 = 0;
 
-      // set predictor values
-      s_1 = 0;
-      s_2 = 0;
+   u8 *pos;
 
-      u8 *pos;
+   for(pos = snd.data; pos < snd.data + snd.len; pos += 16)
+   {
+      // first byte of data: two nibbles, predict weight and shift factor
+      int predict_weight = pos[0] >> 4;
+      int shift_factor   = pos[0] & 15;
 
-      for(pos = sfx[i].data; pos < sfx[i].data + sfx[i].len; pos += 16)
-      {
-         // first byte of data: two nibbles, predict weight and shift factor
-         int predict_weight = pos[0] >> 4;
-         int shift_factor   = pos[0] & 15;
+      // second byte of data is flags, we use those elsewhere
+      // 4: set loop start point
+      // 1: stop (2 = halt, not 2 = loop)
 
-         // second byte of data is flags, we use those elsewhere
-         // 4: set loop start point
-         // 1: stop (2 = halt, not 2 = loop)
+      // remaining bytes are dpcm values for 28 samples in nibbles
 
-         // remaining bytes are dpcm values for 28 samples in nibbles
+      for(int j = 2; j < 16; j++)
+      {
+         s32 samp = pos[j] & 15; // low nibble
 
-         for(int j = 2; j < 16; j++)
+         for(int k = 0; k < 2; k++)
          {
-            s32 samp = pos[j] & 15; // low nibble
+            samp <<= 12; // convert to 16.16
 
-            for(int k = 0; k < 2; k++)
-            {
-               samp <<= 12; // convert to 16.16
+            if(samp & 0x8000) 
+               samp |= 0xffff0000; // sign extend
 
-               if(samp & 0x8000) 
-                  samp |= 0xffff0000; // sign extend
+            samp >>= shift_factor; // apply shift
 
-               samp >>= shift_factor; // apply shift
+            samp += s_1 * f[predict_weight][0] >> 6;
+            samp += s_2 * f[predict_weight][1] >> 6; // add weighted previous two samples
 
-               samp += s_1 * f[predict_weight][0] >> 6;
-               samp += s_2 * f[predict_weight][1] >> 6; // add weighted previous two samples
+            // clip
+            if(samp > 32767)
+               samp = 32767;
+            else if(samp < -32768)
+               samp = -32768;
 
-               // clip
-               if(samp > 32767)
-                  samp = 32767;
-               else if(samp < -32768)
-                  samp = -32768;
+            s_2 = s_1;
+            s_1 = (s16)samp; // shift time fowards 1 sample
+            *outpos++ = (s16)samp;
 
-               s_2 = s_1;
-               s_1 = (s16)samp; // shift time fowards 1 sample
-               *outpos++ = (s16)samp;
-
-               // second iteration: high nibble
-               samp = pos[j] >> 4;
-            }
+            // second iteration: high nibble
+            samp = pos[j] >> 4;
          }
       }
    }
+
+   return pcm;
 }
 
 //
@@ -541,29 +532,42 @@ static void S_openAllMapLCDs(const qstring &inpath)
 //
 // S_loadSounds
 //
-// Load all sounds from LCD files and then convert them to PCM data.
+// Load all sounds from LCD files. They are only converted to PCM data as each
+// one is needed.
 //
 static void S_loadSounds(const qstring &inpath)
 {
+   if(s_sfxfmt != SFX_FMT_DMX && s_sfxfmt != SFX_FMT_WAV)
+      I_Error("S_loadSounds: unknown sound output format %d\n", s_sfxfmt);
+
    // Load LCDs
    printf("S_LoadSounds: Loading LCD files:");
    V_SetLoading(61, true);
    S_openMainLCD(inpath);
    S_openAllMapLCDs(inpath);
 
-   // Render PCM
-   printf("S_RenderPCM: Decoding ADPCM data\n");
-   switch(s_sfxfmt)
-   {
-   case SFX_FMT_DMX:
-      S_renderPCMDMX();
-      break;
-   case SFX_FMT_WAV:
-      S_renderPCMWAV();
-      break;
-   default:
-      I_Error("S_loadSounds: unknown sound output format %d\n", s_sfxfmt);
-   }
+   printf("S_LoadSounds: ADPCM data will be decoded as it is written\n");
+}
+
+//
+// S_renderSound
+//
+// Decode one loaded sound to PCM data in the chosen output format, returning
+// a new buffer of len bytes. This only reads the sound's ADPCM data, so any
+// number of sounds may be rendered on different threads at once.
+//
+static byte *S_renderSound(int id, uint32_t &len)
+{
+   size_t total;
+   u8    *pcm;
+
+   if(s_sfxfmt == SFX_FMT_WAV)
+      pcm = S_renderPCMWAV(sfx[id], total);
+   else
+      pcm = S_renderPCMDMX(sfx[id], total);
+
+   len = static_cast<uint32_t>(total);
+   return pcm;
 }
 
 //=============================================================================
@@ -575,26 +579,30 @@ static void S_loadSounds(const qstring &inpath)
 // S_ProcessSoundsForZip
 //
 // Read in all the sound data and then output file entries to the zip archive.
+// Each sound's ADPCM data is only decoded once the archive is ready to write
+// it out.
 //
 void S_ProcessSoundsForZip(const qstring &inpath, ziparchive_t *zip)
 {
-   // load sounds from all of the LCD files and decode the ADPCM data
+   // load sounds from all of the LCD files
    S_loadSounds(inpath);
 
    Zip_AddFile(zip, "sounds/", NULL, 0, ZIP_DIRECTORY, false);
 
    for(int i = 0; i < NUMPSXSFX; i++)
    {
-      auto &sfxinfo = psxsfxinfo[i];
-      auto &snd     = sfx[sfxinfo.sfxID];
+      int     id = psxsfxinfo[i].sfxID;
       qstring name;
 
-      if(!snd.pcm || !snd.total)
+      if(!sfx[id].data || !sfx[id].len)
          continue;
 
-      name << "sounds/" << sfxinfo.name;
+      name << "sounds/" << psxsfxinfo[i].name;
 
-      Zip_AddFile(zip, name.constPtr(), snd.pcm, snd.total, ZIP_FILE_BINARY, true);
+      Zip_AddFile(zip, name.constPtr(), [id] (uint32_t &len)
+      {
+         return S_renderSound(id, len);
+      }, true);
    }
 }
 
@@ -622,14 +630,16 @@ void S_UnitTest1(const qstring &inpath)
 
    for(int i = 0; i < 256; i++)
    {
-      qstring name;
+      qstring  name;
+      uint32_t len;
 
-      if(!sfx[i].pcm || !sfx[i].total)
+      if(!sfx[i].data || !sfx[i].len)
          continue;
 
       name << "sounds/psxsnd" << i << ".lmp";
 
-      Zip_AddFile(&zip, name.constPtr(), sfx[i].pcm, sfx[i].total, ZIP_FILE_BINARY, true);
+      byte *pcm = S_renderSound(i, len);
+      Zip_AddFile(&zip, name.constPtr(), pcm, len, ZIP_FILE_BINARY, true, true);
    }
 
    Zip_Write(&zip);
@@ -652,16 +662,17 @@ void S_UnitTest2(const qstring &inpath)
 
    for(int i = 0; i < NUMPSXSFX; i++)
    {
-      auto &sfxinfo = psxsfxinfo[i];
-      auto &snd     = sfx[sfxinfo.sfxID];
-      qstring name;
+      auto    &sfxinfo = psxsfxinfo[i];
+      qstring  name;
+      uint32_t len;
 
-      if(!snd.pcm || !snd.total)
+      if(!sfx[sfxinfo.sfxID].data || !sfx[sfxinfo.sfxID].len)
          continue;
 
       name << "sounds/" << sfxinfo.name << ".lmp";
 
-      Zip_AddFile(&zip, name.constPtr(), snd.pcm, snd.total, ZIP_FILE_BINARY, true);
+      byte *pcm = S_renderSound(sfxinfo.sfxID, len);
+      Zip_AddFile(&zip, name.constPtr(), pcm, len, ZIP_FILE_BINARY, true, true);
    }
 
    Zip_Write(&zip);
@@ -26,14 +26,33 @@
 
 #include "z_zone.h"
 
-static int loading_total;
-static int loading_amount;
+static int  loading_total;
+static int  loading_amount;
+static bool loading_quiet;
+
+//
+// V_SetLoadingQuiet
+//
+// When several conversions run at the same time their progress bars would
+// only trample each other, so they can be turned off altogether.
+//
+void V_SetLoadingQuiet(bool quiet)
+{
+   loading_quiet = quiet;
+}
 
 //
 // V_SetLoading
 //
 void V_SetLoading(int total, bool newline)
 {
+   if(loading_quiet)
+   {
+      if(newline)
+         putchar('\n');
+      return;
+   }
+
    loading_total = total;
    loading_amount = 0;
 
@@ -53,6 +72,9 @@ void V_SetLoading(int total, bool newline)
 //
 void V_LoadingIncrease()
 {
+   if(loading_quiet)
+      return;
+
    if(loading_amount < loading_total)
    {
       loading_amount++;
@@ -71,6 +93,9 @@ void V_ProgressSpinner()
 {
    static unsigned int pcnt;
 
+   if(loading_quiet)
+      return;
+
    if(!((++pcnt)&31))
       printf("%c\b","/-\\|"[((pcnt)>>5)&3]);
 }
@@ -27,6 +27,7 @@
 #ifndef V_LOADING_H__
 #define V_LOADING_H__
 
+void V_SetLoadingQuiet(bool quiet);
 void V_SetLoading(int total, bool newline);
 void V_LoadingIncrease();
 void V_ProgressSpinner();
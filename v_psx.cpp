@@ -28,12 +28,24 @@
 //
 //-----------------------------------------------------------------------------
 
+#include <chrono>
+#include <mutex>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define V_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "z_zone.h"
 
+#include "i_mmap.h"
+#include "m_binary.h"
 #include "m_collection.h"
 #include "m_compare.h"
+#include "m_crc32.h"
 #include "m_fixed.h"
 #include "m_misc.h"
+#include "m_parallel.h"
 #include "m_qstr.h"
 #include "m_swap.h"
 #include "r_patch.h"
@@ -76,31 +88,173 @@ struct psxpic_header_t
 
 #define SAFEUINT16(dest, s) dest = SwapShort(*s | (*(s+1) << 8)); read += 2;
 
+//
+// V_countTrailingZeros
+//
+// Index of the lowest set bit of a non-zero value.
+//
+static inline int V_countTrailingZeros(uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+   return __builtin_ctzll(bits);
+#elif defined(_MSC_VER) && defined(_M_X64)
+   unsigned long index;
+   _BitScanForward64(&index, bits);
+   return (int)index;
+#else
+   int index = 0;
+   while(!(bits & 1))
+   {
+      bits >>= 1;
+      ++index;
+   }
+   return index;
+#endif
+}
+
+//
+// V_buildOpacity
+//
+// Fill in an opacity plane, which must start out cleared, from an image's
+// pixels: every pixel not of index 0 gets its bit set. The plane is stored a
+// column at a time, each column taking pitch 64-bit words, with row y in bit
+// y % 64 of word y / 64.
+//
+static void V_buildOpacity(const uint8_t *pixels, uint64_t *opacity, 
+                           int width, int height, size_t pitch)
+{
+   for(int y = 0; y < height; y++)
+   {
+      const uint8_t *row   = pixels + y * width;
+      uint64_t      *plane = opacity + (y >> 6);
+      const int      shift = y & 63;
+      int x = 0;
+
+#ifdef V_USE_SSE2
+      // test 16 pixels at once, and only visit the opaque ones
+      const __m128i zero = _mm_setzero_si128();
+
+      for(; x + 16 <= width; x += 16)
+      {
+         __m128i  px     = _mm_loadu_si128((const __m128i *)(row + x));
+         uint64_t opaque = ~_mm_movemask_epi8(_mm_cmpeq_epi8(px, zero)) & 0xffff;
+
+         while(opaque)
+         {
+            plane[(x + V_countTrailingZeros(opaque)) * pitch] |= 1ull << shift;
+            opaque &= opaque - 1;
+         }
+      }
+#endif
+
+      for(; x < width; x++)
+         plane[x * pitch] |= (uint64_t)(row[x] != 0) << shift;
+   }
+}
+
+//
+// V_nextSpan
+//
+// Find the first run of opaque rows in a column of an opacity plane at or
+// after row start. Returns false if there is none; otherwise the run covers
+// rows start up to but not including end.
+//
+static bool V_nextSpan(const uint64_t *column, int height, int &start, int &end)
+{
+   int      words = (height + 63) >> 6;
+   int      w     = start >> 6;
+   uint64_t bits;
+
+   if(start >= height)
+      return false;
+
+   // find the next set bit; rows past the bottom of the image are never set
+   bits = column[w] & (~0ull << (start & 63));
+   while(!bits)
+   {
+      if(++w == words)
+         return false;
+      bits = column[w];
+   }
+   start = (w << 6) + V_countTrailingZeros(bits);
+
+   // find the next clear bit after it
+   bits = ~column[w] & (~0ull << (start & 63));
+   while(!bits)
+   {
+      if(++w == words)
+      {
+         end = height;
+         return true;
+      }
+      bits = ~column[w];
+   }
+   end = (w << 6) + V_countTrailingZeros(bits);
+   if(end > height)
+      end = height;
+
+   return true;
+}
+
 //
 // VPSXImage::readImage
 //
-// Read the image from a lump.
+// Read the image from the lump held in lumpData. The pixels are used where
+// they lie in the lump, rather than being copied out of it.
 //
-void VPSXImage::readImage(const void *data)
+void VPSXImage::readImage(size_t size)
 {
-   const uint8_t *read = static_cast<const uint8_t *>(data);
+   const uint8_t *read = lumpData;
+
+   if(size < PSXPIC_HEADER_SIZE)
+      I_Error("VPSXImage: lump too small for an image header\n");
 
    SAFEUINT16(left,   read);
    SAFEUINT16(top,    read);
    SAFEUINT16(width,  read);
    SAFEUINT16(height, read);
 
-   pixels = ecalloc(uint8_t *, width, height);
-   mask   = ecalloc(uint8_t *, width, height);
+   if(width < 0 || height < 0 || 
+      size - PSXPIC_HEADER_SIZE < (size_t)(width * height))
+      I_Error("VPSXImage: %dx%d image is larger than its lump\n", width, height);
 
-   memcpy(pixels, read, width * height);
-   memset(mask,    255, width * height);
+   pixels  = lumpData + PSXPIC_HEADER_SIZE;
+   opacity = nullptr;
+}
+
+//
+// VPSXImage::loadLump
+//
+// Read in a lump, which the image holds on to for as long as it is using its
+// pixels.
+//
+void VPSXImage::loadLump(WadDirectory &dir, int lumpnum)
+{
+   size_t size = dir.lumpLength(lumpnum);
+
+   lumpData = emalloc(uint8_t *, size ? size : 1);
+   dir.readLump(lumpnum, lumpData);
+   readImage(size);
+}
 
-   for(size_t i = 0; i < (size_t)(width*height); i++)
+//
+// VPSXImage::needOpacity
+//
+// Returns the opacity plane, building it from the pixels the first time it is
+// needed. Not safe to call on the same image from two threads until the plane
+// has been built.
+//
+const uint64_t *VPSXImage::needOpacity() const
+{
+   if(!opacity)
    {
-      if(pixels[i] == 0)
-         mask[i] = 0;
+      size_t pitch = getOpacityPitch();
+
+      opacity = ecalloc(uint64_t *, width * pitch + 1, sizeof(uint64_t));
+      V_buildOpacity(pixels, opacity, width, height, pitch);
    }
+
+   return opacity;
 }
 
 //
@@ -128,9 +282,10 @@ void VPSXImage::adjustOffsets(const char *name)
 //
 VPSXImage::VPSXImage(WadDirectory &dir, int lumpnum)
 {
-   ZAutoBuffer buf;
-   dir.cacheLumpAuto(lumpnum, buf);
-   readImage(buf.get());
+   if(lumpnum < 0 || lumpnum >= dir.getNumLumps())
+      I_Error("VPSXImage: %i >= numlumps\n", lumpnum);
+
+   loadLump(dir, lumpnum);
    adjustOffsets(dir.getLumpInfo()[lumpnum]->name);
 }
 
@@ -140,9 +295,7 @@ VPSXImage::VPSXImage(WadDirectory &dir, int lumpnum)
 //
 VPSXImage::VPSXImage(WadDirectory &dir, const char *lumpname)
 {
-   ZAutoBuffer buf;
-   dir.cacheLumpAuto(lumpname, buf);
-   readImage(buf.get());
+   loadLump(dir, dir.getNumForName(lumpname));
    adjustOffsets(lumpname);
 }
 
@@ -158,13 +311,14 @@ VPSXImage::VPSXImage(const VPSXImage &parent, const rect_t &subrect,
       subrect.y < 0 || subrect.y + subrect.height > parent.height)
       I_Error("VPSXImage: invalid subregion for child image\n");
    
-   top    = topoffs;
-   left   = leftoffs;
-   width  = subrect.width;
-   height = subrect.height;
-
-   pixels = ecalloc(uint8_t *, width, height);
-   mask   = ecalloc(uint8_t *, width, height);
+   top      = topoffs;
+   left     = leftoffs;
+   width    = subrect.width;
+   height   = subrect.height;
+   lumpData = nullptr;
+
+   pixels  = ecalloc(uint8_t *, width, height);
+   opacity = nullptr;
    
    int16_t dsty  = 0;
    int16_t srcy1 = subrect.y;
@@ -172,11 +326,8 @@ VPSXImage::VPSXImage(const VPSXImage &parent, const rect_t &subrect,
    do
    {
       uint8_t *psrc = parent.pixels + srcy1 * parent.width + subrect.x;
-      uint8_t *msrc = parent.mask   + srcy1 * parent.width + subrect.x;
       uint8_t *pdst = pixels + dsty * width;
-      uint8_t *mdst = mask   + dsty * width;
       memcpy(pdst, psrc, width);
-      memcpy(mdst, msrc, width);
       ++dsty;
       ++srcy1;
    }
@@ -188,26 +339,38 @@ VPSXImage::VPSXImage(const VPSXImage &parent, const rect_t &subrect,
 //
 VPSXImage::~VPSXImage()
 {
-   if(pixels)
+   if(lumpData)
+      efree(lumpData);
+   else if(pixels)
       efree(pixels);
-   if(mask)
-      efree(mask);
+   if(opacity)
+      efree(opacity);
 
-   pixels = mask = nullptr;
+   lumpData = pixels = nullptr;
+   opacity  = nullptr;
 }
 
-class VPatchPost
+//
+// VPSXImage::releasePixels
+//
+// Hand over the pixel data, which the caller must free. If the pixels are
+// still those of the lump, they are moved down over its header in place, so
+// that no new buffer is needed.
+//
+uint8_t *VPSXImage::releasePixels()
 {
-public:
-   uint8_t row_off;
-   PODCollection<uint8_t> pixels;
-};
+   uint8_t *ret = pixels;
 
-class VPatchColumn
-{
-public:
-   Collection<VPatchPost> posts;
-};
+   if(lumpData)
+   {
+      memmove(lumpData, pixels, width * height);
+      ret      = lumpData;
+      lumpData = nullptr;
+   }
+
+   pixels = nullptr;
+   return ret;
+}
 
 #define PUTBYTE(r, v) *r = (uint8_t)(v); ++r
 
@@ -223,170 +386,224 @@ public:
    *(r+3) = (byte)(((uint32_t)(v) >> 24) & 0xff); \
    r += 4
 
+//
+// V_finishPost
+//
+// Fill in the length and leading pad byte of a post whose pixels have all been
+// written after its header, and add the trailing pad byte.
+//
+static byte *V_finishPost(byte *post, byte *rover)
+{
+   size_t numPixels = rover - post - 3;
+   byte   lastval   = numPixels ? rover[-1] : 0;
+
+   post[1] = (byte)numPixels;
+   post[2] = numPixels ? post[3] : 0;
+   PUTBYTE(rover, lastval);
+
+   return rover;
+}
+
 //
 // VPSXImage::toPatch
 //
 // Return the image converted to a patch_t-format lump.
-// Mostly straight from SLADE.
+// Originally from SLADE, but each column's posts are taken from the runs of
+// set bits in its opacity plane, and written straight into the output.
 //
 void *VPSXImage::toPatch(size_t &size) const
 {
-   Collection<VPatchColumn> columns;
+   // A column has at most one post for every two rows, plus a dummy post and
+   // a post split in two for every 254 rows of a tall patch. Posts take four
+   // bytes besides their pixels, and each column ends with a cap byte.
+   size_t maxPosts = (height + 1) / 2 + 2 * (height / 254);
+   size_t maxSize  = 4 * sizeof(int16_t) + 
+                     width * (sizeof(int32_t) + height + 4 * maxPosts + 1);
+
+   const uint64_t *plane = needOpacity();
+   const size_t    pitch = getOpacityPitch();
+
+   byte *output = ecalloc(byte *, maxSize, 1);
+   byte *rover  = output;
+
+   // write header fields
+   PUTSHORT(rover, width);
+   PUTSHORT(rover, height);
+   PUTSHORT(rover, left);
+   PUTSHORT(rover, top);
+
+   // set starting position of column offsets table, and skip over it
+   byte *col_offsets = rover;
+   rover += width * 4;
 
    // Go through columns
-   uint32_t offset = 0;
    for(int c = 0; c < width; c++)
    {
-      VPatchColumn col;
-      VPatchPost   post;
-      post.row_off   = 0;
-      bool ispost    = false;
-      bool first_254 = true;  // first 254 pixels use absolute offsets
-
-      offset = c;
-      uint8_t row_off = 0;
-      for(int r = 0; r < height; r++)
-      {
-         // if we're at offset 254, create a dummy post for tall doom gfx support
-         if(row_off == 254)
-         {
-            // Finish current post if any
-            if(ispost)
-            {
-               col.posts.add(post);
-               post.pixels.makeEmpty();
-               ispost = false;
-            }
+      const uint64_t *column = plane + c * pitch;
 
-            // Begin relative offsets
-            first_254 = false;
+      bool first_254 = true; // first 254 pixels use absolute offsets
+      int  row_off   = 0;    // offset the next post would be written with
+      int  row       = 0;    // row reached in the column
+      int  start     = 0;
+      int  end       = 0;
 
-            // Create dummy post
-            post.row_off = 254;
-            col.posts.add(post);
+      // write column offset to offset table
+      uint32_t offs = (uint32_t)(rover - output);
+      PUTLONG(col_offsets, offs);
 
-            // Clear post
-            row_off = 0;
-            ispost  = false;
+      // Move down to row limit, writing a dummy post for tall doom gfx support
+      // at every row where the offset would reach 254.
+      auto skipTo = [&] (int limit)
+      {
+         while(row + 254 - row_off <= limit)
+         {
+            row      += 254 - row_off;
+            row_off   = 0;
+            first_254 = false; // begin relative offsets
+
+            // Write dummy post: offset, no pixels, and two pad bytes
+            PUTBYTE(rover, 254);
+            PUTBYTE(rover, 0);
+            PUTBYTE(rover, 0);
+            PUTBYTE(rover, 0);
          }
 
-         // If the current pixel is not transparent, add it to the current post
-         if(mask[offset] > 0)
+         row_off += limit - row;
+         row      = limit;
+      };
+
+      // Write each run of opaque pixels, split into posts of up to 254 rows
+      while(V_nextSpan(column, height, start, end))
+      {
+         skipTo(start);
+
+         while(true)
          {
-            // If we're not currently building a post, begin one and set its offset
-            if(!ispost)
-            {
-               // Set offset
-               post.row_off = row_off;
+            // Once offsets are relative, each post starts its count afresh
+            int   room  = first_254 ? 254 - row_off : 254;
+            int   count = end - row < room ? end - row : room;
+            byte *post  = rover;
 
-               // Reset offset if we're in relative offsets mode
-               if(!first_254)
-                  row_off = 0;
+            PUTBYTE(rover, row_off);
+            rover += 2; // length and pad byte, filled in when finished
 
-               // Start post
-               ispost = true;
+            const uint8_t *src = pixels + row * width + c;
+            for(int i = 0; i < count; i++, src += width)
+            {
+               PUTBYTE(rover, *src);
             }
 
-            // Add the pixel to the post
-            post.pixels.add(pixels[offset]);
-         }
-         else if(ispost)
-         {
-            // If the current pixel is transparent and we are currently building
-            // a post, add the current post to the list and clear it
-            col.posts.add(post);
-            post.pixels.makeEmpty();
-            ispost = false;
+            rover = V_finishPost(post, rover);
+
+            // Offsets are relative to the last post once past the first 254
+            if(!first_254)
+               row_off = 0;
+            row_off += count;
+            row     += count;
+
+            if(row == end)
+               break;
+
+            // the post ran into row 254; a dummy post is due before going on
+            skipTo(row);
          }
 
-         // Go to next row
-         offset += width;
-         ++row_off;
+         start = end;
       }
 
-      // If the column ended with a post, add it
-      if(ispost)
-         col.posts.add(post);
+      // Dummy posts are still written over transparent rows at the bottom
+      if(height > 0)
+         skipTo(height - 1);
 
-      // Add the column data
-      columns.add(col);
-
-      // Go to next column
-      ++offset;
+      // Write 255 cap byte
+      PUTBYTE(rover, 0xff);
    }
 
-   // Calculate needed memory size to allocate patch buffer
-   size = 0;
-   size += 4 * sizeof(int16_t);                   // 4 header shorts
-   size += columns.getLength() * sizeof(int32_t); // offsets table
+   // Done! Give back what the bound overestimated.
+   size = (size_t)(rover - output);
+   return erealloc(byte *, output, size);
+}
 
-   for(size_t c = 0; c < columns.getLength(); c++)
-   {
-      for(size_t p = 0; p < columns[c].posts.getLength(); p++)
-      {
-         size_t post_len = 0;
+//
+// V_ValidatePatch
+//
+// Decode a patch_t-format lump back to pixels to make sure it is well formed:
+// every column offset must point inside the lump, and every post must fit
+// within both the lump and the patch's height before its column's 0xff cap.
+// Posts use the same tall patch convention toPatch writes, where a post which
+// does not start below the one before it is offset relative to it. Returns
+// NULL if the patch is good, or a description of the first problem found.
+//
+const char *V_ValidatePatch(const byte *data, size_t size)
+{
+   if(size < PSXPIC_HEADER_SIZE)
+      return "patch header is truncated";
 
-         post_len += 2; // two bytes for post header
-         post_len += 1; // dummy byte
-         post_len += columns[c].posts[p].pixels.getLength(); // pixels
-         post_len += 1; // dummy byte
+   int width  = read16_le(data,     int16_t);
+   int height = read16_le(data + 2, int16_t);
 
-         size += post_len;
-      }
+   if(width <= 0 || height <= 0)
+      return "patch has no size";
 
-      size += 1; // room for 0xff cap byte
-   }
+   size_t tableEnd = PSXPIC_HEADER_SIZE + width * sizeof(int32_t);
+   if(size < tableEnd)
+      return "column offset table is truncated";
 
-   byte *output = ecalloc(byte *, size, 1);
-   byte *rover  = output;
+   ZAutoBuffer  pixelBuf(width * height, false);
+   byte        *pixels = pixelBuf.getAs<byte *>();
+   const byte  *colofs = data + PSXPIC_HEADER_SIZE;
+   const char  *error  = NULL;
 
-   // write header fields
-   PUTSHORT(rover, width);
-   PUTSHORT(rover, height);
-   PUTSHORT(rover, left);
-   PUTSHORT(rover, top);
+   for(int c = 0; c < width && !error; c++)
+   {
+      uint32_t offset = read32_le(colofs + c * 4, uint32_t);
+      int      top    = -1;
 
-   // set starting position of column offsets table, and skip over it
-   byte *col_offsets = rover;
-   rover += columns.getLength() * 4;
+      if(offset < tableEnd || offset >= size)
+      {
+         error = "column offset out of bounds";
+         break;
+      }
 
-   for(size_t c = 0; c < columns.getLength(); c++)
-   {
-      // write column offset to offset table
-      uint32_t offs = (uint32_t)(rover - output);
-      PUTLONG(col_offsets, offs);
+      const byte *rover = data + offset;
+      const byte *end   = data + size;
 
-      // write column posts
-      for(size_t p = 0; p < columns[c].posts.getLength(); p++)
+      while(1)
       {
-         // Write row offset
-         PUTBYTE(rover, columns[c].posts[p].row_off);
+         if(*rover == 0xff)
+            break; // end of column
 
-         // Write number of pixels
-         size_t numPixels = columns[c].posts[p].pixels.getLength();
-         PUTBYTE(rover, numPixels);
+         if(end - rover < 4)
+         {
+            error = "post runs off the end of the patch";
+            break;
+         }
+
+         int topdelta = rover[0];
+         int length   = rover[1];
 
-         // Write pad byte
-         byte lastval = numPixels ? columns[c].posts[p].pixels[0] : 0;
-         PUTBYTE(rover, lastval);
+         // tall patches: offsets become relative once past row 254
+         top = (topdelta <= top) ? top + topdelta : topdelta;
 
-         // Write pixels
-         for(size_t a = 0; a < numPixels; a++)
+         if(top + length > height)
          {
-            lastval = columns[c].posts[p].pixels[a];
-            PUTBYTE(rover, lastval);
+            error = "post runs off the bottom of its column";
+            break;
+         }
+         if(end - rover < length + 5) // header, two pad bytes, and a cap
+         {
+            error = "post runs off the end of the patch";
+            break;
          }
 
-         // Write pad byte
-         PUTBYTE(rover, lastval);
-      }
+         for(int r = 0; r < length; r++)
+            pixels[(top + r) * width + c] = rover[3 + r];
 
-      // Write 255 cap byte
-      PUTBYTE(rover, 0xff);
+         rover += length + 4;
+      }
    }
 
-   // Done!
-   return output;
+   return error;
 }
 
 static bool   palettebuilt;
@@ -398,55 +615,40 @@ static byte *tranmap_50;
 // tranmap with 25% / 75% translucency
 static byte *tranmap_25_75;
 
-static byte V_blendTwoPx25(byte col1, byte col2, byte mask1, byte mask2)
-{
-   byte mcol1 = mask1 ? col1 : 0;
-   byte mcol2 = mask2 ? col2 : 0;
-
-   if(mcol1 && mcol2)
-      return tranmap_25_75[(mcol2 << 8) + mcol1];
-   else if(mcol2)
-      return mcol2;
-   else
-      return mcol1;
-}
+// The tranmaps again, with row and column 0 standing for a transparent pixel:
+// blending any pixel with one of those leaves it as it was. Indexed by
+// (col2 << 8) + col1, as the tranmaps are by scaleForFourThree.
+static byte *blendmap_50;
+static byte *blendmap_25_75;
 
-static byte V_blendTwoPx75(byte col1, byte col2, byte mask1, byte mask2)
+//
+// V_buildBlendMap
+//
+static byte *V_buildBlendMap(const byte *tranmap)
 {
-   byte mcol1 = mask1 ? col1 : 0;
-   byte mcol2 = mask2 ? col2 : 0;
+   byte *blendmap = emalloc(byte *, 256*256);
 
-   if(mcol1 && mcol2)
-      return tranmap_25_75[(mcol1 << 8) + mcol2];
-   else if(mcol1)
-      return mcol1;
-   else
-      return mcol2;
-}
+   memcpy(blendmap, tranmap, 256*256);
 
-static byte V_blendTwoPx50(byte col1, byte col2, byte mask1, byte mask2)
-{
-   byte mcol1 = mask1 ? col1 : 0;
-   byte mcol2 = mask2 ? col2 : 0;
+   for(int i = 0; i < 256; i++)
+   {
+      blendmap[i]      = (byte)i; // col2 is transparent
+      blendmap[i << 8] = (byte)i; // col1 is transparent
+   }
 
-   if(mcol1 && mcol2)
-      return tranmap_50[(mcol2 << 8) + mcol1];
-   else if(mcol2)
-      return mcol2;
-   else
-      return mcol1;
+   return blendmap;
 }
 
 //
-// VPSXImage::scaleForFourThree
+// V_InitTranMaps
 //
-// Upscales the width of a screen patch to account for the 256 -> 320 scaling
-// that happened during video signal rasterization on television sets.
+// Build the translucency tables used by VPSXImage::scaleForFourThree. The
+// PLAYPAL must already be loaded. This should be called before any images are
+// scaled from more than one thread at a time, as the tables are otherwise
+// built on first use.
 //
-void VPSXImage::scaleForFourThree()
+void V_InitTranMaps()
 {
-   int scaledWidth = (int)(ceil((width * 5.0) / 4.0));
-
    if(!palettebuilt)
    {
       V_ColoursFromPLAYPAL(0, tranpalette);
@@ -465,90 +667,124 @@ void VPSXImage::scaleForFourThree()
       V_BuildTranMap(tranpalette, tranmap_25_75, 25);
    }
 
-   // allocate upscaled buffer
-   byte *newPixels = ecalloc(byte *, scaledWidth, height);
-   byte *newMask   = ecalloc(byte *, scaledWidth, height);
+   if(!blendmap_50)
+      blendmap_50 = V_buildBlendMap(tranmap_50);
+   if(!blendmap_25_75)
+      blendmap_25_75 = V_buildBlendMap(tranmap_25_75);
+}
+
+// Screens are big enough to be worth scaling on several threads at once.
+#define SCALE_PARALLEL_PIXELS 32768
 
-   // TEST
-   memset(newPixels, 168, scaledWidth*height);
+//
+// V_scaleRowFourThree
+//
+// Scale one row of an image, turning every 4 pixels into 5: the first and
+// last are kept, and the three between are blends of their neighbours at 25%,
+// 50% and 75%. Index 0 is transparent, and blends with it as such; blended
+// pixels are only transparent if they came out as index 0.
+//
+static void V_scaleRowFourThree(const byte *psrc, byte *pdst, int width, 
+                                int scaledWidth)
+{
+   int sx = 0;
+   int dx = 0;
 
-   for(int y = 0; y < height; y++)
+   // every 4 source pixels must turn into 5 destination pixels
+   for(; sx <= width - 4; sx += 4, dx += 5, psrc += 4, pdst += 5)
    {
-      int sx = 0;
-      int dx = 0;
+      unsigned int q0 = psrc[0];
+      unsigned int q1 = psrc[1];
+      unsigned int q2 = psrc[2];
+      unsigned int q3 = psrc[3];
+
+      pdst[0] = q0;                               // 100% 0
+      pdst[1] = blendmap_25_75[(q1 << 8) + q0];   // 25%  0 + 75% 1
+      pdst[2] = blendmap_50[(q2 << 8) + q1];      // 50%  1 + 50% 2
+      pdst[3] = blendmap_25_75[(q2 << 8) + q3];   // 75%  2 + 25% 3
+      pdst[4] = q3;                               // 100% 3
+   }
 
-      // every 4 source pixels must turn into 5 destination pixels
-      for(; sx <= width - 4; sx += 4, dx += 5)
-      {
-         byte *psrc = pixels    + y * width       + sx;
-         byte *pdst = newPixels + y * scaledWidth + dx;
-         byte *msrc = mask      + y * width       + sx;
-         byte *mdst = newMask   + y * scaledWidth + dx;
-
-         pdst[0] = psrc[0];                                 // 100% 0
-         pdst[1] = V_blendTwoPx25(psrc[0], psrc[1], msrc[0], msrc[1]); // 25%  0 + 75% 1
-         pdst[2] = V_blendTwoPx50(psrc[1], psrc[2], msrc[1], msrc[2]); // 50%  1 + 50% 2
-         pdst[3] = V_blendTwoPx75(psrc[2], psrc[3], msrc[2], msrc[3]); // 75%  2 + 25% 3
-         pdst[4] = psrc[3];                                 // 100% 3
-
-         mdst[0] = msrc[0];
-         mdst[1] = !!pdst[1];
-         mdst[2] = !!pdst[2];
-         mdst[3] = !!pdst[3];
-         mdst[4] = !!pdst[4];
-         mdst[4] = msrc[3];
-      }
-      if(sx < width) // width is not 0 % 4?
+   if(sx < width) // width is not 0 % 4?
+   {
+      byte dstpx[] = { 0, 0, 0, 0, 0 };
+      unsigned int q0 = psrc[0];
+      unsigned int q1, q2;
+
+      switch(width % 4)
       {
-         byte dstpx[] = { 0, 0, 0, 0, 0 };
-         byte dstmx[] = { 0, 0, 0, 0, 0 };
-         byte *psrc = pixels    + y * width       + sx;
-         byte *msrc = mask      + y * width       + sx;
-         byte *pdst = newPixels + y * scaledWidth + dx;
-         byte *mdst = newMask   + y * scaledWidth + dx;
-         
-         switch(width % 4)
-         {
-         case 1: // one pixel left
-            dstpx[0] = *psrc;
-            dstmx[0] = *msrc;
-            break;
-         case 2: // two pixels left
-            dstpx[0] = *psrc;
-            dstmx[0] = *msrc;
-            dstpx[1] = V_blendTwoPx25(psrc[0], psrc[1], msrc[0], msrc[1]);
-            dstmx[1] = !!dstpx[1];
-            dstpx[2] = psrc[1];
-            dstmx[2] = msrc[1];
-            break;
-         case 3: // three pixels left
-            dstpx[0] = *psrc;
-            dstmx[0] = *msrc;
-            dstpx[1] = V_blendTwoPx25(psrc[0], psrc[1], msrc[0], msrc[1]);
-            dstmx[1] = !!dstpx[1];
-            dstpx[2] = V_blendTwoPx50(psrc[1], psrc[2], msrc[1], msrc[2]);
-            dstmx[2] = !!dstpx[2];
-            dstpx[3] = psrc[2];
-            dstmx[3] = msrc[2];
-            break;
-         default: // shouldn't be reachable.
-            break;
-         }
-         size_t amt = scaledWidth - dx > 5 ? 5 : scaledWidth - dx;
-         if(amt)
-         {
-            memcpy(pdst, dstpx, amt);
-            memcpy(mdst, dstmx, amt);
-         }
+      case 1: // one pixel left
+         dstpx[0] = psrc[0];
+         break;
+      case 2: // two pixels left
+         q1 = psrc[1];
+         dstpx[0] = psrc[0];
+         dstpx[1] = blendmap_25_75[(q1 << 8) + q0];
+         dstpx[2] = psrc[1];
+         break;
+      case 3: // three pixels left
+         q1 = psrc[1];
+         q2 = psrc[2];
+         dstpx[0] = psrc[0];
+         dstpx[1] = blendmap_25_75[(q1 << 8) + q0];
+         dstpx[2] = blendmap_50[(q2 << 8) + q1];
+         dstpx[3] = psrc[2];
+         break;
+      default: // shouldn't be reachable.
+         break;
       }
+      size_t amt = scaledWidth - dx > 5 ? 5 : scaledWidth - dx;
+      if(amt)
+         memcpy(pdst, dstpx, amt);
+   }
+}
+
+//
+// VPSXImage::scaleForFourThree
+//
+// Upscales the width of a screen patch to account for the 256 -> 320 scaling
+// that happened during video signal rasterization on television sets.
+//
+void VPSXImage::scaleForFourThree()
+{
+   int scaledWidth = (int)(ceil((width * 5.0) / 4.0));
+
+   V_InitTranMaps();
+
+   // allocate upscaled buffer; every pixel of it gets written
+   byte *newPixels = emalloc(byte *, scaledWidth * height);
+
+   auto scaleRow = [&] (size_t y)
+   {
+      V_scaleRowFourThree(pixels + y * width, newPixels + y * scaledWidth,
+                          width, scaledWidth);
+   };
+
+   if(width * height >= SCALE_PARALLEL_PIXELS)
+      M_ParallelFor(height, scaleRow);
+   else
+   {
+      for(int y = 0; y < height; y++)
+         scaleRow(y);
    }
 
    // set image to the new pixel array and adjust width
-   efree(pixels);
-   efree(mask);
+   if(lumpData)
+   {
+      efree(lumpData);
+      lumpData = nullptr;
+   }
+   else
+      efree(pixels);
+
+   // any opacity plane is rebuilt from the new pixels when next needed
+   if(opacity)
+   {
+      efree(opacity);
+      opacity = nullptr;
+   }
 
    pixels = newPixels;
-   mask   = newMask;
    width  = scaledWidth;
 }
 
@@ -561,44 +797,37 @@ void VPSXImage::scaleForFourThree()
 // V_ConvertSpritesToZip
 //
 // Convert PSX Doom's sprites to Doom's patch format and insert them into the
-// zip under the sprites/ directory.
+// zip under the sprites/ directory. Each sprite is only converted once the
+// archive gets around to writing it out.
 //
 void V_ConvertSpritesToZip(WadDirectory &dir, ziparchive_t *zip)
 {
    WadNamespaceIterator wni(dir, lumpinfo_t::ns_sprites);
-   int numlumps = wni.getNumLumps();
-   fixed_t dotstep  = numlumps ? 64 * FRACUNIT / numlumps : 0;
-   fixed_t dotaccum = 0;
-
-   printf("V_ConvertSprites: converting sprites:");
-   V_SetLoading(64, true);
+   // nothing is converted here, so there is no progress to show until the
+   // archive is written out
+   printf("V_ConvertSprites: adding %d sprites\n", wni.getNumLumps());
 
    Zip_AddFile(zip, "sprites/", NULL, 0, ZIP_DIRECTORY, false);
 
-   int count = 0;
-   for(wni.begin(); wni.current(); wni.next(), count++)
+   for(wni.begin(); wni.current(); wni.next())
    {
       lumpinfo_t *lump = wni.current();
-      VPSXImage img(dir, lump->selfindex);
-      size_t  size = 0;
-      void   *data = img.toPatch(size);
+      int     lumpnum = lump->selfindex;
       qstring name;
 
-      dotaccum += dotstep;
-      while(dotaccum >= FRACUNIT)
-      {
-         V_LoadingIncrease();
-         dotaccum -= FRACUNIT;
-      }
-
       name << "sprites/" << lump->name;
 
-      Zip_AddFile(zip, name.constPtr(), (byte *)data, (uint32_t)size, 
-                  ZIP_FILE_BINARY, true);
-   }
+      // converted when the archive gets to it
+      Zip_AddFile(zip, name.constPtr(), [&dir, lumpnum] (uint32_t &len)
+      {
+         VPSXImage img(dir, lumpnum);
+         size_t size = 0;
+         void  *data = img.toPatch(size);
 
-   if(dotaccum != 0)
-      V_LoadingIncrease();
+         len = (uint32_t)size;
+         return static_cast<byte *>(data);
+      }, true);
+   }
 }
 
 //=============================================================================
@@ -610,44 +839,37 @@ void V_ConvertSpritesToZip(WadDirectory &dir, ziparchive_t *zip)
 // V_ConvertTexturesToZip
 //
 // Convert the PSX textures into Doom's patch format and insert them into the
-// zip under the textures/ directory.
+// zip under the textures/ directory. As with sprites, conversion happens as the
+// archive is being written.
 //
 void V_ConvertTexturesToZip(WadDirectory &dir, ziparchive_t *zip)
 {
    WadNamespaceIterator wni(dir, lumpinfo_t::ns_textures);
-   int numlumps = wni.getNumLumps();
-   fixed_t dotstep  = numlumps ? 64 * FRACUNIT / numlumps : 0;
-   fixed_t dotaccum = 0;
-
-   printf("V_ConvertTextures: converting textures:");
-   V_SetLoading(64, true);
+   // nothing is converted here, so there is no progress to show until the
+   // archive is written out
+   printf("V_ConvertTextures: adding %d textures\n", wni.getNumLumps());
 
    Zip_AddFile(zip, "textures/", NULL, 0, ZIP_DIRECTORY, false);
 
-   int count = 0;
-   for(wni.begin(); wni.current(); wni.next(), count++)
+   for(wni.begin(); wni.current(); wni.next())
    {
       lumpinfo_t *lump = wni.current();
-      VPSXImage img(dir, lump->selfindex);
-      size_t  size = 0;
-      void   *data = img.toPatch(size);
+      int     lumpnum = lump->selfindex;
       qstring name;
 
-      dotaccum += dotstep;
-      while(dotaccum >= FRACUNIT)
-      {
-         V_LoadingIncrease();
-         dotaccum -= FRACUNIT;
-      }
-
       name << "textures/" << lump->name;
 
-      Zip_AddFile(zip, name.constPtr(), (byte *)data, (uint32_t)size, 
-                  ZIP_FILE_BINARY, true);
-   }
+      // converted when the archive gets to it
+      Zip_AddFile(zip, name.constPtr(), [&dir, lumpnum] (uint32_t &len)
+      {
+         VPSXImage img(dir, lumpnum);
+         size_t size = 0;
+         void  *data = img.toPatch(size);
 
-   if(dotaccum != 0)
-      V_LoadingIncrease();
+         len = (uint32_t)size;
+         return static_cast<byte *>(data);
+      }, true);
+   }
 }
 
 //=============================================================================
@@ -692,7 +914,7 @@ void V_ConvertFlatsToZip(WadDirectory &dir, ziparchive_t *zip)
       name << "flats/" << lump->name;
 
       Zip_AddFile(zip, name.constPtr(), data, img.getWidth()*img.getHeight(),
-                  ZIP_FILE_BINARY, true);
+                  ZIP_FILE_BINARY, true, true);
    }
 
    if(dotaccum != 0)
@@ -1040,7 +1262,7 @@ static void V_convertSTATUSToZip(WadDirectory &dir, ziparchive_t *zip)
       name << "graphics/" << reg.lumpname;
 
       Zip_AddFile(zip, name.constPtr(), (byte *)data, (uint32_t)size, 
-                  ZIP_FILE_BINARY, true);
+                  ZIP_FILE_BINARY, true, true);
    }
 }
 
@@ -1077,10 +1299,27 @@ static void V_convertScreensToZip(WadDirectory &dir, ziparchive_t *zip)
       name << "graphics/" << screens[i].destLumpName;
 
       Zip_AddFile(zip, name.constPtr(), pic, size, 
-                  ZIP_FILE_BINARY, true);
+                  ZIP_FILE_BINARY, true, true);
    }
 }
 
+//
+// V_IsRawScreen
+//
+// True if the named graphic is one of the full screens written out as a plain
+// block of pixels, rather than as a patch.
+//
+bool V_IsRawScreen(const char *lumpname)
+{
+   for(size_t i = 0; i < earrlen(screens); i++)
+   {
+      if(!strcasecmp(screens[i].destLumpName, lumpname))
+         return true;
+   }
+
+   return false;
+}
+
 //
 // V_ConvertGraphicsToZip
 //
@@ -1409,35 +1648,55 @@ void V_ColoursFromPLAYPAL(size_t palnum, rgba_t outpal[256])
    }
 }
 
-static inline double colourDiff(rgba_t colours[256], rgba_t &rgb, int index)
+//
+// VInversePalette
+//
+// Every colour in the PSX palettes comes from RGB555, so the RGB cube is cut
+// into 32x32x32 cells, each holding the 8x8x8 colours which share the top five
+// bits of every channel. For each cell, the palette entries which could be the
+// nearest to any colour inside it are listed; any entry whose closest approach
+// to the cell is further than some other entry's furthest point can be ruled
+// out. The nearest entry to the cell's RGB555 colour itself is kept as well.
+// Cells span up to the start of the next one, rather than to the last whole
+// colour inside them, so that the lists also hold for blended colours with
+// fractional channels.
+//
+
+// Squared distance along one channel from a value to a cell's span
+static inline int V_cellMinDist(int v, int cell)
+{
+   int lo = cell << 3, hi = lo + 8;
+   int d  = (v < lo) ? lo - v : (v > hi) ? v - hi : 0;
+   return d * d;
+}
+
+static inline int V_cellMaxDist(int v, int cell)
 {
-   double d1 = rgb.r - colours[index].r;
-   double d2 = rgb.g - colours[index].g;
-   double d3 = rgb.b - colours[index].b;
-   return (d1*d1)+(d2*d2)+(d3*d3);
+   int lo = cell << 3, hi = lo + 8;
+   int d  = (v - lo > hi - v) ? v - lo : hi - v;
+   return d * d;
 }
 
 //
-// V_FindNearestColour
+// VInversePalette::searchCell
 //
-// From SLADE, but tweaked for PSX in two manners:
-// * Default color match should be index 255, not 0.
-// * Never match against color 0.
+// Find the nearest colour among a cell's candidates. These are in index order,
+// so ties go to the lowest index, just as they would in a full search.
 //
-int V_FindNearestColour(rgba_t colours[256], rgba_t colour)
+int VInversePalette::searchCell(int cell, rgba_t colour) const
 {
-   double min_d = 999999;
-   int    index = 255;
-   double delta;
+   int min_d = INT_MAX;
+   int index = 255;
 
-   for(int a = 1; a < 256; a++)
+   for(uint32_t i = cellStart[cell]; i < cellStart[cell + 1]; i++)
    {
-      delta = colourDiff(colours, colour, a);
+      int a  = candidates[i];
+      int d1 = colour.r - colours[a].r;
+      int d2 = colour.g - colours[a].g;
+      int d3 = colour.b - colours[a].b;
+      int delta = d1*d1 + d2*d2 + d3*d3;
 
-      // Exact match?
-      if(delta == 0.0)
-         return a;
-      else if(delta < min_d)
+      if(delta < min_d)
       {
          min_d = delta;
          index = a;
@@ -1447,6 +1706,272 @@ int V_FindNearestColour(rgba_t colours[256], rgba_t colour)
    return index;
 }
 
+//
+// VInversePalette Constructor
+//
+// Cells are worked out a blue slice at a time, in parallel. Distances along
+// each channel are separable, so they are tabulated once per entry and then
+// only summed for each cell.
+//
+VInversePalette::VInversePalette(const rgba_t pal[256])
+   : ZoneObject(), candidates(NULL)
+{
+   PODCollection<byte> slices[32];
+
+   // squared distances from each entry to each span of 8 values per channel
+   auto minDist = ecalloc(int (*)[32][256], 3, sizeof(int [32][256]));
+   auto maxDist = ecalloc(int (*)[32][256], 3, sizeof(int [32][256]));
+
+   memcpy(colours, pal, sizeof(colours));
+
+   for(int cell = 0; cell < 32; cell++)
+   {
+      for(int a = 1; a < 256; a++)
+      {
+         minDist[0][cell][a] = V_cellMinDist(colours[a].r, cell);
+         minDist[1][cell][a] = V_cellMinDist(colours[a].g, cell);
+         minDist[2][cell][a] = V_cellMinDist(colours[a].b, cell);
+         maxDist[0][cell][a] = V_cellMaxDist(colours[a].r, cell);
+         maxDist[1][cell][a] = V_cellMaxDist(colours[a].g, cell);
+         maxDist[2][cell][a] = V_cellMaxDist(colours[a].b, cell);
+      }
+   }
+
+   M_ParallelFor(32, [&] (size_t bc)
+   {
+      PODCollection<byte> &list = slices[bc];
+
+      for(int gc = 0; gc < 32; gc++)
+      {
+         for(int rc = 0; rc < 32; rc++)
+         {
+            int cell  = (int)(bc << 10) | (gc << 5) | rc;
+            int bound = INT_MAX;
+
+            // index 0 is never matched, so it's never a candidate
+            for(int a = 1; a < 256; a++)
+            {
+               int furthest = maxDist[0][rc][a] + maxDist[1][gc][a] + 
+                              maxDist[2][bc][a];
+               if(furthest < bound)
+                  bound = furthest;
+            }
+
+            cellStart[cell] = (uint32_t)list.getLength();
+            for(int a = 1; a < 256; a++)
+            {
+               int closest = minDist[0][rc][a] + minDist[1][gc][a] + 
+                             minDist[2][bc][a];
+               if(closest <= bound)
+                  list.add((byte)a);
+            }
+         }
+      }
+   });
+
+   efree(minDist);
+   efree(maxDist);
+
+   // lay the slices out one after another
+   size_t total = 0;
+   for(int bc = 0; bc < 32; bc++)
+      total += slices[bc].getLength();
+
+   candidates = emalloc(byte *, total);
+
+   size_t pos = 0;
+   for(int bc = 0; bc < 32; bc++)
+   {
+      size_t len = slices[bc].getLength();
+
+      for(int cell = bc << 10; cell < (bc + 1) << 10; cell++)
+         cellStart[cell] += (uint32_t)pos;
+      if(len)
+         memcpy(candidates + pos, &slices[bc][0], len);
+      pos += len;
+   }
+   cellStart[32*32*32] = (uint32_t)pos;
+
+   M_ParallelFor(32, [&] (size_t bc)
+   {
+      for(int cell = (int)(bc << 10); cell < (int)((bc + 1) << 10); cell++)
+      {
+         rgba_t colour;
+         colour.r = (uint8_t)((cell & 0x1f) << 3);
+         colour.g = (uint8_t)(((cell >> 5) & 0x1f) << 3);
+         colour.b = (uint8_t)(((cell >> 10) & 0x1f) << 3);
+         colour.a = 0;
+         direct[cell] = (byte)searchCell(cell, colour);
+      }
+   });
+}
+
+//
+// VInversePalette Constructor
+//
+// Restore a table written out by save, which must have been checked first.
+//
+VInversePalette::VInversePalette(const byte *saved)
+   : ZoneObject(), candidates(NULL)
+{
+   for(int i = 0; i < 256; i++)
+   {
+      colours[i].r = *saved++;
+      colours[i].g = *saved++;
+      colours[i].b = *saved++;
+      colours[i].a = 0;
+   }
+
+   memcpy(direct, saved, sizeof(direct));
+   saved += sizeof(direct);
+   memcpy(cellStart, saved, sizeof(cellStart));
+   saved += sizeof(cellStart);
+
+   size_t total = cellStart[32*32*32];
+   candidates = emalloc(byte *, total ? total : 1);
+   memcpy(candidates, saved, total);
+}
+
+//
+// VInversePalette Destructor
+//
+VInversePalette::~VInversePalette()
+{
+   if(candidates)
+      efree(candidates);
+}
+
+//
+// VInversePalette::matches
+//
+// True if this table was built for the given palette.
+//
+bool VInversePalette::matches(const rgba_t pal[256]) const
+{
+   for(int i = 0; i < 256; i++)
+   {
+      if(pal[i].r != colours[i].r || pal[i].g != colours[i].g ||
+         pal[i].b != colours[i].b)
+         return false;
+   }
+
+   return true;
+}
+
+//
+// VInversePalette::nearest
+//
+// Find the palette entry nearest to a colour, looking it up directly if the
+// colour came from RGB555.
+//
+int VInversePalette::nearest(rgba_t colour) const
+{
+   int cell = cellFor(colour.r, colour.g, colour.b);
+
+   if(!((colour.r | colour.g | colour.b) & 7))
+      return direct[cell];
+
+   return searchCell(cell, colour);
+}
+
+//
+// VInversePalette::getSavedSize
+//
+size_t VInversePalette::getSavedSize() const
+{
+   return 768 + sizeof(direct) + sizeof(cellStart) + cellStart[32*32*32];
+}
+
+//
+// VInversePalette::save
+//
+// Write the table out in the machine's own byte order.
+//
+void VInversePalette::save(byte *out) const
+{
+   for(int i = 0; i < 256; i++)
+   {
+      *out++ = colours[i].r;
+      *out++ = colours[i].g;
+      *out++ = colours[i].b;
+   }
+
+   memcpy(out, direct, sizeof(direct));
+   out += sizeof(direct);
+   memcpy(out, cellStart, sizeof(cellStart));
+   out += sizeof(cellStart);
+   memcpy(out, candidates, cellStart[32*32*32]);
+}
+
+//
+// VInversePalette::CheckSaved
+//
+size_t VInversePalette::CheckSaved(const byte *data, size_t size)
+{
+   const size_t fixedSize = 768 + sizeof(direct) + sizeof(cellStart);
+
+   if(size < fixedSize)
+      return 0;
+
+   // cells must follow one after another from the start of the candidates
+   const byte *starts = data + 768 + sizeof(direct);
+   uint32_t    prev   = 0;
+
+   for(int cell = 0; cell <= 32*32*32; cell++)
+   {
+      uint32_t start;
+      memcpy(&start, starts + cell * sizeof(uint32_t), sizeof(start));
+
+      if((cell == 0 && start != 0) || start < prev)
+         return 0;
+      prev = start;
+   }
+
+   if(size - fixedSize < prev)
+      return 0;
+
+   return fixedSize + prev;
+}
+
+// tables built so far, for each palette asked about
+static PODCollection<VInversePalette *> inversePalettes;
+static std::mutex                       inversePaletteLock;
+
+//
+// V_GetInversePalette
+//
+// Get the inverse palette table for a palette, building it the first time that
+// palette is seen. Tables are kept until exit.
+//
+const VInversePalette &V_GetInversePalette(const rgba_t colours[256])
+{
+   std::lock_guard<std::mutex> guard(inversePaletteLock);
+
+   for(VInversePalette *inverse : inversePalettes)
+   {
+      if(inverse->matches(colours))
+         return *inverse;
+   }
+
+   VInversePalette *inverse = new VInversePalette(colours);
+   inversePalettes.add(inverse);
+   return *inverse;
+}
+
+//
+// V_FindNearestColour
+//
+// From SLADE, but tweaked for PSX in two manners:
+// * Default color match should be index 255, not 0.
+// * Never match against color 0.
+// Answered from the palette's inverse table, which gives the same results as
+// searching the whole palette would.
+//
+int V_FindNearestColour(rgba_t colours[256], rgba_t colour)
+{
+   return V_GetInversePalette(colours).nearest(colour);
+}
+
 //=============================================================================
 //
 // Tranmap computation (for internal use)
@@ -1455,6 +1980,14 @@ int V_FindNearestColour(rgba_t colours[256], rgba_t colour)
 // number of fixed point digits in filter percent
 #define TSC 12 
 
+//
+// V_BuildTranMap
+//
+// Each entry is the palette colour nearest to a blend of two others, which
+// only needs to be looked for among the candidates listed for the blend's
+// cell in the palette's inverse table. Ties go to the highest index, as they
+// always have. Rows are independent, so they are built in parallel.
+//
 void V_BuildTranMap(rgba_t colours[256], byte *map, int pct)
 {
    int pal[3][256], tot[256], pal_w1[3][256];
@@ -1478,6 +2011,71 @@ void V_BuildTranMap(rgba_t colours[256], byte *map, int pct)
    }
    while(--i >= 0);
 
+   const VInversePalette &inverse = V_GetInversePalette(colours);
+
+   // Next, compute all entries using minimum arithmetic.
+   M_ParallelFor(256, [&] (size_t row)
+   {
+      byte *tp = map + (row << 8);
+      int   r1 = pal[0][row] * w2;
+      int   g1 = pal[1][row] * w2;
+      int   b1 = pal[2][row] * w2;
+
+      for(int j = 0; j < 256; j++, tp++)
+      {
+         int r = pal_w1[0][j] + r1;
+         int g = pal_w1[1][j] + g1;
+         int b = pal_w1[2][j] + b1;
+         int best = INT_MAX;
+         int err;
+
+         size_t      count;
+         const byte *cand = 
+            inverse.getCandidates(VInversePalette::cellFor(r >> TSC, g >> TSC, 
+                                                           b >> TSC), count);
+
+         // candidates are in index order, so keep the last of any ties
+         for(size_t k = 0; k < count; k++)
+         {
+            int color = cand[k];
+
+            if((err = tot[color] - pal[0][color]*r
+               - pal[1][color]*g - pal[2][color]*b) <= best)
+               best = err, *tp = color;
+         }
+      }
+   });
+}
+
+#ifndef NO_UNIT_TESTS
+//
+// V_buildTranMapReference
+//
+// The original exhaustive search, which V_BuildTranMap must agree with.
+//
+static void V_buildTranMapReference(rgba_t colours[256], byte *map, int pct)
+{
+   int pal[3][256], tot[256], pal_w1[3][256];
+   int w1 = ((unsigned int) pct << TSC) / 100;
+   int w2 = (1l << TSC) - w1;
+   int i;
+
+   // First, convert playpal into long int type, and transpose array,
+   // for fast inner-loop calculations. Precompute tot array.
+   i = 255;
+   do
+   {
+      int t, d;
+      pal_w1[0][i] = (pal[0][i] = t = colours[i].r) * w1;
+      d = t*t;
+      pal_w1[1][i] = (pal[1][i] = t = colours[i].g) * w1;
+      d += t*t;
+      pal_w1[2][i] = (pal[2][i] = t = colours[i].b) * w1;
+      d += t*t;
+      tot[i] = d << (TSC - 1);
+   }
+   while(--i >= 0);
+
    // Next, compute all entries using minimum arithmetic.
    byte *tp = map;
    for(i = 0; i < 256; i++)
@@ -1505,6 +2103,65 @@ void V_BuildTranMap(rgba_t colours[256], byte *map, int pct)
    }
 }
 
+//
+// V_TranMapUnitTest
+//
+// Build tranmaps for every palette in PLAYPAL at a few blend levels, both
+// with V_BuildTranMap and with the exhaustive search, checking that they are
+// identical and comparing how long each took.
+//
+void V_TranMapUnitTest(WadDirectory &dir)
+{
+   static const int pcts[] = { 25, 50, 75 };
+
+   if(!playpal)
+      V_LoadPLAYPAL(dir);
+
+   byte *expect = ecalloc(byte *, 256, 256);
+   byte *map    = ecalloc(byte *, 256, 256);
+   std::chrono::duration<double> refTime(0), newTime(0), tableTime(0);
+
+   for(size_t palnum = 0; palnum < numpals; palnum++)
+   {
+      rgba_t colours[256];
+      V_ColoursFromPLAYPAL(palnum, colours);
+
+      // the inverse table is shared with other users of the palette
+      auto tableStart = std::chrono::steady_clock::now();
+      V_GetInversePalette(colours);
+      tableTime += std::chrono::steady_clock::now() - tableStart;
+
+      for(size_t p = 0; p < earrlen(pcts); p++)
+      {
+         auto start = std::chrono::steady_clock::now();
+         V_buildTranMapReference(colours, expect, pcts[p]);
+         auto mid = std::chrono::steady_clock::now();
+         V_BuildTranMap(colours, map, pcts[p]);
+         auto end = std::chrono::steady_clock::now();
+
+         refTime += mid - start;
+         newTime += end - mid;
+
+         if(memcmp(expect, map, 256*256))
+         {
+            I_Error("V_TranMapUnitTest: palette %u at %d%% differs\n",
+                    (unsigned int)palnum, pcts[p]);
+         }
+      }
+   }
+
+   printf("V_TranMapUnitTest: %u tranmaps identical; exhaustive %.3f s, "
+          "V_BuildTranMap %.3f s (%.1fx), plus %.3f s building %u inverse "
+          "palettes\n", (unsigned int)(numpals * earrlen(pcts)), 
+          refTime.count(), newTime.count(), 
+          newTime.count() > 0.0 ? refTime.count() / newTime.count() : 0.0,
+          tableTime.count(), (unsigned int)numpals);
+
+   efree(expect);
+   efree(map);
+}
+#endif
+
 //=============================================================================
 //
 // COLORMAP Generation
@@ -1518,6 +2175,7 @@ void V_BuildTranMap(rgba_t colours[256], byte *map, int pct)
 //
 
 static uint8_t colormap[34*256];
+static bool    colormapbuilt;
 static float col_greyscale_r = 0.299f;
 static float col_greyscale_g = 0.587f;
 static float col_greyscale_b = 0.114f;
@@ -1540,8 +2198,14 @@ void V_GenerateCOLORMAP()
    rgba_t rgb;
    float  grey;
 
+   // may have been loaded from the table cache
+   if(colormapbuilt)
+      return;
+
    V_ColoursFromPLAYPAL(0, palette);
 
+   const VInversePalette &inverse = V_GetInversePalette(palette);
+
    // Generate 34 maps: the first 32 for diminishing light levels, the 33rd for
    // the inverted grey map used by invulnerability, and the 34th colormap,
    // which remains empty and black.
@@ -1584,9 +2248,11 @@ void V_GenerateCOLORMAP()
             rgb.b = playpal[2];
          }
 
-         colormap[256*l+c] = V_FindNearestColour(palette, rgb);
+         colormap[256*l+c] = inverse.nearest(rgb);
       }
    }
+
+   colormapbuilt = true;
 }
 
 //
@@ -1600,6 +2266,250 @@ void V_ConvertCOLORMAPToZip(ziparchive_t *zip)
    Zip_AddFile(zip, "COLORMAP", (byte *)colormap, 34*256, ZIP_FILE_BINARY, false);
 }
 
+//=============================================================================
+//
+// Derived Table Cache
+//
+// COLORMAP, the tranmaps and the inverse palettes depend on nothing but
+// PLAYPAL, which never changes for a given release of the game. With a cache
+// directory set, they are saved once built, in a file named for a hash of the
+// decoded PLAYPAL and the version of the code which generates them; later
+// runs over a disc with the same palettes map that file in instead. Tables
+// are saved in the machine's own byte order, as the cache is only meant to be
+// read by the machine which wrote it.
+//
+
+// Increase whenever any of the cached tables would come out differently.
+#define V_TABLECACHE_VERSION 1
+
+static const char tableCacheMagic[8] = { 'P','S','X','T','A','B','L','E' };
+
+struct tablecacheheader_t
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t byteOrder;  // 0x01020304 as written
+   uint32_t palSize;    // size of the decoded PLAYPAL which follows
+   uint32_t numInverse; // number of inverse palettes, which come last
+   uint32_t crc;        // CRC-32 of everything after the header
+};
+
+static qstring     tableCacheDir;   // directory of cache files, if any
+static MappedFile *tableCache;      // cache file the tables are loaded from
+
+//
+// V_SetTableCacheDir
+//
+// Set the directory, which must already exist, in which tables are cached.
+//
+void V_SetTableCacheDir(const char *dir)
+{
+   tableCacheDir = dir;
+}
+
+//
+// V_tableCachePath
+//
+static void V_tableCachePath(qstring &path)
+{
+   uint32_t crc = M_CRC32HashData(playpal, numpals * 768);
+   qstring  name;
+
+   name.Printf(64, "psxtables-%d-%08x.bin", V_TABLECACHE_VERSION, crc);
+
+   path = tableCacheDir;
+   path.pathConcatenate(name.constPtr());
+}
+
+//
+// V_LoadTableCache
+//
+// Call once PLAYPAL is loaded, and before any tables are built. If the cache
+// holds tables for these palettes, they are put in place with one mapping of
+// the cache file, so that they needn't be built again.
+//
+bool V_LoadTableCache()
+{
+   qstring path;
+   FILE   *f;
+
+   if(tableCacheDir.empty() || tableCache)
+      return false;
+
+   V_tableCachePath(path);
+
+   if(!(f = fopen(path.constPtr(), "rb")))
+      return false;
+
+   MappedFile *mapping = new MappedFile();
+   bool        mapped  = mapping->map(f);
+
+   fclose(f);
+
+   const byte *data      = mapping->getData();
+   size_t      size      = mapping->getSize();
+   size_t      palSize   = numpals * 768;
+   size_t      tableSize = 34*256 + 2*256*256;
+   tablecacheheader_t header;
+
+   if(!mapped || size < sizeof(header) + palSize + tableSize)
+   {
+      delete mapping;
+      return false;
+   }
+
+   memcpy(&header, data, sizeof(header));
+   data += sizeof(header);
+   size -= sizeof(header);
+
+   if(M_CRC32HashData(data, size) != header.crc)
+   {
+      printf("V_LoadTableCache: cache file '%s' is damaged\n", 
+             path.constPtr());
+      delete mapping;
+      return false;
+   }
+
+   // make sure it was written by this version, for these palettes
+   if(memcmp(header.magic, tableCacheMagic, sizeof(header.magic)) ||
+      header.version != V_TABLECACHE_VERSION || 
+      header.byteOrder != 0x01020304 || header.palSize != palSize ||
+      memcmp(data, playpal, palSize))
+   {
+      printf("V_LoadTableCache: ignoring stale cache file '%s'\n", 
+             path.constPtr());
+      delete mapping;
+      return false;
+   }
+   data += palSize;
+   size -= palSize;
+
+   // the inverse palettes come last, and must all be sound
+   const byte *inverse     = data + tableSize;
+   size_t      inverseSize = size - tableSize;
+   PODCollection<size_t> inverseSizes;
+
+   for(uint32_t i = 0; i < header.numInverse; i++)
+   {
+      size_t savedSize;
+
+      if(!(savedSize = VInversePalette::CheckSaved(inverse, inverseSize)))
+      {
+         printf("V_LoadTableCache: cache file '%s' is damaged\n", 
+                path.constPtr());
+         delete mapping;
+         return false;
+      }
+      inverseSizes.add(savedSize);
+      inverse     += savedSize;
+      inverseSize -= savedSize;
+   }
+
+   // COLORMAP is copied in; tranmaps are used straight from the mapping
+   memcpy(colormap, data, 34*256);
+   colormapbuilt = true;
+   data += 34*256;
+
+   if(!palettebuilt)
+   {
+      V_ColoursFromPLAYPAL(0, tranpalette);
+      palettebuilt = true;
+   }
+   tranmap_50    = const_cast<byte *>(data);
+   tranmap_25_75 = const_cast<byte *>(data + 256*256);
+   data += 2*256*256;
+
+   {
+      std::lock_guard<std::mutex> guard(inversePaletteLock);
+
+      for(size_t savedSize : inverseSizes)
+      {
+         inversePalettes.add(new VInversePalette(data));
+         data += savedSize;
+      }
+   }
+
+   tableCache = mapping;
+
+   printf("V_LoadTableCache: loaded tables from '%s'\n", path.constPtr());
+   return true;
+}
+
+//
+// V_SaveTableCache
+//
+// Call once COLORMAP and the tranmaps are built, to save them along with any
+// inverse palettes for later runs. Nothing is written if they were loaded
+// from the cache in the first place. The file is written under a temporary
+// name unique to this process and then renamed, so that other runs sharing
+// the cache never see it half written.
+//
+void V_SaveTableCache()
+{
+   if(tableCacheDir.empty() || tableCache || !colormapbuilt || 
+      !tranmap_50 || !tranmap_25_75)
+      return;
+
+   std::lock_guard<std::mutex> guard(inversePaletteLock);
+
+   size_t palSize = numpals * 768;
+   size_t size    = sizeof(tablecacheheader_t) + palSize + 34*256 + 2*256*256;
+
+   for(VInversePalette *inverse : inversePalettes)
+      size += inverse->getSavedSize();
+
+   ZAutoBuffer buffer(size, false);
+   byte *out = buffer.getAs<byte *>();
+
+   // header is filled in last
+   out += sizeof(tablecacheheader_t);
+   memcpy(out, playpal, palSize);
+   out += palSize;
+   memcpy(out, colormap, 34*256);
+   out += 34*256;
+   memcpy(out, tranmap_50, 256*256);
+   out += 256*256;
+   memcpy(out, tranmap_25_75, 256*256);
+   out += 256*256;
+
+   for(VInversePalette *inverse : inversePalettes)
+   {
+      inverse->save(out);
+      out += inverse->getSavedSize();
+   }
+
+   tablecacheheader_t header;
+   memcpy(header.magic, tableCacheMagic, sizeof(header.magic));
+   header.version    = V_TABLECACHE_VERSION;
+   header.byteOrder  = 0x01020304;
+   header.palSize    = static_cast<uint32_t>(palSize);
+   header.numInverse = static_cast<uint32_t>(inversePalettes.getLength());
+   header.crc        = M_CRC32HashData(buffer.getAs<byte *>() + sizeof(header),
+                                       size - sizeof(header));
+   memcpy(buffer.get(), &header, sizeof(header));
+
+   // another run may be writing the same file at once, so each writes its
+   // own temporary file
+   qstring path, temp;
+   V_tableCachePath(path);
+   M_TempFileName(path.constPtr(), temp);
+
+   FILE *f;
+   if(!(f = fopen(temp.constPtr(), "wb")))
+      return;
+
+   bool written = (fwrite(buffer.get(), 1, size, f) == size);
+
+   if(fclose(f) || !written || 
+      !M_ReplaceFile(temp.constPtr(), path.constPtr()))
+   {
+      remove(temp.constPtr());
+      return;
+   }
+
+   printf("V_SaveTableCache: saved tables to '%s'\n", path.constPtr());
+}
+
 //=============================================================================
 //
 // LIGHTS
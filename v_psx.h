@@ -66,11 +66,14 @@ protected:
    int16_t width;
    int16_t height;
 
-   uint8_t *pixels;
-   uint8_t *mask;
+   uint8_t *lumpData;          // lump the image was read from, if still held
+   uint8_t *pixels;            // may point into lumpData rather than own storage
+   mutable uint64_t *opacity;  // built from the pixels when first needed
 
-   void readImage(const void *data);
+   void readImage(size_t size);
+   void loadLump(WadDirectory &dir, int lumpnum);
    void adjustOffsets(const char *name);
+   const uint64_t *needOpacity() const;
 
 public:
    VPSXImage(WadDirectory &dir, int lumpnum);
@@ -85,20 +88,69 @@ public:
    int16_t getHeight() const { return height; }
    
    const uint8_t *getPixels() const { return pixels; }
-   const uint8_t *getMask()   const { return mask;   }
 
-   uint8_t *releasePixels()
-   {
-      uint8_t *ret = pixels;
-      pixels = nullptr;
-      return ret;
-   }
+   // Opacity plane: one bit per pixel, set where the pixel is not index 0.
+   // Stored a column at a time, getOpacityPitch() words to a column, with
+   // row y in bit y % 64 of word y / 64.
+   const uint64_t *getOpacity()      const { return needOpacity(); }
+   size_t          getOpacityPitch() const { return (height + 63) / 64; }
+
+   uint8_t *releasePixels();
 
    void *toPatch(size_t &size) const;
 
    void scaleForFourThree();
 };
 
+//
+// VInversePalette
+//
+// Table for finding the nearest entry in a palette to any colour, in constant
+// time for colours made from RGB555 as all PSX colours are. Results are those
+// of a full search of the palette: index 0 is never matched, and ties go to
+// the lowest index.
+//
+class VInversePalette : public ZoneObject
+{
+protected:
+   rgba_t    colours[256];
+   byte      direct[32*32*32];        // nearest entry to each RGB555 colour
+   uint32_t  cellStart[32*32*32 + 1]; // where each cell's candidates start
+   byte     *candidates;              // entries which may be nearest in a cell
+
+   int searchCell(int cell, rgba_t colour) const;
+
+public:
+   VInversePalette(const rgba_t pal[256]);
+   VInversePalette(const byte *saved);
+   ~VInversePalette();
+
+   // Tables may be saved to a buffer of getSavedSize() bytes, and restored
+   // from it by the constructor. CheckSaved returns the size of a saved table
+   // at data if it is sound and fits within size bytes, or 0 if not.
+   size_t getSavedSize() const;
+   void   save(byte *out) const;
+   static size_t CheckSaved(const byte *data, size_t size);
+
+   bool matches(const rgba_t pal[256]) const;
+   int  nearest(rgba_t colour) const;
+
+   // Entries which may be nearest to colours in a cell, in index order
+   const byte *getCandidates(int cell, size_t &count) const
+   {
+      count = cellStart[cell + 1] - cellStart[cell];
+      return candidates + cellStart[cell];
+   }
+
+   // Cell holding a colour; channels may be fractional, if rounded down
+   static int cellFor(int r, int g, int b)
+   {
+      return (r >> 3) | ((g >> 3) << 5) | ((b >> 3) << 10);
+   }
+};
+
+const VInversePalette &V_GetInversePalette(const rgba_t colours[256]);
+
 // Known PSX PLAYPAL palette numbers
 enum psxpalette_e
 {
@@ -128,8 +180,12 @@ enum psxpalette_e
 int V_FindNearestColour(rgba_t colours[256], rgba_t colour);
 void V_ColoursFromPLAYPAL(size_t palnum, rgba_t outpal[256]);
 void V_BuildTranMap(rgba_t colours[256], byte *map, int pct);
+void V_InitTranMaps();
 
 void V_LoadPLAYPAL(WadDirectory &dir);
+void V_SetTableCacheDir(const char *dir);
+bool V_LoadTableCache();
+void V_SaveTableCache();
 void V_GenerateCOLORMAP();
 void V_LoadLIGHTS(WadDirectory &dir);
 
@@ -141,11 +197,15 @@ void V_ConvertPLAYPALToZip(ziparchive_t *zip);
 void V_ConvertCOLORMAPToZip(ziparchive_t *zip);
 void V_ConvertLIGHTSToZip(ziparchive_t *zip);
 
+const char *V_ValidatePatch(const byte *data, size_t size);
+bool V_IsRawScreen(const char *lumpname);
+
 void V_ExtractMovie(const qstring &infile, const qstring &outfile, 
                     int offset, int length);
 
 #ifndef NO_UNIT_TESTS
 void V_ExplodePLAYPAL(WadDirectory &dir);
+void V_TranMapUnitTest(WadDirectory &dir);
 #endif
 
 #endif
@@ -33,6 +33,7 @@
 #endif
 
 #include <memory>
+#include <mutex>
 
 #include "z_zone.h"
 #include "i_system.h"
@@ -77,6 +78,17 @@ static size_t W_FileReadLump  (lumpinfo_t *, void *);
 static size_t W_ZipReadLump   (lumpinfo_t *, void *);
 static size_t W_JagReadLump   (lumpinfo_t *, void *);
 
+// Lump readers seek and read on FILE handles shared by the whole directory,
+// so the actual file access of reads coming from different threads must
+// take turns.
+static std::mutex lumpReadLock;
+
+// Source IDs and the table of source filenames are shared by every directory,
+// and private directories may be opened on more than one thread at once (map
+// wads are rebuilt on zip writer threads), so adding files takes turns too.
+// Adding a wad found inside a zip re-enters addFile, hence recursive.
+static std::recursive_mutex sourceLock;
+
 static lumptype_t LumpHandlers[lumpinfo_t::lump_numtypes] =
 {
    // direct lump
@@ -639,6 +651,8 @@ bool WadDirectory::addFile(wfileadd_t &addInfo)
       &WadDirectory::addSingleFile // W_FORMAT_FILE
    };
    
+   std::lock_guard<std::recursive_mutex> sourceGuard(sourceLock);
+
    openwad_t openData;
 
    // When loading a subfile, the physical file is already open.
@@ -721,6 +735,8 @@ int WadDirectory::addDirectory(const char *dirpath)
 
    PODCollection<dirfile_t> files;
    lumpinfo_t *newlumps;
+
+   std::lock_guard<std::recursive_mutex> sourceGuard(sourceLock);
    
    if(!(dir = opendir(dirpath)))
       return 0;
@@ -1168,6 +1184,8 @@ const char *WadDirectory::getLumpFileName(int lump)
    if(lump < 0 || lump >= numlumps)
       return NULL;
 
+   std::lock_guard<std::recursive_mutex> sourceGuard(sourceLock);
+
    size_t lumpIdx = static_cast<size_t>(lump);
    return WadDirectoryPimpl::FileNameForSource(lumpinfo[lumpIdx]->source);
 }
@@ -1627,6 +1645,7 @@ static size_t W_DirectReadLump(lumpinfo_t *l, void *dest)
 
    // killough 10/98: Add flashing disk indicator
    //I_BeginRead();
+   std::lock_guard<std::mutex> readGuard(lumpReadLock);
    fseek(direct.file, direct.position, SEEK_SET);
    ret = fread(dest, 1, size, direct.file);
    //I_EndRead();
@@ -1699,8 +1718,11 @@ static size_t W_JagReadLump(lumpinfo_t *l, void *dest)
 
    memset(dest, 0, l->size);
 
-   fseek(direct.file, direct.position, SEEK_SET);
-   ret = fread(dest, 1, size, direct.file);
+   {
+      std::lock_guard<std::mutex> readGuard(lumpReadLock);
+      fseek(direct.file, direct.position, SEEK_SET);
+      ret = fread(dest, 1, size, direct.file);
+   }
 
    Jag_Decompress((byte *)dest, dmpLmp);
 
@@ -1757,7 +1779,16 @@ static size_t W_FileReadLump(lumpinfo_t *l, void *dest)
 
 static size_t W_ZipReadLump(lumpinfo_t *l, void *dest)
 {
-   l->zip.zipLump->read(dest);
+   ZipLump *zipLump = l->zip.zipLump;
+
+   // lumps in mapped zips don't share a file position, so need no lock
+   if(zipLump->file->isMapped())
+      zipLump->read(dest);
+   else
+   {
+      std::lock_guard<std::mutex> readGuard(lumpReadLock);
+      zipLump->read(dest);
+   }
 
    // if I_Error wasn't invoked, we can assume the full read was
    // successful.
@@ -24,11 +24,16 @@
 //
 //-----------------------------------------------------------------------------
 
+#include <mutex>
+
 #include "z_auto.h"
 
+#include "i_mmap.h"
 #include "i_system.h"
 #include "m_buffer.h"
 #include "m_compare.h"
+#include "m_crc32.h"
+#include "m_parallel.h"
 #include "m_qstr.h"
 #include "m_structio.h"
 #include "m_swap.h"
@@ -165,6 +170,22 @@ static MStructReader<ZIPEndOfCentralDir> endCentralDirReader(&endSignature);
 #define ZF_ENCRYPTED   0x01
 #define BUFREADCOMMENT 0x400
 
+//
+// ZIP_Get16 / ZIP_Get32
+//
+// Little-endian fields straight out of a mapped file.
+//
+static uint16_t ZIP_Get16(const byte *p)
+{
+   return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t ZIP_Get32(const byte *p)
+{
+   return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+          (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
 //
 // ZIP_FindEndOfCentralDir
 //
@@ -289,6 +310,13 @@ ZipFile::~ZipFile()
       wads = NULL;
    }
 
+   // release the mapping
+   if(mapping)
+   {
+      delete mapping;
+      mapping = NULL;
+   }
+
    // close the disk file if it is open
    if(file)
    {
@@ -316,6 +344,17 @@ bool ZipFile::readEndOfCentralDir(InBuffer &fin, ZIPEndOfCentralDir &zcd)
    if(!endCentralDirReader.readFields(zcd, fin))
       return false;
 
+   return checkEndOfCentralDir(zcd);
+}
+
+//
+// ZipFile::checkEndOfCentralDir
+//
+// Protected method. Sanity check the end-of-central-directory data structure
+// and allocate the directory it describes.
+//
+bool ZipFile::checkEndOfCentralDir(const ZIPEndOfCentralDir &zcd)
+{
    // Basic sanity checks
 
    // Multi-disk zips aren't supported
@@ -342,7 +381,6 @@ bool ZipFile::readEndOfCentralDir(InBuffer &fin, ZIPEndOfCentralDir &zcd)
 //
 bool ZipFile::readCentralDirEntry(InBuffer &fin, ZipLump &lump, bool &skip)
 {
-   qstring namestr;
    ZIPCentralDirEntry entry;
 
    if(!centralDirReader.readFields(entry, fin))
@@ -362,6 +400,22 @@ bool ZipFile::readCentralDirEntry(InBuffer &fin, ZipLump &lump, bool &skip)
    if(fin.read(name, totalStrLen) != totalStrLen)
       return false;
 
+   return setupLump(entry, name, lump, skip);
+}
+
+//
+// ZipFile::setupLump
+//
+// Protected method.
+// Decide whether a central directory entry, followed by its name, should be
+// exposed as a lump, and if so fill in the lump from it. Returns the same as
+// readCentralDirEntry.
+//
+bool ZipFile::setupLump(const ZIPCentralDirEntry &entry, const char *name,
+                        ZipLump &lump, bool &skip)
+{
+   qstring namestr;
+
    // skip bogus unnamed entries and directories
    if(!entry.nameLength ||
       (name[entry.nameLength - 1] == '/' && entry.uncompressed == 0))
@@ -400,6 +454,7 @@ bool ZipFile::readCentralDirEntry(InBuffer &fin, ZipLump &lump, bool &skip)
    lump.method     = entry.method;
    lump.compressed = entry.compressed;
    lump.size       = entry.uncompressed;
+   lump.crc        = entry.crc32;
    lump.offset     = entry.localOffset;
 
    // Lump will need true offset to file data calculated the first time it is
@@ -451,6 +506,112 @@ bool ZipFile::readCentralDirectory(InBuffer &fin, long offset, uint32_t size)
    return true;
 }
 
+//
+// ZipFile::readMappedDirectory
+//
+// Protected method.
+// Read the whole directory straight out of the mapped file. Each lump's local
+// header is looked at right away as well, so that the lumps already know
+// where their data is, and reading them never has to modify them.
+//
+bool ZipFile::readMappedDirectory()
+{
+   const byte *base = mapping->getData();
+   size_t      size = mapping->getSize();
+
+   if(size < ZIP_END_OF_DIR_SIZE)
+      return false;
+
+   // Locate the end of the central directory, which may be followed by a
+   // comment of up to 64K
+   size_t pos    = size - ZIP_END_OF_DIR_SIZE;
+   size_t minpos = (pos > 0xffff) ? pos - 0xffff : 0;
+
+   while(memcmp(base + pos, ZIP_END_OF_DIR_SIG, 4))
+   {
+      if(pos-- == minpos)
+         return false;
+   }
+
+   ZIPEndOfCentralDir zcd;
+   const byte        *p = base + pos;
+
+   zcd.diskNum          = ZIP_Get16(p +  4);
+   zcd.centralDirDiskNo = ZIP_Get16(p +  6);
+   zcd.numEntriesOnDisk = ZIP_Get16(p +  8);
+   zcd.numEntriesTotal  = ZIP_Get16(p + 10);
+   zcd.centralDirSize   = ZIP_Get32(p + 12);
+   zcd.centralDirOffset = ZIP_Get32(p + 16);
+
+   if(!checkEndOfCentralDir(zcd))
+      return false;
+
+   int    lumpidx = 0;     // current index into lumps[]
+   size_t offset  = zcd.centralDirOffset;
+
+   for(int i = 0; i < numLumps; i++)
+   {
+      ZIPCentralDirEntry entry;
+
+      if(offset + ZIP_CENTRAL_DIR_SIZE > size)
+         return false;
+
+      p = base + offset;
+
+      // verify signature
+      if(memcmp(p, ZIP_CENTRAL_DIR_SIG, 4))
+         return false;
+
+      entry.gpFlags       = ZIP_Get16(p +  8);
+      entry.method        = ZIP_Get16(p + 10);
+      entry.crc32         = ZIP_Get32(p + 16);
+      entry.compressed    = ZIP_Get32(p + 20);
+      entry.uncompressed  = ZIP_Get32(p + 24);
+      entry.nameLength    = ZIP_Get16(p + 28);
+      entry.extraLength   = ZIP_Get16(p + 30);
+      entry.commentLength = ZIP_Get16(p + 32);
+      entry.localOffset   = ZIP_Get32(p + 42);
+
+      offset += ZIP_CENTRAL_DIR_SIZE + entry.nameLength + entry.extraLength +
+                entry.commentLength;
+      if(offset > size)
+         return false;
+
+      ZipLump &lump    = lumps[lumpidx];
+      bool     skipped = false;
+
+      if(!setupLump(entry, reinterpret_cast<const char *>(p) + ZIP_CENTRAL_DIR_SIZE,
+                    lump, skipped))
+         return false;
+
+      if(skipped)
+         continue;
+
+      // find the data past the local header
+      size_t local = static_cast<size_t>(lump.offset);
+      if(local + ZIP_LOCAL_FILE_SIZE > size ||
+         memcmp(base + local, ZIP_LOCAL_FILE_SIG, 4))
+         return false;
+
+      local += ZIP_LOCAL_FILE_SIZE + ZIP_Get16(base + local + 26) + 
+               ZIP_Get16(base + local + 28);
+
+      if(local + lump.compressed > size ||
+         (lump.method == METHOD_STORED && lump.size > lump.compressed))
+         return false;
+
+      lump.offset = static_cast<long>(local);
+      lump.flags &= ~LF_CALCOFFSET;
+
+      ++lumpidx;
+   }
+
+   // Adjust numLumps to omit skipped lumps
+   numLumps = lumpidx;
+
+   return true;
+}
+
 //
 // ZIP_LumpSortCB
 //
@@ -477,15 +638,29 @@ bool ZipFile::readFromFile(FILE *f)
    // remember our disk file
    file = f;
 
-   reader.openExisting(f, InBuffer::LENDIAN);
+   // If the file can be mapped, everything from here on is a matter of
+   // looking at memory, and lumps can be read from any thread.
+   mapping = new MappedFile();
+   if(mapping->map(f))
+   {
+      if(!readMappedDirectory())
+         return false;
+   }
+   else
+   {
+      delete mapping;
+      mapping = NULL;
 
-   // read in the end-of-central-directory structure
-   if(!readEndOfCentralDir(reader, zcd))
-      return false;
+      reader.openExisting(f, InBuffer::LENDIAN);
 
-   // read in the directory
-   if(!readCentralDirectory(reader, zcd.centralDirOffset, zcd.centralDirSize))
-      return false;
+      // read in the end-of-central-directory structure
+      if(!readEndOfCentralDir(reader, zcd))
+         return false;
+
+      // read in the directory
+      if(!readCentralDirectory(reader, zcd.centralDirOffset, zcd.centralDirSize))
+         return false;
+   }
 
    // sort the directory
    if(numLumps > 1)
@@ -494,14 +669,94 @@ bool ZipFile::readFromFile(FILE *f)
    return true;
 }
 
+//
+// ZIPInflaterPool
+//
+// Inflate streams shared by threads decompressing lumps from memory. Each
+// stream is only set up once, and reset whenever it is handed back.
+//
+class ZIPInflaterPool
+{
+protected:
+   PODCollection<z_stream *> streams;
+   std::mutex                lock;
+
+public:
+   ZIPInflaterPool() : streams(), lock() {}
+
+   ~ZIPInflaterPool()
+   {
+      for(z_stream *zs : streams)
+      {
+         inflateEnd(zs);
+         efree(zs);
+      }
+   }
+
+   z_stream *get()
+   {
+      {
+         std::lock_guard<std::mutex> poolGuard(lock);
+         if(!streams.isEmpty())
+            return streams.pop();
+      }
+
+      int code;
+      z_stream *zs = estructalloc(z_stream, 1);
+
+      if((code = inflateInit2(zs, -MAX_WBITS)) != Z_OK)
+         I_Error("ZIPInflaterPool::get: inflateInit2 failed with code %d\n", code);
+
+      return zs;
+   }
+
+   void release(z_stream *zs)
+   {
+      inflateReset(zs);
+
+      std::lock_guard<std::mutex> poolGuard(lock);
+      streams.add(zs);
+   }
+};
+
+//
+// ZIP_InflateMemory
+//
+// Decompress a whole deflated lump which is already in memory, using a stream
+// which has been set up for raw inflation. Returns NULL if successful, or a
+// description of what was wrong with the data.
+//
+static const char *ZIP_InflateMemory(z_stream *zs, const ZipLump &lump,
+                                     const byte *src, void *dest)
+{
+   zs->next_in   = const_cast<Bytef *>(src);
+   zs->avail_in  = static_cast<uInt>(lump.compressed);
+   zs->next_out  = static_cast<Bytef *>(dest);
+   zs->avail_out = static_cast<uInt>(lump.size);
+
+   int code = inflate(zs, Z_FINISH);
+
+   if(code != Z_STREAM_END && code != Z_OK && code != Z_BUF_ERROR)
+      return "invalid deflate stream";
+
+   if(zs->avail_out != 0)
+      return "truncated deflate stream";
+
+   return NULL;
+}
+
 //
 // ZipFile::checkForWadFiles
 //
 // Find all lumps that were marked as LF_ISEMBEDDEDWAD, load them into memory,
 // and then add them to the same directory to which this zip file belongs.
+// The wads are decompressed in parallel, but added in directory order, so
+// lookups come out the same as if they had been loaded one at a time.
 //
 void ZipFile::checkForWadFiles(WadDirectory &parentDir)
 {
+   PODCollection<ZipLump *> wadLumps;
+
    for(int i = 0; i < numLumps; i++)
    {
       if(!(lumps[i].flags & LF_ISEMBEDDEDWAD))
@@ -512,17 +767,86 @@ void ZipFile::checkForWadFiles(WadDirectory &parentDir)
       if(lumps[i].size < 28)
          continue;
 
-      ZipWad *zipwad = estructalloc(ZipWad, 1);
+      wadLumps.add(&lumps[i]);
+   }
 
-      zipwad->size   = static_cast<size_t>(lumps[i].size);
-      zipwad->buffer = Z_Malloc(zipwad->size, PU_STATIC, NULL);
+   if(wadLumps.isEmpty())
+      return;
 
-      lumps[i].read(zipwad->buffer);
+   size_t numWads = wadLumps.getLength();
+   PODCollection<byte *>       rawData; // read from the file, if not mapped
+   PODCollection<const byte *> wadData; // the finished wads
+   PODCollection<bool>         owned;   // whether to keep it as a ZipWad
 
-      parentDir.addInMemoryWad(zipwad->buffer, zipwad->size);
+   rawData.resize(numWads);
+   wadData.resize(numWads);
+   owned.resize(numWads);
 
-      // remember this zipwad
-      zipwad->links.insert(zipwad, &wads);
+   // The file can't be read from more than one thread, so pull in whatever
+   // isn't mapped first. Only the decompression needs to be spread out.
+   for(size_t w = 0; w < numWads; w++)
+   {
+      ZipLump &lump = *wadLumps[w];
+
+      if(!lump.getMappedData())
+      {
+         rawData[w] = emalloc(byte *, lump.compressed);
+         lump.readRaw(rawData[w]);
+      }
+   }
+
+   ZIPInflaterPool pool;
+
+   M_ParallelFor(numWads, [&] (size_t w)
+   {
+      ZipLump    &lump = *wadLumps[w];
+      const byte *src  = rawData[w] ? rawData[w] : lump.getMappedData();
+
+      if(lump.method == METHOD_STORED)
+      {
+         // a stored wad can be used right where it is
+         wadData[w] = src;
+         owned[w]   = (rawData[w] != NULL);
+         rawData[w] = NULL;
+      }
+      else
+      {
+         auto buffer = static_cast<byte *>(Z_Malloc(lump.size, PU_STATIC, NULL));
+
+         z_stream   *zs    = pool.get();
+         const char *error = ZIP_InflateMemory(zs, lump, src, buffer);
+
+         if(error)
+            I_Error("ZipFile::checkForWadFiles: %s in '%s'\n", error, lump.name);
+         pool.release(zs);
+         wadData[w] = buffer;
+         owned[w]   = true;
+      }
+
+      // Verify the data against the checksum from the directory.
+      if(M_CRC32HashData(wadData[w], lump.size) != lump.crc)
+         I_Error("ZipFile::checkForWadFiles: CRC mismatch on lump '%s'\n", lump.name);
+   });
+
+   for(size_t w = 0; w < numWads; w++)
+   {
+      if(rawData[w])
+         efree(rawData[w]);
+
+      auto   buffer = const_cast<byte *>(wadData[w]);
+      size_t size   = static_cast<size_t>(wadLumps[w]->size);
+
+      parentDir.addInMemoryWad(buffer, size);
+
+      if(owned[w])
+      {
+         // remember this zipwad
+         ZipWad *zipwad = estructalloc(ZipWad, 1);
+
+         zipwad->buffer = buffer;
+         zipwad->size   = size;
+         zipwad->links.insert(zipwad, &wads);
+      }
    }
 }
 
@@ -550,6 +874,48 @@ ZipLump &ZipFile::getLump(int lumpNum)
    return lumps[lumpNum];
 }
 
+//
+// ZipFile::findLump
+//
+// Look up a lump by its full name, or return NULL if there is no such lump.
+// Names are compared the same way they are normalized when read in.
+//
+ZipLump *ZipFile::findLump(const char *name)
+{
+   qstring key(name);
+
+   key.toLower();
+   key.replace("\\", '/');
+
+   int low = 0, high = numLumps - 1;
+
+   // directory was sorted by name when it was read
+   while(low <= high)
+   {
+      int mid = (low + high) / 2;
+      int cmp = strcmp(key.constPtr(), lumps[mid].name);
+
+      if(!cmp)
+         return &lumps[mid];
+      else if(cmp < 0)
+         high = mid - 1;
+      else
+         low = mid + 1;
+   }
+
+   return NULL;
+}
+
+//
+// ZipFile::getMappedBase
+//
+// Start of the mapped file, or NULL if it isn't mapped.
+//
+const byte *ZipFile::getMappedBase() const
+{
+   return mapping ? mapping->getData() : NULL;
+}
+
 //=============================================================================
 //
 // ZipFile::Lump Methods
@@ -582,7 +948,7 @@ static void ZIP_ReadStored(InBuffer &fin, void *buffer, uint32_t len)
 class ZIPDeflateReader
 {
 protected:
-   InBuffer &fin;       // input buffered file
+   InBuffer *fin;       // input buffered file, or NULL when reading memory
    z_stream  zlStream;  // zlib data structure
    bool      atEOF;     // hit EOF in InBuffer::Read
    
@@ -592,7 +958,7 @@ protected:
    {
       size_t bytesRead;
 
-      bytesRead = fin.read(deflateBuffer, DEFLATE_BUFF_SIZE);
+      bytesRead = fin->read(deflateBuffer, DEFLATE_BUFF_SIZE);
 
       if(bytesRead != DEFLATE_BUFF_SIZE)
          atEOF = true;
@@ -603,15 +969,28 @@ protected:
 
 public:
    ZIPDeflateReader(InBuffer &pFin) 
-      : fin(pFin), zlStream(), atEOF(false)
+      : fin(&pFin), zlStream(), atEOF(false)
+   {
+      buffer();
+      init();
+   }
+
+   // Inflate straight out of memory, such as a mapped file
+   ZIPDeflateReader(const byte *data, uint32_t len)
+      : fin(NULL), zlStream(), atEOF(true)
+   {
+      zlStream.next_in  = const_cast<Bytef *>(data);
+      zlStream.avail_in = static_cast<uInt>(len);
+      init();
+   }
+
+   void init()
    {
       int code;
       
       zlStream.zalloc = NULL;
       zlStream.zfree  = NULL;
 
-      buffer();
-      
       if((code = inflateInit2(&zlStream, -MAX_WBITS)) != Z_OK)
          I_Error("ZIPDeflateReader: inflateInit2 failed with code %d\n", code);
    }
@@ -656,6 +1035,19 @@ static void ZIP_ReadDeflated(InBuffer &fin, void *buffer, size_t len)
    reader.read(buffer, len);
 }
 
+//
+// ZipLump::getMappedData
+//
+// The lump's stored or compressed data, if its zip file is mapped into
+// memory; otherwise NULL.
+//
+const byte *ZipLump::getMappedData() const
+{
+   const byte *base = file->getMappedBase();
+
+   return base ? base + offset : NULL;
+}
+
 //
 // ZipLump::setAddress
 //
@@ -694,35 +1086,57 @@ void ZipLump::setAddress(InBuffer &fin)
 }
 
 //
-// ZipLump::read
+// ZipLump::seekToData
 //
-// Read a zip lump out of the zip file.
+// Position the reader at the start of the lump's stored or compressed data.
 //
-void ZipLump::read(void *buffer)
+void ZipLump::seekToData(InBuffer &fin)
 {
-   InBuffer reader;
-
-   reader.openExisting(file->getFile(), InBuffer::LENDIAN);
-
    // Calculate an offset beyond the lump's local file header, if such hasn't
    // been done already. This will modify Lump::offset. Note if we call this,
    // we'll end up in reading position, so a seek is unnecessary then.
    if(flags & ZipFile::LF_CALCOFFSET)
-      setAddress(reader);
+      setAddress(fin);
    else
    {
-      if(reader.seek(offset, SEEK_SET))
-         I_Error("ZipLump::read: could not seek to lump '%s'\n", name);
+      if(fin.seek(offset, SEEK_SET))
+         I_Error("ZipLump::seekToData: could not seek to lump '%s'\n", name);
+   }
+}
+
+//
+// ZipLump::read
+//
+// Read a zip lump out of the zip file.
+//
+void ZipLump::read(void *buffer)
+{
+   InBuffer    reader;
+   const byte *mapped = getMappedData();
+
+   if(!mapped)
+   {
+      reader.openExisting(file->getFile(), InBuffer::LENDIAN);
+      seekToData(reader);
    }
 
    // Read the file according to its indicated storage method.
    switch(method)
    {
    case ZipFile::METHOD_STORED:
-      ZIP_ReadStored(reader, buffer, size);
+      if(mapped)
+         memcpy(buffer, mapped, size);
+      else
+         ZIP_ReadStored(reader, buffer, size);
       break;
    case ZipFile::METHOD_DEFLATE:
-      ZIP_ReadDeflated(reader, buffer, size);
+      if(mapped)
+      {
+         ZIPDeflateReader inflater(mapped, compressed);
+         inflater.read(buffer, size);
+      }
+      else
+         ZIP_ReadDeflated(reader, buffer, size);
       break;
    default:
       // shouldn't happen; files with other methods are removed from the directory
@@ -730,6 +1144,93 @@ void ZipLump::read(void *buffer)
               method);
       break;
    }
+
+   // Verify the data against the checksum from the directory.
+   if(M_CRC32HashData(buffer, size) != crc)
+      I_Error("ZipLump::read: CRC mismatch on lump '%s'\n", name);
+}
+
+//
+// ZipLump::verify
+//
+// Read a zip lump out of the zip file and check it against its CRC, like
+// read, but report any problem with the data instead of treating it as fatal.
+// Returns NULL if the lump is sound, or a description of what is wrong with
+// it. Lumps of a mapped zip may be verified from several threads at once.
+//
+const char *ZipLump::verify(void *buffer)
+{
+   const byte *src   = getMappedData();
+   byte       *raw   = NULL;
+   const char *error = NULL;
+
+   if(!src)
+   {
+      raw = emalloc(byte *, compressed ? compressed : 1);
+      readRaw(raw);
+      src = raw;
+   }
+
+   switch(method)
+   {
+   case ZipFile::METHOD_STORED:
+      if(compressed != size)
+         error = "stored size mismatch";
+      else
+         memcpy(buffer, src, size);
+      break;
+   case ZipFile::METHOD_DEFLATE:
+      {
+         z_stream zs;
+         memset(&zs, 0, sizeof(zs));
+
+         if(inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+            error = "cannot initialize inflate";
+         else
+         {
+            error = ZIP_InflateMemory(&zs, *this, src, buffer);
+            inflateEnd(&zs);
+         }
+      }
+      break;
+   default:
+      error = "unsupported compression method";
+      break;
+   }
+
+   if(!error && M_CRC32HashData(buffer, size) != crc)
+      error = "CRC mismatch";
+
+   if(raw)
+      efree(raw);
+
+   return error;
+}
+
+//
+// ZipLump::readRaw
+//
+// Read a zip lump's data exactly as it is stored in the zip file, without
+// decompressing it. The buffer must hold "compressed" bytes.
+//
+void ZipLump::readRaw(void *buffer)
+{
+   const byte *mapped;
+
+   if((mapped = getMappedData()))
+   {
+      memcpy(buffer, mapped, compressed);
+      return;
+   }
+
+   InBuffer reader;
+
+   reader.openExisting(file->getFile(), InBuffer::LENDIAN);
+
+   seekToData(reader);
+
+   if(reader.read(buffer, compressed) != compressed)
+      I_Error("ZipLump::readRaw: failed to read lump '%s'\n", name);
 }
 
 // EOF
@@ -31,7 +31,9 @@
 #include "m_dllist.h"
 
 class  InBuffer;
+class  MappedFile;
 class  WadDirectory;
+struct ZIPCentralDirEntry;
 struct ZIPEndOfCentralDir;
 class  ZipFile;
 
@@ -42,12 +44,18 @@ struct ZipLump
    int       method;     // compression method
    uint32_t  compressed; // compressed size
    uint32_t  size;       // uncompressed size
+   uint32_t  crc;        // CRC-32 of uncompressed data
    long      offset;     // file offset
    char     *name;       // full name 
    ZipFile  *file;       // parent zipfile
 
    void setAddress(InBuffer &fin);
+   void seekToData(InBuffer &fin);
    void read(void *buffer);
+   void readRaw(void *buffer);
+   const char *verify(void *buffer);
+
+   const byte *getMappedData() const;
 };
 
 struct ZipWad
@@ -84,18 +92,24 @@ protected:
    ZipLump *lumps;    // directory
    int      numLumps; // directory size
    FILE    *file;     // physical disk file
+   MappedFile *mapping; // file mapped into memory, if it could be
 
    DLListItem<ZipFile> links; // links for use by WadDirectory
 
    DLListItem<ZipWad> *wads;  // wads loaded from inside the zip
 
    bool readEndOfCentralDir(InBuffer &fin, ZIPEndOfCentralDir &zcd);
+   bool checkEndOfCentralDir(const ZIPEndOfCentralDir &zcd);
    bool readCentralDirEntry(InBuffer &fin, ZipLump &lump, bool &skip);
+   bool setupLump(const ZIPCentralDirEntry &entry, const char *name, 
+                  ZipLump &lump, bool &skip);
    bool readCentralDirectory(InBuffer &fin, long offset, uint32_t size);
+   bool readMappedDirectory();
 
 public:
    ZipFile() 
-      : ZoneObject(), lumps(NULL), numLumps(0), file(NULL), links(), wads(NULL) 
+      : ZoneObject(), lumps(NULL), numLumps(0), file(NULL), mapping(NULL),
+        links(), wads(NULL) 
    {
    }
    
@@ -107,8 +121,11 @@ public:
 
    void     linkTo(DLListItem<ZipFile> **head);
    ZipLump &getLump(int lumpNum);
+   ZipLump *findLump(const char *name);
    int      getNumLumps() const { return numLumps; }   
    FILE    *getFile()     const { return file;     }
+   bool     isMapped()    const { return mapping != NULL; }
+   const byte *getMappedBase() const;
 };
 
 #endif
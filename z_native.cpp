@@ -38,6 +38,8 @@
 //
 //-----------------------------------------------------------------------------
 
+#include <mutex>
+
 #include "z_zone.h"
 #include "i_system.h"
 #include "doomtype.h"
@@ -122,7 +124,22 @@ static memblock_t *blockbytag[PU_MAX];   // used for tracking all zone blocks
 
 // ZoneObject class statics
 ZoneObject *ZoneObject::objectbytag[PU_MAX]; // like blockbytag but for objects
-void       *ZoneObject::newalloc;            // most recent ZoneObject alloc
+thread_local void *ZoneObject::newalloc;     // most recent ZoneObject alloc
+
+//
+// Z_Lock
+//
+// The block lists are shared by every thread, so all operations that touch
+// them are serialized. The lock is recursive because Z_Malloc may purge with
+// Z_FreeTags, which in turn calls Z_Free.
+//
+static std::recursive_mutex &Z_Lock()
+{
+   static std::recursive_mutex zonelock;
+   return zonelock;
+}
+
+#define ZONE_LOCK() std::lock_guard<std::recursive_mutex> zoneguard(Z_Lock())
 
 //=============================================================================
 //
@@ -316,6 +333,8 @@ void *(Z_Malloc)(size_t size, int tag, void **user, const char *file, int line)
    register memblock_t *block;
    byte *ret;
 
+   ZONE_LOCK();
+
    DEBUG_CHECKHEAP();
 
    Z_IDCheckNB(IDBOOL(tag >= PU_PURGELEVEL && !user),
@@ -374,6 +393,8 @@ void *(Z_Malloc)(size_t size, int tag, void **user, const char *file, int line)
 //
 void (Z_Free)(void *p, const char *file, int line)
 {
+   ZONE_LOCK();
+
    DEBUG_CHECKHEAP();
 
    if(p)
@@ -429,6 +450,8 @@ void (Z_FreeTags)(int lowtag, int hightag, const char *file, int line)
 {
    memblock_t *block;
 
+   ZONE_LOCK();
+
    // haleyjd 03/30/2011: delete ZoneObjects of the same tags as well
    ZoneObject::FreeTags(lowtag, hightag);
    
@@ -463,6 +486,8 @@ void (Z_FreeTags)(int lowtag, int hightag, const char *file, int line)
 void (Z_ChangeTag)(void *ptr, int tag, const char *file, int line)
 {
    memblock_t *block;
+
+   ZONE_LOCK();
    
    DEBUG_CHECKHEAP();
    
@@ -514,6 +539,8 @@ void *(Z_Realloc)(void *ptr, size_t n, int tag, void **user,
    void *p;
    memblock_t *block, *newblock, *origblock;
 
+   ZONE_LOCK();
+
    // if not allocated at all, defer to Z_Malloc
    if(!ptr)
       return (Z_Malloc)(n, tag, user, file, line);
@@ -896,6 +923,8 @@ void Z_SysFree(void *p)
 //
 void Z_FreeAlloca(void)
 {
+   ZONE_LOCK();
+
    memblock_t *block = blockbytag[PU_AUTO];
 
    if(!block)
@@ -1015,6 +1044,8 @@ ZoneObject::ZoneObject()
 {
    if(newalloc)
    {
+      ZONE_LOCK();
+
       zonealloc = newalloc;
       newalloc  = NULL;
       addToTagList(getZoneTag());
@@ -1058,6 +1089,8 @@ void ZoneObject::changeTag(int tag)
 {
    if(zonealloc) // If not a zone object, this is a no-op
    {
+      ZONE_LOCK();
+
       int curtag = getZoneTag();
 
       // not actually changing?
@@ -1085,6 +1118,8 @@ ZoneObject::~ZoneObject()
 {
    if(zonealloc)
    {
+      ZONE_LOCK();
+
       removeFromTagList();
       zonealloc = NULL;
    }
@@ -1129,6 +1164,8 @@ void ZoneObject::FreeTags(int lowtag, int hightag)
 {
    ZoneObject *obj;
 
+   ZONE_LOCK();
+
    if(lowtag <= PU_FREE)
       lowtag = PU_FREE+1;
 
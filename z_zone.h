@@ -193,7 +193,7 @@ class ZoneObject
 private:
    // static data
    static ZoneObject *objectbytag[PU_MAX];
-   static void *newalloc;
+   static thread_local void *newalloc;
 
    // instance data
    void        *zonealloc; // If non-null, the object is living on the zone heap
@@ -0,0 +1,1498 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//    Exhaustive deflate encoder.
+//
+//    zlib chooses each match greedily, with a little lookahead, and codes
+//    everything it has seen so far as one block. Here, every match available
+//    at every position is found up front, then the cheapest way through the
+//    input is found by dynamic programming against estimated bit costs. The
+//    costs come from the symbol statistics of the previous pass, so each pass
+//    refines the next. Before that, the input is split into blocks at points
+//    where coding the two halves with their own Huffman trees comes out
+//    smaller. The approach is that of Google's Zopfli.
+//
+//-----------------------------------------------------------------------------
+
+#include <math.h>
+
+#include "z_zone.h"
+
+#include "i_system.h"
+#include "m_collection.h"
+#include "m_parallel.h"
+#include "zip_optimal.h"
+
+#include "zlib/zlib.h"
+
+#define ZOPT_WINDOW    32768 // deflate's window size
+#define ZOPT_MINMATCH  3
+#define ZOPT_MAXMATCH  258
+#define ZOPT_NUMLL     288   // literal/length alphabet size
+#define ZOPT_NUMD      32    // distance alphabet size
+#define ZOPT_NUMCL     19    // code length alphabet size
+#define ZOPT_HASHBITS  15
+#define ZOPT_MAXCHAIN  4096  // most earlier positions to try matching against
+#define ZOPT_MAXBLOCKS 15    // most blocks to split the input into
+
+// Too little work to be worth handing out to other threads
+#define ZOPT_MINPARALLEL 8192
+
+//=============================================================================
+//
+// Deflate Alphabets
+//
+
+static const int lengthBase[29] =
+{
+   3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+   67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const int lengthExtra[29] =
+{
+   0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+   5, 5, 5, 5, 0
+};
+
+static const int distBase[30] =
+{
+   1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+   769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const int distExtra[30] =
+{
+   0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+   11, 11, 12, 12, 13, 13
+};
+
+// Order in which code length code lengths are sent
+static const int clOrder[ZOPT_NUMCL] =
+{
+   16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+//
+// zoptlengthtab_t
+//
+// Match length to length code lookup.
+//
+struct zoptlengthtab_t
+{
+   byte code[ZOPT_MAXMATCH + 1]; // index into lengthBase for each length
+
+   zoptlengthtab_t()
+   {
+      int c = 0;
+      for(int len = ZOPT_MINMATCH; len <= ZOPT_MAXMATCH; len++)
+      {
+         while(c < 28 && len >= lengthBase[c + 1])
+            ++c;
+         code[len] = static_cast<byte>(c);
+      }
+   }
+};
+
+static const zoptlengthtab_t &ZOpt_lengthTab()
+{
+   static zoptlengthtab_t tab;
+   return tab;
+}
+
+//
+// ZOpt_distCode
+//
+// Index into distBase for a distance.
+//
+static int ZOpt_distCode(int dist)
+{
+   if(dist <= 4)
+      return dist - 1;
+
+   int d = dist - 1;
+   int l = 0;
+   while((d >> (l + 1)) != 0)
+      ++l;
+
+   return l * 2 + ((d >> (l - 1)) & 1);
+}
+
+//=============================================================================
+//
+// LZ77 Data
+//
+
+// One literal (dist == 0) or length/distance pair
+struct zoptlz_t
+{
+   uint16_t litlen;
+   uint16_t dist;
+};
+
+typedef PODCollection<zoptlz_t> zoptstore_t;
+
+//
+// zoptstats_t
+//
+// Symbol frequencies for a run of LZ77 data.
+//
+struct zoptstats_t
+{
+   double ll[ZOPT_NUMLL];
+   double d[ZOPT_NUMD];
+
+   void clear()
+   {
+      for(double &f : ll)
+         f = 0;
+      for(double &f : d)
+         f = 0;
+   }
+
+   void count(const zoptlz_t *lz, size_t numlz)
+   {
+      const zoptlengthtab_t &lt = ZOpt_lengthTab();
+
+      clear();
+      for(size_t i = 0; i < numlz; i++)
+      {
+         if(!lz[i].dist)
+            ll[lz[i].litlen] += 1;
+         else
+         {
+            ll[257 + lt.code[lz[i].litlen]] += 1;
+            d[ZOpt_distCode(lz[i].dist)] += 1;
+         }
+      }
+      ll[256] = 1; // end of block
+   }
+};
+
+//=============================================================================
+//
+// Huffman Codes
+//
+
+// A leaf, or a package of two nodes from the previous list
+struct zoptpmnode_t
+{
+   double weight;
+   int    leaf;        // symbol, or -1 if a package
+   int    left, right; // children, if a package
+};
+
+//
+// ZOpt_countLeaves
+//
+static void ZOpt_countLeaves(const PODCollection<zoptpmnode_t> &pool, int node,
+                             unsigned *lengths)
+{
+   const zoptpmnode_t &n = pool[node];
+
+   if(n.leaf >= 0)
+      ++lengths[n.leaf];
+   else
+   {
+      ZOpt_countLeaves(pool, n.left,  lengths);
+      ZOpt_countLeaves(pool, n.right, lengths);
+   }
+}
+
+//
+// ZOpt_codeLengths
+//
+// Calculate optimal code lengths no longer than maxbits for the given
+// frequencies, using the package-merge algorithm. Symbols with no uses get
+// no code.
+//
+static void ZOpt_codeLengths(const double *freqs, int n, int maxbits,
+                             unsigned *lengths)
+{
+   PODCollection<zoptpmnode_t> pool;
+   PODCollection<int>          cur, pkg, merged;
+   int numleaves = 0;
+
+   for(int i = 0; i < n; i++)
+   {
+      lengths[i] = 0;
+      if(freqs[i] > 0)
+      {
+         zoptpmnode_t &node = pool.addNew();
+         node.weight = freqs[i];
+         node.leaf   = i;
+         node.left   = node.right = -1;
+         ++numleaves;
+      }
+   }
+
+   if(numleaves <= 2)
+   {
+      for(int i = 0; i < numleaves; i++)
+         lengths[pool[i].leaf] = 1;
+      return;
+   }
+
+   // sort leaves by weight, then by symbol, so the result is well-defined
+   auto leaves = &pool[0];
+   for(int i = 1; i < numleaves; i++)
+   {
+      zoptpmnode_t tmp = leaves[i];
+      int j = i - 1;
+      while(j >= 0 && (leaves[j].weight > tmp.weight ||
+                       (leaves[j].weight == tmp.weight && leaves[j].leaf > tmp.leaf)))
+      {
+         leaves[j + 1] = leaves[j];
+         --j;
+      }
+      leaves[j + 1] = tmp;
+   }
+
+   for(int i = 0; i < numleaves; i++)
+      cur.add(i);
+
+   for(int level = 1; level < maxbits; level++)
+   {
+      // package up pairs from the previous list
+      pkg.makeEmpty();
+      for(size_t i = 0; i + 1 < cur.getLength(); i += 2)
+      {
+         zoptpmnode_t node;
+         node.weight = pool[cur[i]].weight + pool[cur[i + 1]].weight;
+         node.leaf   = -1;
+         node.left   = cur[i];
+         node.right  = cur[i + 1];
+         pool.add(node);
+         pkg.add(static_cast<int>(pool.getLength() - 1));
+      }
+
+      // and merge them with the leaves
+      merged.makeEmpty();
+      size_t li = 0, pi = 0;
+      while(li < (size_t)numleaves || pi < pkg.getLength())
+      {
+         if(pi == pkg.getLength() ||
+            (li < (size_t)numleaves && pool[li].weight <= pool[pkg[pi]].weight))
+            merged.add(static_cast<int>(li++));
+         else
+            merged.add(pkg[pi++]);
+      }
+
+      cur.makeEmpty();
+      for(int node : merged)
+         cur.add(node);
+   }
+
+   // each time a leaf appears among the chosen nodes adds a bit to its code
+   for(int i = 0; i < 2 * numleaves - 2; i++)
+      ZOpt_countLeaves(pool, cur[i], lengths);
+}
+
+//
+// ZOpt_canonicalCodes
+//
+// Assign deflate's canonical codes to a set of code lengths.
+//
+static void ZOpt_canonicalCodes(const unsigned *lengths, int n, unsigned *codes)
+{
+   unsigned blcount[16] = { 0 };
+   unsigned nextcode[16];
+   unsigned code = 0;
+
+   for(int i = 0; i < n; i++)
+      ++blcount[lengths[i]];
+   blcount[0] = 0;
+
+   for(int bits = 1; bits < 16; bits++)
+   {
+      code = (code + blcount[bits - 1]) << 1;
+      nextcode[bits] = code;
+   }
+
+   for(int i = 0; i < n; i++)
+      codes[i] = lengths[i] ? nextcode[lengths[i]]++ : 0;
+}
+
+//=============================================================================
+//
+// Bit Output
+//
+
+class ZOptBitWriter
+{
+protected:
+   PODCollection<byte> &out;
+   uint32_t bitbuf;
+   int      bitcount;
+
+public:
+   ZOptBitWriter(PODCollection<byte> &pOut)
+      : out(pOut), bitbuf(0), bitcount(0)
+   {
+   }
+
+   void addBits(uint32_t value, int nbits)
+   {
+      bitbuf   |= value << bitcount;
+      bitcount += nbits;
+      while(bitcount >= 8)
+      {
+         out.add(static_cast<byte>(bitbuf));
+         bitbuf  >>= 8;
+         bitcount -= 8;
+      }
+   }
+
+   // Huffman codes go out most significant bit first
+   void addCode(uint32_t code, int nbits)
+   {
+      uint32_t rev = 0;
+      for(int i = 0; i < nbits; i++)
+         rev |= ((code >> i) & 1) << (nbits - 1 - i);
+      addBits(rev, nbits);
+   }
+
+   void alignToByte()
+   {
+      if(bitcount)
+         addBits(0, 8 - bitcount);
+   }
+};
+
+//=============================================================================
+//
+// Block Coding
+//
+
+enum
+{
+   ZOPT_BLOCK_STORED,
+   ZOPT_BLOCK_FIXED,
+   ZOPT_BLOCK_DYNAMIC
+};
+
+//
+// zopttrees_t
+//
+// Code lengths used to code one block.
+//
+struct zopttrees_t
+{
+   unsigned ll[ZOPT_NUMLL];
+   unsigned d[ZOPT_NUMD];
+
+   void setFixed()
+   {
+      for(int i = 0; i < ZOPT_NUMLL; i++)
+         ll[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+      for(int i = 0; i < ZOPT_NUMD; i++)
+         d[i] = 5;
+   }
+
+   void setDynamic(const zoptstats_t &stats)
+   {
+      ZOpt_codeLengths(stats.ll, ZOPT_NUMLL, 15, ll);
+      ZOpt_codeLengths(stats.d,  ZOPT_NUMD,  15, d);
+
+      // Some inflaters choke on fewer than two distance codes
+      int used = 0;
+      for(unsigned len : d)
+         used += (len != 0);
+      if(used < 2)
+      {
+         if(!d[0])
+            d[0] = 1;
+         else
+            d[1] = 1;
+         if(!used)
+            d[1] = 1;
+      }
+   }
+};
+
+//
+// ZOpt_codeTrees
+//
+// Work out, and optionally write, the header describing a dynamic block's
+// Huffman codes. Returns its size in bits.
+//
+static size_t ZOpt_codeTrees(const zopttrees_t &trees, ZOptBitWriter *bw)
+{
+   unsigned lens[ZOPT_NUMLL + ZOPT_NUMD];
+   int      hlit = 29, hdist = 30; // 286 literal/length and 30 distance codes
+
+   // trim unused codes from the ends
+   while(hlit > 0 && !trees.ll[257 + hlit - 1])
+      --hlit;
+   while(hdist > 0 && !trees.d[hdist - 1])
+      --hdist;
+   hdist = (hdist > 0) ? hdist : 1;
+
+   int numll = 257 + hlit;
+   int total = numll + hdist;
+
+   for(int i = 0; i < numll; i++)
+      lens[i] = trees.ll[i];
+   for(int i = 0; i < hdist; i++)
+      lens[numll + i] = trees.d[i];
+
+   // run-length code the lengths
+   PODCollection<unsigned> syms, extras;
+   double clfreqs[ZOPT_NUMCL] = { 0 };
+
+   auto emit = [&] (unsigned sym, unsigned extra)
+   {
+      syms.add(sym);
+      extras.add(extra);
+      clfreqs[sym] += 1;
+   };
+
+   for(int i = 0; i < total; )
+   {
+      unsigned len = lens[i];
+      int      run = 1;
+
+      while(i + run < total && lens[i + run] == len)
+         ++run;
+      i += run;
+
+      if(!len)
+      {
+         while(run >= 11)
+         {
+            int r = (run > 138) ? 138 : run;
+            emit(18, r - 11);
+            run -= r;
+         }
+         if(run >= 3)
+         {
+            emit(17, run - 3);
+            run = 0;
+         }
+      }
+      else
+      {
+         emit(len, 0);
+         --run;
+         while(run >= 3)
+         {
+            int r = (run > 6) ? 6 : run;
+            emit(16, r - 3);
+            run -= r;
+         }
+      }
+
+      while(run-- > 0)
+         emit(len, 0);
+   }
+
+   unsigned cllens[ZOPT_NUMCL], clcodes[ZOPT_NUMCL];
+   ZOpt_codeLengths(clfreqs, ZOPT_NUMCL, 7, cllens);
+
+   // the code length code must be complete, so it needs two symbols at least
+   int used = 0;
+   for(unsigned len : cllens)
+      used += (len != 0);
+   for(int i = 0; used < 2 && i < ZOPT_NUMCL; i++)
+   {
+      if(!cllens[i])
+      {
+         cllens[i] = 1;
+         ++used;
+      }
+   }
+
+   int hclen = ZOPT_NUMCL;
+   while(hclen > 4 && !cllens[clOrder[hclen - 1]])
+      --hclen;
+
+   size_t bits = 5 + 5 + 4 + 3 * hclen;
+   for(size_t i = 0; i < syms.getLength(); i++)
+   {
+      bits += cllens[syms[i]];
+      bits += (syms[i] == 16) ? 2 : (syms[i] == 17) ? 3 : (syms[i] == 18) ? 7 : 0;
+   }
+
+   if(bw)
+   {
+      ZOpt_canonicalCodes(cllens, ZOPT_NUMCL, clcodes);
+
+      bw->addBits(hlit, 5);
+      bw->addBits(hdist - 1, 5);
+      bw->addBits(hclen - 4, 4);
+      for(int i = 0; i < hclen; i++)
+         bw->addBits(cllens[clOrder[i]], 3);
+
+      for(size_t i = 0; i < syms.getLength(); i++)
+      {
+         unsigned sym = syms[i];
+         bw->addCode(clcodes[sym], cllens[sym]);
+         if(sym == 16)
+            bw->addBits(extras[i], 2);
+         else if(sym == 17)
+            bw->addBits(extras[i], 3);
+         else if(sym == 18)
+            bw->addBits(extras[i], 7);
+      }
+   }
+
+   return bits;
+}
+
+//
+// ZOpt_dataBits
+//
+// Size in bits of LZ77 data plus end of block marker, coded with the given
+// code lengths.
+//
+static size_t ZOpt_dataBits(const zopttrees_t &trees, const zoptlz_t *lz,
+                            size_t numlz)
+{
+   const zoptlengthtab_t &lt = ZOpt_lengthTab();
+   size_t bits = trees.ll[256];
+
+   for(size_t i = 0; i < numlz; i++)
+   {
+      if(!lz[i].dist)
+         bits += trees.ll[lz[i].litlen];
+      else
+      {
+         int lc = lt.code[lz[i].litlen];
+         int dc = ZOpt_distCode(lz[i].dist);
+         bits += trees.ll[257 + lc] + lengthExtra[lc];
+         bits += trees.d[dc] + distExtra[dc];
+      }
+   }
+
+   return bits;
+}
+
+//
+// ZOpt_storedBits
+//
+// Size in bits of len bytes sent as stored blocks, assuming the worst case
+// for padding out to a byte boundary.
+//
+static size_t ZOpt_storedBits(size_t len)
+{
+   size_t numblocks = (len + 65534) / 65535;
+   if(!numblocks)
+      numblocks = 1;
+
+   return numblocks * (3 + 7 + 32) + len * 8;
+}
+
+//
+// ZOpt_blockBits
+//
+// Size in bits of LZ77 data coded as a block of the given type.
+//
+static size_t ZOpt_blockBits(const zoptlz_t *lz, size_t numlz, int type)
+{
+   zopttrees_t trees;
+
+   if(type == ZOPT_BLOCK_FIXED)
+   {
+      trees.setFixed();
+      return 3 + ZOpt_dataBits(trees, lz, numlz);
+   }
+
+   zoptstats_t stats;
+   stats.count(lz, numlz);
+   trees.setDynamic(stats);
+
+   return 3 + ZOpt_codeTrees(trees, NULL) + ZOpt_dataBits(trees, lz, numlz);
+}
+
+//
+// ZOpt_writeBlock
+//
+// Write out a block of the given type. Stored blocks are written from the
+// source data the LZ77 data covers.
+//
+static void ZOpt_writeBlock(ZOptBitWriter &bw, int type, bool final,
+                            const zoptlz_t *lz, size_t numlz,
+                            const byte *src, size_t srclen)
+{
+   if(type == ZOPT_BLOCK_STORED)
+   {
+      size_t pos = 0;
+      do
+      {
+         size_t len  = srclen - pos;
+         if(len > 65535)
+            len = 65535;
+         bool   last = (pos + len == srclen);
+
+         bw.addBits((final && last) ? 1 : 0, 1);
+         bw.addBits(0, 2);
+         bw.alignToByte();
+         bw.addBits(static_cast<uint32_t>(len), 16);
+         bw.addBits(static_cast<uint32_t>(~len & 0xffff), 16);
+         for(size_t i = 0; i < len; i++)
+            bw.addBits(src[pos + i], 8);
+
+         pos += len;
+      }
+      while(pos < srclen);
+      return;
+   }
+
+   zopttrees_t trees;
+   unsigned    llcodes[ZOPT_NUMLL], dcodes[ZOPT_NUMD];
+
+   bw.addBits(final ? 1 : 0, 1);
+   bw.addBits(type, 2);
+
+   if(type == ZOPT_BLOCK_FIXED)
+      trees.setFixed();
+   else
+   {
+      zoptstats_t stats;
+      stats.count(lz, numlz);
+      trees.setDynamic(stats);
+      ZOpt_codeTrees(trees, &bw);
+   }
+
+   ZOpt_canonicalCodes(trees.ll, ZOPT_NUMLL, llcodes);
+   ZOpt_canonicalCodes(trees.d,  ZOPT_NUMD,  dcodes);
+
+   const zoptlengthtab_t &lt = ZOpt_lengthTab();
+
+   for(size_t i = 0; i < numlz; i++)
+   {
+      if(!lz[i].dist)
+         bw.addCode(llcodes[lz[i].litlen], trees.ll[lz[i].litlen]);
+      else
+      {
+         int lc = lt.code[lz[i].litlen];
+         int dc = ZOpt_distCode(lz[i].dist);
+
+         bw.addCode(llcodes[257 + lc], trees.ll[257 + lc]);
+         bw.addBits(lz[i].litlen - lengthBase[lc], lengthExtra[lc]);
+         bw.addCode(dcodes[dc], trees.d[dc]);
+         bw.addBits(lz[i].dist - distBase[dc], distExtra[dc]);
+      }
+   }
+
+   bw.addCode(llcodes[256], trees.ll[256]);
+}
+
+//=============================================================================
+//
+// Match Finding
+//
+
+// Longest match still available at the given distance
+struct zoptmatch_t
+{
+   uint16_t len;
+   uint16_t dist;
+};
+
+//
+// ZOptMatchCache
+//
+// For every position of the input, every useful match: for each length, the
+// closest distance at which a match at least that long can be found. As the
+// closest distance only changes at a few lengths, just those are kept.
+//
+class ZOptMatchCache
+{
+protected:
+   PODCollection<zoptmatch_t> matches;
+   PODCollection<uint32_t>    first;   // first match of each position
+
+   static void findMatches(const byte *src, size_t len, const int32_t *prev,
+                           size_t pos, PODCollection<zoptmatch_t> &out);
+
+public:
+   ZOptMatchCache() : matches(), first() {}
+
+   void build(const byte *src, size_t len);
+
+   const zoptmatch_t *begin(size_t pos) const { return &matches[0] + first[pos];     }
+   const zoptmatch_t *end(size_t pos)   const { return &matches[0] + first[pos + 1]; }
+};
+
+//
+// ZOptMatchCache::findMatches
+//
+void ZOptMatchCache::findMatches(const byte *src, size_t len,
+                                 const int32_t *prev, size_t pos,
+                                 PODCollection<zoptmatch_t> &out)
+{
+   size_t maxlen = len - pos;
+   size_t best   = ZOPT_MINMATCH - 1;
+   int    chain  = 0;
+
+   if(maxlen > ZOPT_MAXMATCH)
+      maxlen = ZOPT_MAXMATCH;
+   if(maxlen < ZOPT_MINMATCH)
+      return;
+
+   for(int32_t cand = prev[pos];
+       cand >= 0 && pos - cand <= ZOPT_WINDOW && chain < ZOPT_MAXCHAIN;
+       cand = prev[cand], chain++)
+   {
+      const byte *a = src + pos;
+      const byte *b = src + cand;
+
+      // quick reject: can't be any longer than what we have
+      if(a[best] != b[best])
+         continue;
+
+      size_t l = 0;
+      while(l < maxlen && a[l] == b[l])
+         ++l;
+
+      if(l > best)
+      {
+         zoptmatch_t m;
+         m.len  = static_cast<uint16_t>(l);
+         m.dist = static_cast<uint16_t>(pos - cand);
+         out.add(m);
+
+         best = l;
+         if(best == maxlen)
+            break;
+      }
+   }
+}
+
+//
+// ZOptMatchCache::build
+//
+void ZOptMatchCache::build(const byte *src, size_t len)
+{
+   static const size_t CHUNK = 4096;
+
+   PODCollection<int32_t> head, prev;
+
+   // chain together earlier positions with the same first three bytes
+   head.resize(1 << ZOPT_HASHBITS);
+   prev.resize(len + 1);
+
+   for(int32_t &h : head)
+      h = -1;
+
+   for(size_t i = 0; i < len; i++)
+   {
+      if(i + ZOPT_MINMATCH > len)
+      {
+         prev[i] = -1;
+         continue;
+      }
+
+      unsigned h = ((src[i] << 10) ^ (src[i + 1] << 5) ^ src[i + 2]) &
+                   ((1 << ZOPT_HASHBITS) - 1);
+      prev[i] = head[h];
+      head[h] = static_cast<int32_t>(i);
+   }
+
+   // positions are independent once the chains are built, so search chunks
+   // of them at a time and then stitch the results together in order
+   size_t numchunks = (len + CHUNK - 1) / CHUNK;
+   Collection<PODCollection<zoptmatch_t>> chunkMatches;
+   Collection<PODCollection<uint32_t>>    chunkCounts;
+
+   for(size_t c = 0; c < numchunks; c++)
+   {
+      chunkMatches.add(PODCollection<zoptmatch_t>());
+      chunkCounts.add(PODCollection<uint32_t>());
+   }
+
+   auto search = [&] (size_t c)
+   {
+      size_t end = (c + 1) * CHUNK;
+      if(end > len)
+         end = len;
+
+      for(size_t i = c * CHUNK; i < end; i++)
+      {
+         size_t before = chunkMatches[c].getLength();
+         findMatches(src, len, &prev[0], i, chunkMatches[c]);
+         chunkCounts[c].add(static_cast<uint32_t>(chunkMatches[c].getLength() - before));
+      }
+   };
+
+   if(len >= ZOPT_MINPARALLEL)
+      M_ParallelFor(numchunks, search);
+   else
+   {
+      for(size_t c = 0; c < numchunks; c++)
+         search(c);
+   }
+
+   uint32_t total = 0;
+   for(size_t c = 0; c < numchunks; c++)
+   {
+      for(uint32_t count : chunkCounts[c])
+      {
+         first.add(total);
+         total += count;
+      }
+      for(const zoptmatch_t &m : chunkMatches[c])
+         matches.add(m);
+   }
+   first.add(total);
+
+   // keep begin() valid when nothing matched at all
+   if(matches.isEmpty())
+   {
+      zoptmatch_t none = { 0, 0 };
+      matches.add(none);
+   }
+}
+
+//=============================================================================
+//
+// Parsing
+//
+
+//
+// ZOpt_greedyParse
+//
+// A quick parse in the style of zlib, taking the longest match unless the
+// next position has a longer one. This is a good enough stand-in for the
+// final data when deciding where to split blocks.
+//
+static void ZOpt_greedyParse(const ZOptMatchCache &mc, const byte *src,
+                             size_t len, zoptstore_t &out)
+{
+   auto longest = [&] (size_t pos) -> zoptmatch_t
+   {
+      zoptmatch_t m = { 0, 0 };
+      if(mc.begin(pos) != mc.end(pos))
+         m = *(mc.end(pos) - 1);
+      return m;
+   };
+
+   size_t pos = 0;
+   while(pos < len)
+   {
+      zoptmatch_t m = longest(pos);
+      zoptlz_t    lz;
+
+      if(m.len >= ZOPT_MINMATCH &&
+         (pos + 1 >= len || longest(pos + 1).len <= m.len))
+      {
+         lz.litlen = m.len;
+         lz.dist   = m.dist;
+         pos += m.len;
+      }
+      else
+      {
+         lz.litlen = src[pos];
+         lz.dist   = 0;
+         ++pos;
+      }
+
+      out.add(lz);
+   }
+}
+
+//
+// zoptcosts_t
+//
+// Estimated bits for each symbol, including extra bits.
+//
+struct zoptcosts_t
+{
+   float lit[256];
+   float len[ZOPT_MAXMATCH + 1];
+   float dist[ZOPT_NUMD];
+
+   void setFromTrees(const zopttrees_t &trees)
+   {
+      const zoptlengthtab_t &lt = ZOpt_lengthTab();
+
+      for(int i = 0; i < 256; i++)
+         lit[i] = static_cast<float>(trees.ll[i]);
+      for(int l = ZOPT_MINMATCH; l <= ZOPT_MAXMATCH; l++)
+         len[l] = static_cast<float>(trees.ll[257 + lt.code[l]] + lengthExtra[lt.code[l]]);
+      for(int d = 0; d < 30; d++)
+         dist[d] = static_cast<float>(trees.d[d] + distExtra[d]);
+   }
+
+   // Entropy of each symbol; unused symbols are costed as if seen once
+   void setFromStats(const zoptstats_t &stats)
+   {
+      const zoptlengthtab_t &lt = ZOpt_lengthTab();
+      double llbits[ZOPT_NUMLL], dbits[ZOPT_NUMD];
+
+      entropy(stats.ll, ZOPT_NUMLL, llbits);
+      entropy(stats.d,  ZOPT_NUMD,  dbits);
+
+      for(int i = 0; i < 256; i++)
+         lit[i] = static_cast<float>(llbits[i]);
+      for(int l = ZOPT_MINMATCH; l <= ZOPT_MAXMATCH; l++)
+         len[l] = static_cast<float>(llbits[257 + lt.code[l]] + lengthExtra[lt.code[l]]);
+      for(int d = 0; d < 30; d++)
+         dist[d] = static_cast<float>(dbits[d] + distExtra[d]);
+   }
+
+   static void entropy(const double *freqs, int n, double *bits)
+   {
+      double sum = 0;
+      for(int i = 0; i < n; i++)
+         sum += freqs[i];
+
+      double logsum = log2(sum > 0 ? sum : 1);
+      for(int i = 0; i < n; i++)
+      {
+         bits[i] = (freqs[i] > 0) ? logsum - log2(freqs[i]) : logsum;
+         if(bits[i] < 0)
+            bits[i] = 0;
+      }
+   }
+};
+
+//
+// ZOpt_optimalParse
+//
+// Find the cheapest sequence of literals and matches covering src[start] up
+// to src[end] under the given costs.
+//
+static void ZOpt_optimalParse(const ZOptMatchCache &mc, const byte *src,
+                              size_t start, size_t end,
+                              const zoptcosts_t &costs, zoptstore_t &out)
+{
+   size_t n = end - start;
+   PODCollection<float>    best;
+   PODCollection<uint16_t> steplen, stepdist;
+
+   best.resize(n + 1);
+   steplen.resize(n + 1);
+   stepdist.resize(n + 1);
+
+   float    *bestp = &best[0];
+   uint16_t *lenp  = &steplen[0];
+   uint16_t *distp = &stepdist[0];
+
+   for(size_t i = 1; i <= n; i++)
+      bestp[i] = 1e30f;
+   bestp[0] = 0;
+
+   for(size_t i = 0; i < n; i++)
+   {
+      size_t pos  = start + i;
+      float  here = bestp[i];
+
+      // literal
+      float c = here + costs.lit[src[pos]];
+      if(c < bestp[i + 1])
+      {
+         bestp[i + 1] = c;
+         lenp[i + 1]  = 1;
+         distp[i + 1] = 0;
+      }
+
+      // every length of every match, at its closest distance
+      size_t maxlen = end - pos;
+      if(maxlen > ZOPT_MAXMATCH)
+         maxlen = ZOPT_MAXMATCH;
+
+      size_t l = ZOPT_MINMATCH;
+      for(const zoptmatch_t *m = mc.begin(pos); m != mc.end(pos) && l <= maxlen; m++)
+      {
+         float  dcost = costs.dist[ZOpt_distCode(m->dist)];
+         size_t mlen  = (m->len < maxlen) ? m->len : maxlen;
+
+         for(; l <= mlen; l++)
+         {
+            c = here + costs.len[l] + dcost;
+            if(c < bestp[i + l])
+            {
+               bestp[i + l] = c;
+               lenp[i + l]  = static_cast<uint16_t>(l);
+               distp[i + l] = m->dist;
+            }
+         }
+      }
+   }
+
+   // trace the cheapest path back from the end
+   size_t count = 0;
+   for(size_t i = n; i > 0; i -= lenp[i])
+      ++count;
+
+   size_t first = out.getLength();
+   out.resize(first + count);
+
+   size_t k = first + count;
+   for(size_t i = n; i > 0; i -= lenp[i])
+   {
+      zoptlz_t &lz = out[--k];
+      if(lenp[i] == 1)
+      {
+         lz.litlen = src[start + i - 1];
+         lz.dist   = 0;
+      }
+      else
+      {
+         lz.litlen = lenp[i];
+         lz.dist   = distp[i];
+      }
+   }
+}
+
+//
+// zoptrandom_t
+//
+// Small deterministic random number generator (multiply-with-carry), used to
+// shake the cost model out of a rut.
+//
+struct zoptrandom_t
+{
+   uint32_t w, z;
+
+   zoptrandom_t() : w(1), z(2) {}
+
+   uint32_t next()
+   {
+      z = 36969 * (z & 65535) + (z >> 16);
+      w = 18000 * (w & 65535) + (w >> 16);
+      return (z << 16) + w;
+   }
+
+   void shuffle(double *freqs, int n)
+   {
+      for(int i = 0; i < n; i++)
+      {
+         if((next() >> 4) % 3 == 0)
+            freqs[i] = freqs[next() % n];
+      }
+   }
+};
+
+//
+// ZOpt_optimizeBlock
+//
+// Parse one block repeatedly, each time costing symbols by how often the
+// previous parse used them, and keep the parse which codes smallest. When
+// the results stop changing, the statistics are randomly disturbed to try
+// to find a better neighbourhood.
+//
+static void ZOpt_optimizeBlock(const ZOptMatchCache &mc, const byte *src,
+                               size_t start, size_t end, int iterations,
+                               zoptstore_t &out)
+{
+   zoptcosts_t  costs;
+   zopttrees_t  fixed;
+   zoptstats_t  stats, laststats;
+   zoptrandom_t rnd;
+   zoptstore_t  cur;
+   size_t       bestbits = (size_t)-1, lastbits = (size_t)-1;
+   bool         shaken   = false;
+
+   // start from the fixed code, which at least knows matches are worthwhile
+   fixed.setFixed();
+   costs.setFromTrees(fixed);
+
+   for(int it = 0; it < iterations; it++)
+   {
+      cur.makeEmpty();
+      ZOpt_optimalParse(mc, src, start, end, costs, cur);
+
+      size_t bits = ZOpt_blockBits(cur.begin(), cur.getLength(), ZOPT_BLOCK_DYNAMIC);
+      if(bits < bestbits)
+      {
+         bestbits = bits;
+         out.makeEmpty();
+         for(const zoptlz_t &lz : cur)
+            out.add(lz);
+      }
+
+      stats.count(cur.begin(), cur.getLength());
+      if(shaken)
+      {
+         // don't let a random step be forgotten immediately
+         for(int i = 0; i < ZOPT_NUMLL; i++)
+            stats.ll[i] += laststats.ll[i] * 0.5;
+         for(int i = 0; i < ZOPT_NUMD; i++)
+            stats.d[i] += laststats.d[i] * 0.5;
+         stats.ll[256] = 1;
+      }
+      if(it > 5 && bits == lastbits)
+      {
+         rnd.shuffle(stats.ll, ZOPT_NUMLL);
+         rnd.shuffle(stats.d,  ZOPT_NUMD);
+         stats.ll[256] = 1;
+         shaken = true;
+      }
+
+      laststats = stats;
+      lastbits  = bits;
+      costs.setFromStats(stats);
+   }
+}
+
+//=============================================================================
+//
+// Block Splitting
+//
+
+//
+// ZOpt_findSplit
+//
+// Find the point between lzstart and lzend which minimizes the size of the
+// two halves coded separately, by repeatedly sampling evenly spaced points
+// and narrowing in on the best. Returns lzend if no point is any good.
+//
+static size_t ZOpt_findSplit(const zoptlz_t *lz, size_t lzstart, size_t lzend)
+{
+   static const size_t SAMPLES = 16;
+
+   size_t whole = ZOpt_blockBits(lz + lzstart, lzend - lzstart, ZOPT_BLOCK_DYNAMIC);
+   size_t lo    = lzstart + 1;
+   size_t hi    = lzend;
+   size_t best  = lzend;
+   size_t bestbits = whole;
+
+   while(hi - lo > 1)
+   {
+      size_t points[SAMPLES], bits[SAMPLES];
+      size_t numpoints = 0;
+
+      for(size_t i = 0; i < SAMPLES; i++)
+      {
+         size_t p = lo + (hi - lo) * i / SAMPLES;
+         if(!numpoints || p != points[numpoints - 1])
+            points[numpoints++] = p;
+      }
+
+      auto evaluate = [&] (size_t i)
+      {
+         size_t p = points[i];
+         bits[i] = ZOpt_blockBits(lz + lzstart, p - lzstart, ZOPT_BLOCK_DYNAMIC) +
+                   ZOpt_blockBits(lz + p, lzend - p, ZOPT_BLOCK_DYNAMIC);
+      };
+
+      if(lzend - lzstart >= ZOPT_MINPARALLEL)
+         M_ParallelFor(numpoints, evaluate);
+      else
+      {
+         for(size_t i = 0; i < numpoints; i++)
+            evaluate(i);
+      }
+
+      size_t besti = 0;
+      for(size_t i = 1; i < numpoints; i++)
+      {
+         if(bits[i] < bits[besti])
+            besti = i;
+      }
+
+      if(bits[besti] < bestbits)
+      {
+         bestbits = bits[besti];
+         best     = points[besti];
+      }
+
+      // narrow down to either side of the best sample
+      size_t newlo = (besti > 0) ? points[besti - 1] : lo;
+      size_t newhi = (besti + 1 < numpoints) ? points[besti + 1] : hi;
+      if(newlo == lo && newhi == hi)
+         break;
+      lo = newlo;
+      hi = newhi;
+   }
+
+   return best;
+}
+
+//
+// ZOpt_splitBlocks
+//
+// Choose block boundaries for LZ77 data. Returns the positions in the
+// source data at which new blocks start, not including 0.
+//
+static void ZOpt_splitBlocks(const zoptstore_t &lz, PODCollection<size_t> &splits)
+{
+   PODCollection<size_t> points; // LZ77 indices of block starts
+   PODCollection<bool>   done;   // whether each block is worth splitting
+
+   points.add(0);
+   done.add(false);
+
+   while(points.getLength() < ZOPT_MAXBLOCKS)
+   {
+      // split up the largest block which might still benefit
+      size_t which = points.getLength();
+      size_t size  = 0;
+      for(size_t i = 0; i < points.getLength(); i++)
+      {
+         size_t bend = (i + 1 < points.getLength()) ? points[i + 1] : lz.getLength();
+         if(!done[i] && bend - points[i] > size)
+         {
+            which = i;
+            size  = bend - points[i];
+         }
+      }
+      if(which == points.getLength() || size < 10)
+         break;
+
+      size_t bstart = points[which];
+      size_t bend   = (which + 1 < points.getLength()) ? points[which + 1] : lz.getLength();
+      size_t split  = ZOpt_findSplit(&lz[0], bstart, bend);
+
+      if(split == bend)
+      {
+         done[which] = true;
+         continue;
+      }
+
+      // insert the new block after the one split
+      points.add(0);
+      done.add(false);
+      for(size_t i = points.getLength() - 1; i > which + 1; i--)
+      {
+         points[i] = points[i - 1];
+         done[i]   = done[i - 1];
+      }
+      points[which + 1] = split;
+      done[which + 1]   = false;
+   }
+
+   // convert to source positions
+   size_t pos = 0, pi = 1;
+   for(size_t i = 0; i < lz.getLength() && pi < points.getLength(); i++)
+   {
+      if(i == points[pi])
+      {
+         splits.add(pos);
+         ++pi;
+      }
+      pos += lz[i].dist ? lz[i].litlen : 1;
+   }
+}
+
+//=============================================================================
+//
+// Interface
+//
+
+//
+// Zip_DeflateOptimal
+//
+bool Zip_DeflateOptimal(byte *dest, size_t *destLen, const byte *src,
+                        size_t srcLen, int iterations)
+{
+   ZOptMatchCache        mc;
+   zoptstore_t           greedy;
+   PODCollection<size_t> splits;
+
+   mc.build(src, srcLen);
+
+   // decide on blocks
+   ZOpt_greedyParse(mc, src, srcLen, greedy);
+   ZOpt_splitBlocks(greedy, splits);
+
+   size_t numblocks = splits.getLength() + 1;
+   Collection<zoptstore_t> blocks;
+   for(size_t b = 0; b < numblocks; b++)
+      blocks.add(zoptstore_t());
+
+   auto blockStart = [&] (size_t b) { return b ? splits[b - 1] : 0;  };
+   auto blockEnd   = [&] (size_t b) { return b + 1 < numblocks ? splits[b] : srcLen; };
+
+   // and make each as small as possible
+   auto optimize = [&] (size_t b)
+   {
+      ZOpt_optimizeBlock(mc, src, blockStart(b), blockEnd(b), iterations,
+                         blocks[b]);
+   };
+
+   if(numblocks > 1 && srcLen >= ZOPT_MINPARALLEL)
+      M_ParallelFor(numblocks, optimize);
+   else
+   {
+      for(size_t b = 0; b < numblocks; b++)
+         optimize(b);
+   }
+
+   // write them out as whichever type of block comes out smallest
+   PODCollection<byte> out;
+   ZOptBitWriter       bw(out);
+
+   for(size_t b = 0; b < numblocks; b++)
+   {
+      const zoptlz_t *lz    = blocks[b].begin();
+      size_t          numlz = blocks[b].getLength();
+      size_t          start = blockStart(b);
+      size_t          len   = blockEnd(b) - start;
+
+      size_t dynbits    = ZOpt_blockBits(lz, numlz, ZOPT_BLOCK_DYNAMIC);
+      size_t fixedbits  = ZOpt_blockBits(lz, numlz, ZOPT_BLOCK_FIXED);
+      size_t storedbits = ZOpt_storedBits(len);
+
+      int type = ZOPT_BLOCK_DYNAMIC;
+      if(fixedbits <= dynbits)
+         type = ZOPT_BLOCK_FIXED;
+      if(storedbits < (type == ZOPT_BLOCK_FIXED ? fixedbits : dynbits))
+         type = ZOPT_BLOCK_STORED;
+
+      ZOpt_writeBlock(bw, type, b + 1 == numblocks, lz, numlz, src + start, len);
+   }
+
+   bw.alignToByte();
+
+   if(out.getLength() > *destLen)
+      return false;
+
+   if(!out.isEmpty())
+      memcpy(dest, &out[0], out.getLength());
+   *destLen = out.getLength();
+
+   return true;
+}
+
+//
+// Zip_CheckDeflate
+//
+// Make sure a raw deflate stream inflates back to exactly the given data.
+//
+bool Zip_CheckDeflate(const byte *comp, size_t compLen, const byte *src,
+                      size_t srcLen)
+{
+   z_stream zs;
+   memset(&zs, 0, sizeof(zs));
+
+   if(inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+      return false;
+
+   // one byte to spare, so that any extra output shows up
+   byte *out = emalloc(byte *, srcLen + 1);
+
+   zs.next_in   = const_cast<Bytef *>(comp);
+   zs.avail_in  = static_cast<uInt>(compLen);
+   zs.next_out  = out;
+   zs.avail_out = static_cast<uInt>(srcLen + 1);
+
+   bool ok = (inflate(&zs, Z_FINISH) == Z_STREAM_END && !zs.avail_in &&
+              zs.total_out == srcLen && !memcmp(out, src, srcLen));
+
+   inflateEnd(&zs);
+   efree(out);
+
+   return ok;
+}
+
+#ifndef NO_UNIT_TESTS
+
+//
+// Zip_DeflateOptimalUnitTest
+//
+// Compress data of various kinds and sizes, well past the 32 KB window and
+// with matches reaching back across all of it, and make sure zlib inflates
+// every result back to the original.
+//
+void Zip_DeflateOptimalUnitTest()
+{
+   static const size_t sizes[]      = { 0, 1, 300, 5000, 33000, 70000, 200000 };
+   static const int    iterations[] = { 2, 15 };
+   static const int    numKinds     = 4;
+
+   size_t maxSize = sizes[earrlen(sizes) - 1];
+   byte  *src     = emalloc(byte *, maxSize);
+   size_t destMax = maxSize + maxSize / 8 + 1024;
+   byte  *dest    = emalloc(byte *, destMax);
+   size_t total   = 0, totalz = 0;
+
+   uint32_t seed = 0x12345678;
+   auto random = [&seed] () -> uint32_t
+   {
+      seed = seed * 1103515245 + 12345;
+      return seed >> 16;
+   };
+
+   for(size_t s = 0; s < earrlen(sizes); s++)
+   {
+      size_t len = sizes[s];
+
+      for(int kind = 0; kind < numKinds; kind++)
+      {
+         for(size_t i = 0; i < len; i++)
+         {
+            switch(kind)
+            {
+            case 0: // noise
+               src[i] = (byte)random();
+               break;
+            case 1: // short period
+               src[i] = (byte)(i % 251);
+               break;
+            case 2: // repeats of a block at the far end of the window
+               src[i] = i < 30000 ? (byte)(random() & 15) :
+                        src[i - 30000 + (random() % 3 == 0)];
+               break;
+            default: // matches from anywhere 25 to 32 KB back, between noise
+               {
+                  size_t dist = 25000 + random() % 7769;
+                  src[i] = (i >= dist && random() % 4) ? src[i - dist] :
+                           (byte)random();
+               }
+               break;
+            }
+         }
+
+         uLongf zlen = static_cast<uLongf>(destMax);
+         compress2(dest, &zlen, src, static_cast<uLong>(len), 9);
+
+         for(size_t it = 0; it < earrlen(iterations); it++)
+         {
+            size_t destLen = destMax;
+
+            if(!Zip_DeflateOptimal(dest, &destLen, src, len, iterations[it]))
+            {
+               I_Error("Zip_DeflateOptimalUnitTest: no room for %u bytes of "
+                       "kind %d\n", (unsigned int)len, kind);
+            }
+
+            if(!Zip_CheckDeflate(dest, destLen, src, len))
+            {
+               I_Error("Zip_DeflateOptimalUnitTest: %u bytes of kind %d at %d "
+                       "iterations did not inflate back\n", (unsigned int)len,
+                       kind, iterations[it]);
+            }
+
+            if(it == earrlen(iterations) - 1)
+            {
+               total  += destLen;
+               totalz += zlen - 6; // less the zlib header and adler32
+            }
+         }
+      }
+   }
+
+   printf("Zip_DeflateOptimalUnitTest: passed (%lu bytes, zlib level 9 %lu)\n",
+          (unsigned long)total, (unsigned long)totalz);
+
+   efree(dest);
+   efree(src);
+}
+
+#endif
+
+// EOF
+
@@ -0,0 +1,55 @@
+// Emacs style mode select   -*- C++ -*-
+//-----------------------------------------------------------------------------
+//
+// Copyright(C) 2014 James Haley
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION:
+//    Exhaustive deflate encoder
+//
+//-----------------------------------------------------------------------------
+
+#ifndef ZIP_OPTIMAL_H__
+#define ZIP_OPTIMAL_H__
+
+#include "doomtype.h"
+
+// Compress data into a raw deflate stream, trying much harder than zlib does:
+// the input is split into blocks wherever separate Huffman codes pay off, and
+// each block is parsed optimally against a cost model which is refined over
+// the given number of iterations. Work is spread across M_GetNumJobs()
+// threads where there is enough of it, without affecting the result.
+// dest    - receives the compressed data
+// destLen - on entry, space available in dest; on exit, amount used
+// Returns false if the compressed data would not fit.
+bool Zip_DeflateOptimal(byte *dest, size_t *destLen, const byte *src,
+                        size_t srcLen, int iterations);
+
+// True if the raw deflate stream in comp inflates back to exactly src.
+bool Zip_CheckDeflate(const byte *comp, size_t compLen, const byte *src,
+                      size_t srcLen);
+
+#ifndef NO_UNIT_TESTS
+// Unit test function
+void Zip_DeflateOptimalUnitTest();
+#endif
+
+#endif
+
+// EOF
+
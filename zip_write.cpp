@@ -24,17 +24,30 @@
 //
 //-----------------------------------------------------------------------------
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include "z_zone.h"
 
+#include "e_hash.h"
 #include "i_system.h"
 #include "m_buffer.h"
+#include "m_crc32.h"
+#include "m_misc.h"
+#include "m_parallel.h"
+#include "m_qstr.h"
 #include "v_loading.h"
+#include "w_zip.h"
 #include "z_auto.h"
+#include "zip_optimal.h"
 #include "zip_write.h"
 
 // Need zlib for deflate support
 #include "zlib/zlib.h"
 
+static void Zip_StreamFile(ziparchive_t *zip, zipfile_t *file);
+
 //=============================================================================
 //
 // Zip Functions
@@ -58,7 +71,8 @@ void Zip_Create(ziparchive_t *zip, const char *filename)
 // Add a file to a zip archive.
 //
 zipfile_t *Zip_AddFile(ziparchive_t *zip, const char *name, const byte *data, 
-                       uint32_t len, ziptype_e fileType, bool deflate)
+                       uint32_t len, ziptype_e fileType, bool deflate,
+                       bool owned)
 {
    auto file = estructalloc(zipfile_t, 1);
 
@@ -67,6 +81,7 @@ zipfile_t *Zip_AddFile(ziparchive_t *zip, const char *name, const byte *data,
    file->len     = len;
    file->clen    = len;     // start out clen same as len
    file->deflate = deflate;
+   file->owned   = owned;
 
    // Does anything actually pay attention to these? Oh well.
    switch(fileType)
@@ -95,6 +110,9 @@ zipfile_t *Zip_AddFile(ziparchive_t *zip, const char *name, const byte *data,
 
    zip->fcount++;
 
+   if(zip->stream)
+      Zip_StreamFile(zip, file);
+
    return file;
 }
 
@@ -125,310 +143,2168 @@ zipfile_t *Zip_AddFile(ziparchive_t *zip, const char *name,
 
    zip->fcount++;
 
+   if(zip->stream)
+      Zip_StreamFile(zip, file);
+
    return file;
 }
 
-
-//=============================================================================
 //
-// CRC routine
+// Zip_AddFile
+//
+// Add a file to a zip archive which is generated on demand.
 //
+zipfile_t *Zip_AddFile(ziparchive_t *zip, const char *name, 
+                       const zipproducer_t &producer, bool deflate)
+{
+   auto file = estructalloc(zipfile_t, 1);
+
+   file->name     = estrdup(name);
+   file->producer = new zipproducer_t(producer);
+   file->deflate  = deflate;
+   file->owned    = true;
+
+   // Does anything actually pay attention to these? Oh well.
+   file->extattr = 0x20; // set archive flag
+
+   if(zip->last)
+   {
+      zip->last->next = file;
+      zip->last = file;
+   }
+   else
+      zip->files = zip->last = file;
+
+   zip->fcount++;
 
-#define CRC32_IEEE_POLY 0xEDB88320
+   if(zip->stream)
+      Zip_StreamFile(zip, file);
 
-static uint32_t crc32_table[256];
+   return file;
+}
 
 //
-// M_CRC32BuildTable
+// Zip_AppendArchive
 //
-// Builds the polynomial table for CRC32.
+// Move all of the entries of one archive onto the end of another, keeping
+// their order. The source archive is left empty.
 //
-static void M_CRC32BuildTable()
+void Zip_AppendArchive(ziparchive_t *zip, ziparchive_t *src)
 {
-   uint32_t i, j;
-   
-   for(i = 0; i < 256; i++)
+   if(!src->files)
+      return;
+
+   if(zip->last)
    {
-      uint32_t val = i;
-      
-      for(j = 0; j < 8; j++)
-      {
-         if(val & 1)
-            val = (val >> 1) ^ CRC32_IEEE_POLY;
-         else
-            val >>= 1;
-      }
-      
-      crc32_table[i] = val;
+      zip->last->next = src->files;
+      zip->last = src->last;
+   }
+   else
+   {
+      zip->files = src->files;
+      zip->last  = src->last;
+   }
+
+   zip->fcount += src->fcount;
+
+   if(zip->stream)
+   {
+      for(zipfile_t *file = src->files; file; file = file->next)
+         Zip_StreamFile(zip, file);
    }
+
+   src->files  = src->last = NULL;
+   src->fcount = 0;
 }
 
+//=============================================================================
+//
+// Options
+//
+
+// if true, entries are checksummed piece by piece while being deflated
+static bool zipFusedCRC;
+
+// how entries compressed on worker threads get written out
+static zipwritemode_e zipWriteMode = ZIP_WRITE_INORDER;
+
+// if non-zero, stored entries' data is aligned to this many bytes
+static int zipAlignment;
+
+// if true, CRCs and sizes follow each deflated entry's data instead of
+// preceding it
+static bool zipDescriptors;
+
+// compression mode and level override
+static zipcompress_e zipCompressMode  = ZIP_COMPRESS_RELEASE;
+static int           zipCompressLevel = -1;
+
 //
-// M_CRC32Initialize
+// Compression Policy
 //
-// Builds the table if it hasn't been built yet. Doesn't do anything
-// else, since CRC32 starting value has already been set properly by
-// the main hash init routine.
+// Settings for entries which asked to be deflated, chosen by the start or
+// end of the entry's name. The first match wins, so the catch-all entry must
+// come last. A level of 0 means the entry is stored instead.
 //
-static void M_CRC32Initialize()
+struct zippolicy_t
 {
-   static bool tablebuilt = false;
-   
-   // build the CRC32 table if it hasn't been built yet
-   if(!tablebuilt)
-   {
-      M_CRC32BuildTable();
-      tablebuilt = true;
-   }
-   
-   // zero is the appropriate starting value for CRC32, so we need do nothing
-   // special here
-}
+   const char *prefix;    // name starts with this, if non-NULL
+   const char *suffix;    // name ends with this, if non-NULL
+   int         level;     // zlib level for release builds
+   int         fastLevel; // zlib level for -fast builds
+   int         memLevel;  // zlib memLevel
+   int         strategy;  // zlib strategy
+   bool        mappable;  // stored when aligning, so it can be mapped directly
+};
+
+static zippolicy_t zipPolicies[] =
+{
+   // PCM sound data gains little from deflate, so don't bother when in a hurry
+   { "sounds/",   NULL,   9, 0, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, false },
+
+   // raw flats and patches; flats and palettes are large, simple arrays which
+   // engines would rather map than decompress
+   { "flats/",    NULL,   9, 1, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, true  },
+   { "PLAYPAL",   NULL,   9, 1, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, true  },
+   { "sprites/",  NULL,   9, 1, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, false },
+   { "textures/", NULL,   9, 1, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, false },
+   { "graphics/", NULL,   9, 1, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, false },
+
+   // map WADs are largely structured binary data and compress well
+   { NULL,        ".WAD", 9, 3, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, false },
+   { NULL,        ".ROM", 9, 3, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, false },
+
+   // everything else
+   { NULL,        NULL,   9, 1, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, false },
+};
+
+// Parameters for compressing one entry
+struct zipcompparams_t
+{
+   int  level;
+   int  memLevel;
+   int  strategy;
+   bool ultra;    // also try the optimal encoder, and keep whichever wins
+   bool tune;     // try each of the autotuning candidates, and keep the best
+};
+
+// Settings for each policy row chosen by an earlier -autotune run
+static zipcompparams_t zipTuned[earrlen(zipPolicies)];
+static bool            zipHaveTuned[earrlen(zipPolicies)];
+
+// if true, try several settings for every entry
+static bool zipAutotune;
 
 //
-// M_CRC32HashData
+// Zip_SetCompressMode
+//
+void Zip_SetCompressMode(zipcompress_e mode)
+{
+   zipCompressMode = mode;
+}
+
 //
-// Calculates a running CRC32 for the provided block of data.
+// Zip_SetCompressLevel
 //
-static uint32_t M_CRC32HashData(const byte *data, unsigned int len)
+void Zip_SetCompressLevel(int level)
 {
-   uint32_t crc = 0xFFFFFFFF;
-   
-   while(len)
-   {
-      byte idx = (byte)(((int)crc ^ *data++) & 0xff);
-      
-      crc = crc32_table[idx] ^ (crc >> 8);
-      
-      --len;
-   }
-   
-   return crc ^ 0xFFFFFFFF;
+   if(level > 9)
+      level = 9;
+
+   zipCompressLevel = level;
 }
 
 //
-// End CRC routine
+// Zip_findPolicy
 //
-//=============================================================================
+static const zippolicy_t &Zip_findPolicy(const char *name)
+{
+   size_t namelen = strlen(name);
+
+   for(const zippolicy_t &policy : zipPolicies)
+   {
+      if(policy.prefix && strncasecmp(name, policy.prefix, strlen(policy.prefix)))
+         continue;
+
+      if(policy.suffix)
+      {
+         size_t suffixlen = strlen(policy.suffix);
+         if(namelen < suffixlen || 
+            strcasecmp(name + namelen - suffixlen, policy.suffix))
+            continue;
+      }
+
+      return policy;
+   }
+
+   // not reachable, as the last policy matches anything
+   return zipPolicies[earrlen(zipPolicies) - 1];
+}
 
 //
-// Zip_Compress
+// Zip_GetCompressParams
 //
-// Customized version of the zlib compress() routine which is suitable for use
-// with PKZIP archives (need to set window bits to -MAX_WBITS so that we get
-// a raw deflate stream, for one).
+// Decide how to compress an entry. Returns false if it should be stored.
 //
-static int Zip_Compress(Bytef *dest, uLongf *destLen, const Bytef *source,
-                        uLong sourceLen)
+static bool Zip_GetCompressParams(const zipfile_t *file, zipcompparams_t &params)
 {
-   z_stream stream;
-   int err;
+   const zippolicy_t &policy = Zip_findPolicy(file->name);
 
-   stream.next_in   = (Bytef*)source;
-   stream.avail_in  = (uInt)sourceLen;
-   stream.next_out  = dest;
-   stream.avail_out = (uInt)*destLen;
-   
-   if((uLong)stream.avail_out != *destLen)
-      return Z_BUF_ERROR;
+   // leave it stored so it can be used straight out of the archive
+   if(zipAlignment && policy.mappable)
+      return false;
+
+   switch(zipCompressMode)
+   {
+   case ZIP_COMPRESS_STORE:
+      return false;
+   case ZIP_COMPRESS_FAST:
+      params.level = policy.fastLevel;
+      break;
+   default:
+      params.level = policy.level;
+      break;
+   }
 
-   stream.zalloc = Z_NULL;
-   stream.zfree  = Z_NULL;
-   stream.opaque = Z_NULL;
+   params.memLevel = policy.memLevel;
+   params.strategy = policy.strategy;
+   params.ultra    = (zipCompressMode == ZIP_COMPRESS_ULTRA);
+   params.tune     = zipAutotune;
 
-   err = deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 
-                      -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
-   if(err != Z_OK)
-      return err;
+   // an earlier tuning run knows better than the table
+   size_t row = &policy - zipPolicies;
+   if(zipHaveTuned[row] && zipCompressMode != ZIP_COMPRESS_FAST)
+   {
+      params.level    = zipTuned[row].level;
+      params.memLevel = zipTuned[row].memLevel;
+      params.strategy = zipTuned[row].strategy;
+   }
 
-   err = deflate(&stream, Z_FINISH);
-   if(err != Z_STREAM_END) 
+   if(zipCompressLevel >= 0)
    {
-      deflateEnd(&stream);
-      return err == Z_OK ? Z_BUF_ERROR : err;
+      params.level = zipCompressLevel;
+      params.ultra = false;
+      params.tune  = false;
    }
-   *destLen = stream.total_out;
 
-   err = deflateEnd(&stream);
-   return err;
+   return (params.level > 0);
 }
 
 //
-// Zip_ReadDiskFile
+// Zip_GPFlagsForLevel
 //
-// Read a file on disk into memory temporarily to copy it into the zip file.
+// The general purpose flags of a deflated entry record roughly how hard
+// the compressor tried, using the same scheme as Info-ZIP.
 //
-static void Zip_ReadDiskFile(zipfile_t *file)
+static uint16_t Zip_GPFlagsForLevel(int level)
 {
-   FILE *f;
-   long  size;
+   switch(level)
+   {
+   case 1:
+      return 6; // super fast
+   case 2:
+      return 4; // fast
+   case 8:
+   case 9:
+      return 2; // maximum
+   default:
+      return 0; // normal
+   }
+}
 
-   if(!(f = fopen(file->diskfn, "rb")))
-      I_Error("Zip_ReadDiskFile: cannot open file %s\n", file->diskfn);
+//
+// Zip_SetFusedCRC
+//
+void Zip_SetFusedCRC(bool enable)
+{
+   zipFusedCRC = enable;
+}
 
-   // get size
-   if(fseek(f, 0, SEEK_END))
-      I_Error("Zip_ReadDiskFile: cannot seek to end of %s\n", file->diskfn);
-   size = ftell(f);
-   if(size <= 0)
-      return;
-   if(fseek(f, 0, SEEK_SET))
-      I_Error("Zip_ReadDiskFile: cannot seek back on %s\n", file->diskfn);
+//
+// Zip_SetWriteMode
+//
+void Zip_SetWriteMode(zipwritemode_e mode)
+{
+   zipWriteMode = mode;
+}
 
-   // read in the file
-   void *buffer = emalloc(void *, (size_t)size);
-   if(fread(buffer, 1, size, f) != size)
-      I_Error("Zip_ReadDiskFile: short read on file %s\n", file->diskfn);
-   fclose(f);
+//=============================================================================
+//
+// Compression Contexts
+//
+// Setting up a deflate stream costs a few hundred KB of zlib state, which is
+// more than the work of compressing most of the small sprites and sounds that
+// make up an archive. Streams are therefore kept in a pool and reset between
+// entries, as are the buffers that compressed data is written into. One of
+// each is in use per compressing thread at most, plus one output buffer per
+// entry waiting to be written.
+//
 
-   file->data = static_cast<const byte *>(buffer);
-   file->len  = static_cast<uint32_t    >(size);
-   file->clen = file->len;
-}
+// A reusable deflate stream
+struct zipdeflater_t
+{
+   zipdeflater_t  *next;
+   z_stream        stream;
+   zipcompparams_t params; // what the stream is currently set up for
+};
+
+// A reusable, grow-only output buffer
+struct zipscratch_t
+{
+   zipscratch_t *next;
+   byte         *data;
+   size_t        size;
+};
+
+static std::mutex     zipPoolLock;
+static zipdeflater_t *zipFreeDeflaters;
+static zipscratch_t  *zipFreeScratch;
 
 //
-// Zip_FreeDiskBuffer
+// Zip_zalloc
 //
-// Free temporary buffer used to load a file from disk.
+// zlib allocation hook, so that deflate state comes out of the zone heap.
 //
-static void Zip_FreeDiskBuffer(zipfile_t *file)
+static voidpf Zip_zalloc(voidpf opaque, uInt items, uInt size)
 {
-   if(file->data)
-   {
-      auto ptr = const_cast<byte *>(file->data);
-      efree(ptr);
-      file->data = NULL;
-   }
+   return emalloc(voidpf, static_cast<size_t>(items) * size);
 }
 
 //
-// Zip_WriteFile
+// Zip_zfree
 //
-// Write the local file header and file data for a single entry in the zip
-// archive.
+static void Zip_zfree(voidpf opaque, voidpf address)
+{
+   efree(address);
+}
+
 //
-static void Zip_WriteFile(zipfile_t *file, OutBuffer &ob)
+// Zip_GetDeflater
+//
+// Get a deflate stream ready to compress a new entry with the given
+// parameters. A pooled stream which was set up the same way is preferred;
+// otherwise one with the same memLevel can be adjusted with deflateParams,
+// and only failing that must a new stream be initialized.
+//
+static zipdeflater_t *Zip_GetDeflater(const zipcompparams_t &params)
 {
-   ZAutoBuffer buffer;
-   uint16_t    date, time;
-   uint16_t    namelen;
-   const byte *data;
-   uint32_t    len;
+   zipdeflater_t *zd = NULL;
 
-   // if it is a disk file, open up the file
-   if(file->diskfn)
-      Zip_ReadDiskFile(file);
+   {
+      std::lock_guard<std::mutex> guard(zipPoolLock);
+      zipdeflater_t **best = NULL;
 
-   // Can't deflate an empty file
-   if(!file->len || !file->data)
-      file->deflate = false;
+      for(auto link = &zipFreeDeflaters; *link; link = &(*link)->next)
+      {
+         const zipcompparams_t &zp = (*link)->params;
+
+         if(zp.memLevel != params.memLevel)
+            continue;
+         if(!best || (zp.level == params.level && 
+                      zp.strategy == params.strategy))
+            best = link;
+         if(zp.level == params.level && zp.strategy == params.strategy)
+            break;
+      }
 
-   ob.Flush();
+      if(!best && zipFreeDeflaters)
+         best = &zipFreeDeflaters;
 
-   file->offset = ob.Tell();
+      if(best)
+      {
+         zd    = *best;
+         *best = zd->next;
+      }
+   }
 
-   ob.WriteUint32(0x04034b50); // local file header signature
-   ob.WriteUint16(0x14);       // version needed to extract (2.0)
+   int err = Z_OK;
 
-   // general purpose bit flag and compression method
-   if(file->deflate)
+   if(zd && zd->params.memLevel == params.memLevel)
    {
-      ob.WriteUint16(2); // Max deflate compressed
-      ob.WriteUint16(8); // compression method == deflate
+      err = deflateReset(&zd->stream);
+      if(err == Z_OK && (zd->params.level    != params.level || 
+                         zd->params.strategy != params.strategy))
+      {
+         // no data has gone in since the reset, so this flushes nothing
+         err = deflateParams(&zd->stream, params.level, params.strategy);
+      }
    }
    else
    {
-      ob.WriteUint16(0); // Nothing special 
-      ob.WriteUint16(0); // compression method == store
-   }
-   
-   // Time is psxwadgen version #; date is PlayStation Doom release date.
-   time = (1 << 5) | (1 << 11);
-   date = 16 | (11 << 5) | (15 << 9); 
-   
-   ob.WriteUint16(time); // file time (1:01)
-   ob.WriteUint16(date); // file date (11/16/1995)
+      if(zd)
+         deflateEnd(&zd->stream); // memLevel can't be changed on the fly
+      else
+         zd = estructalloc(zipdeflater_t, 1);
 
-   if(file->len)
-   {
-      M_CRC32Initialize();
-      file->crc = M_CRC32HashData(file->data, file->len);
+      zd->stream.zalloc = Zip_zalloc;
+      zd->stream.zfree  = Zip_zfree;
+      zd->stream.opaque = Z_NULL;
+
+      err = deflateInit2(&zd->stream, params.level, Z_DEFLATED, 
+                         -MAX_WBITS, params.memLevel, params.strategy);
    }
-   else
-      file->crc = 0;
 
-   if(file->deflate)
+   if(err != Z_OK)
+      I_Error("Zip_GetDeflater: could not set up deflate (error %d)\n", err);
+
+   zd->params = params;
+   zd->next   = NULL;
+
+   return zd;
+}
+
+//
+// Zip_ReleaseDeflater
+//
+static void Zip_ReleaseDeflater(zipdeflater_t *zd)
+{
+   std::lock_guard<std::mutex> guard(zipPoolLock);
+
+   zd->next = zipFreeDeflaters;
+   zipFreeDeflaters = zd;
+}
+
+//
+// Zip_GetScratch
+//
+// Get an output buffer of at least size bytes. The smallest pooled buffer
+// which is big enough gets used; if none is, one is grown rather than adding
+// yet another buffer to the pool.
+//
+static zipscratch_t *Zip_GetScratch(size_t size)
+{
+   zipscratch_t *zs = NULL;
+
    {
-      auto tmpSize = compressBound(file->len);
-      
-      buffer.alloc(tmpSize, true);      
-      auto tmpData = buffer.getAs<byte *>();
+      std::lock_guard<std::mutex> guard(zipPoolLock);
+      zipscratch_t **best = NULL;
 
-      auto res = Zip_Compress(tmpData, &tmpSize, file->data, file->len);
-      if(res != Z_OK)
-         I_Error("ZIP_WriteFile: compress returned error code %d\n", res);
+      for(auto link = &zipFreeScratch; *link; link = &(*link)->next)
+      {
+         size_t cur = (*link)->size;
+
+         if(!best)
+            best = link;
+         else if(cur >= size)
+         {
+            // smallest one that fits
+            if((*best)->size < size || cur < (*best)->size)
+               best = link;
+         }
+         else if((*best)->size < size && cur > (*best)->size)
+            best = link; // nothing fits so far; prefer the largest
+      }
 
-      // write back compressed size
-      file->clen = (uint32_t)tmpSize;
-      data = tmpData;
-      len  = file->clen;
+      if(best)
+      {
+         zs    = *best;
+         *best = zs->next;
+      }
    }
-   else
+
+   if(!zs)
+      zs = estructalloc(zipscratch_t, 1);
+
+   if(zs->size < size)
    {
-      data = file->data;
-      len  = file->len;
+      // contents don't need to be kept, so don't bother with realloc
+      if(zs->data)
+         efree(zs->data);
+      zs->data = emalloc(byte *, size);
+      zs->size = size;
    }
 
-   ob.WriteUint32(file->crc);  // CRC-32
-   ob.WriteUint32(file->clen); // compressed size
-   ob.WriteUint32(file->len);  // uncompressed size
-
-   namelen = (uint16_t)strlen(file->name);
-   ob.WriteUint16(namelen);    // filename length
-   ob.WriteUint16(0);          // extra field length
+   zs->next = NULL;
 
-   // write file name
-   ob.Write(file->name, namelen);
+   return zs;
+}
 
-   // write file contents (stored or deflated)
-   if(len)
-      ob.Write(data, len);
+//
+// Zip_ReleaseScratch
+//
+static void Zip_ReleaseScratch(zipscratch_t *zs)
+{
+   std::lock_guard<std::mutex> guard(zipPoolLock);
 
-   // if was a disk file, try freeing the buffer
-   if(file->diskfn)
-      Zip_FreeDiskBuffer(file);
+   zs->next = zipFreeScratch;
+   zipFreeScratch = zs;
 }
 
 //
-// Zip_WriteDirEntry
+// Zip_FreeCompressionPools
 //
-// Write the central directory entry for a single file in the zip archive.
+// Release all pooled streams and buffers once an archive is finished.
 //
-static void Zip_WriteDirEntry(ziparchive_t *zip, zipfile_t *file, OutBuffer &ob)
+static void Zip_FreeCompressionPools()
 {
-   unsigned short time, date;
-   unsigned short namelen;
-
-   ob.WriteUint32(0x02014b50); // central file header signature
-   ob.WriteUint16(0x0B14);     // version made by 
-   ob.WriteUint16(0x14);       // version needed to extract (2.0)
+   std::lock_guard<std::mutex> guard(zipPoolLock);
 
-   // general purpose bit flag and compression method
-   if(file->deflate)
+   while(zipFreeDeflaters)
    {
-      ob.WriteUint16(2); // Max deflate compressed
-      ob.WriteUint16(8); // compression method == deflate
+      zipdeflater_t *next = zipFreeDeflaters->next;
+      deflateEnd(&zipFreeDeflaters->stream);
+      efree(zipFreeDeflaters);
+      zipFreeDeflaters = next;
    }
-   else
+
+   while(zipFreeScratch)
    {
-      ob.WriteUint16(0); // Nothing special    
-      ob.WriteUint16(0); // compression method == store
+      zipscratch_t *next = zipFreeScratch->next;
+      if(zipFreeScratch->data)
+         efree(zipFreeScratch->data);
+      efree(zipFreeScratch);
+      zipFreeScratch = next;
    }
+}
 
-   // Time is psxwadgen version #; date is PSX Doom release date.
-   time = (1 << 5) | (1 << 11);
-   date = 16 | (11 << 5) | (15 << 9); 
-   
+//
+// Zip_Compress
+//
+// Customized version of the zlib compress() routine which is suitable for use
+// with PKZIP archives (need to set window bits to -MAX_WBITS so that we get
+// a raw deflate stream, for one).
+//
+// If crc is non-NULL, the CRC-32 of the source is calculated along the way:
+// the input is fed to deflate in pieces small enough to still be in cache
+// when deflate reads them, so each byte is only fetched from memory once.
+//
+// The deflate stream comes from the context pool rather than being set up
+// from scratch for every entry.
+//
+static int Zip_Compress(Bytef *dest, uLongf *destLen, const Bytef *source,
+                        uLong sourceLen, const zipcompparams_t &params, 
+                        uint32_t *crc = NULL)
+{
+   static const uLong CRCCHUNK = 32768;
+   int err;
+
+   if((uLong)(uInt)*destLen != *destLen)
+      return Z_BUF_ERROR;
+
+   zipdeflater_t *zd     = Zip_GetDeflater(params);
+   z_stream      &stream = zd->stream;
+
+   stream.next_in   = (Bytef*)source;
+   stream.avail_in  = (uInt)sourceLen;
+   stream.next_out  = dest;
+   stream.avail_out = (uInt)*destLen;
+
+   if(crc)
+   {
+      // deflate output doesn't depend on how the input is divided up
+      uLong remaining = sourceLen;
+
+      *crc = 0;
+      stream.avail_in = 0;
+
+      while(remaining > CRCCHUNK)
+      {
+         *crc = M_CRC32Update(*crc, stream.next_in, CRCCHUNK);
+         stream.avail_in = (uInt)CRCCHUNK;
+         remaining -= CRCCHUNK;
+
+         if((err = deflate(&stream, Z_NO_FLUSH)) != Z_OK)
+         {
+            Zip_ReleaseDeflater(zd);
+            return err;
+         }
+      }
+
+      *crc = M_CRC32Update(*crc, stream.next_in, remaining);
+      stream.avail_in = (uInt)remaining;
+   }
+
+   err = deflate(&stream, Z_FINISH);
+   if(err == Z_STREAM_END)
+      *destLen = stream.total_out;
+
+   Zip_ReleaseDeflater(zd);
+
+   if(err != Z_STREAM_END) 
+      return err == Z_OK ? Z_BUF_ERROR : err;
+
+   return Z_OK;
+}
+
+//=============================================================================
+//
+// Ultra Compression
+//
+// For release builds where time is no object, every deflated entry is also
+// run through the optimal encoder in zip_optimal.cpp, and whichever of that
+// and zlib's level 9 comes out smaller is kept.
+//
+
+// Passes of the optimal encoder's cost model per block
+#define ZIP_ULTRA_ITERATIONS 15
+
+static std::mutex zipUltraLock;
+static unsigned   zipUltraImproved;
+static size_t     zipUltraSaved;
+
+//
+// Zip_CompressUltra
+//
+// Try to beat the level 9 deflate stream of clen bytes already in the
+// entry's buffer, replacing it if successful. Returns the new length.
+//
+static uLongf Zip_CompressUltra(zipfile_t *file, uLongf clen)
+{
+   // only interesting if it comes out smaller than what we have
+   size_t        ulen = clen - 1;
+   zipscratch_t *zs   = Zip_GetScratch(clen);
+
+   if(Zip_DeflateOptimal(zs->data, &ulen, file->data, file->len, 
+                         ZIP_ULTRA_ITERATIONS))
+   {
+#if defined(_DEBUG) || defined(RANGECHECK)
+      // debug builds: never trust the encoder with data it didn't give back
+      if(!Zip_CheckDeflate(zs->data, ulen, file->data, file->len))
+      {
+         printf("Zip_CompressUltra: warning: bad optimal deflate for %s, "
+                "keeping level 9\n", file->name);
+         Zip_ReleaseScratch(zs);
+         return clen;
+      }
+#endif
+      memcpy(file->cbuf->data, zs->data, ulen);
+
+      std::lock_guard<std::mutex> ultraGuard(zipUltraLock);
+      ++zipUltraImproved;
+      zipUltraSaved += clen - ulen;
+      clen = static_cast<uLongf>(ulen);
+   }
+
+   Zip_ReleaseScratch(zs);
+
+   return clen;
+}
+
+//=============================================================================
+//
+// Autotuning
+//
+// Which zlib settings suit an entry best depends on what it holds: PCM
+// sound barely compresses whatever is done, while flats and raw graphics
+// can prefer run-length or filtered matching. With -autotune, every entry
+// is compressed with each of a small set of candidate settings at once and
+// the smallest result kept. Totals for every candidate are kept for each
+// policy row, so that the best single choice for each kind of entry can be
+// saved to a tuning file and used directly by later runs.
+//
+
+// Tried as well as an entry's usual settings
+static const zipcompparams_t zipTuneCandidates[] =
+{
+   { 9, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, false, false },
+   { 9, 8,             Z_DEFAULT_STRATEGY, false, false },
+   { 9, MAX_MEM_LEVEL, Z_FILTERED,         false, false },
+   { 9, MAX_MEM_LEVEL, Z_RLE,              false, false },
+   { 9, MAX_MEM_LEVEL, Z_HUFFMAN_ONLY,     false, false },
+   { 9, MAX_MEM_LEVEL, Z_FIXED,            false, false },
+   { 6, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY, false, false },
+};
+
+// usual settings, then each candidate
+#define ZIP_NUMTUNINGS (earrlen(zipTuneCandidates) + 1)
+
+// Names of zlib's strategies, indexed by value
+static const char *zipStrategyNames[] =
+{
+   "default", "filtered", "huffman", "rle", "fixed"
+};
+
+struct ziptunestats_t
+{
+   unsigned        entries;                // entries compressed
+   zipcompparams_t usual;                  // usual settings for the row
+   uint64_t        total[ZIP_NUMTUNINGS];  // compressed size with each
+   uint64_t        best;                   // with the best for each entry
+};
+
+static ziptunestats_t zipTuneStats[earrlen(zipPolicies)];
+static std::mutex     zipTuneLock;
+
+//
+// Zip_SetAutotune
+//
+void Zip_SetAutotune(bool enable)
+{
+   zipAutotune = enable;
+}
+
+//
+// Zip_CompressTuned
+//
+// Compress an entry with its usual settings and every candidate, in
+// parallel, and keep the smallest result in the entry's buffer. Returns the
+// compressed length and sets level to the level that achieved it.
+//
+static uLongf Zip_CompressTuned(zipfile_t *file, const zipcompparams_t &params,
+                                uint32_t *crc, int &level)
+{
+   zipcompparams_t tries[ZIP_NUMTUNINGS];
+   zipscratch_t   *bufs[ZIP_NUMTUNINGS];
+   uLongf          sizes[ZIP_NUMTUNINGS];
+   uLongf          bound = compressBound(file->len);
+
+   tries[0] = params;
+   for(size_t i = 1; i < ZIP_NUMTUNINGS; i++)
+      tries[i] = zipTuneCandidates[i - 1];
+
+   M_ParallelFor(ZIP_NUMTUNINGS, [&] (size_t i)
+   {
+      bufs[i]  = Zip_GetScratch(bound);
+      sizes[i] = bound;
+
+      // only one of them needs to work out the CRC
+      auto res = Zip_Compress(bufs[i]->data, &sizes[i], file->data, file->len,
+                              tries[i], i ? NULL : crc);
+      if(res != Z_OK)
+         I_Error("Zip_CompressTuned: compress returned error code %d\n", res);
+   });
+
+   // lowest index wins ties, so the usual settings are kept where possible
+   size_t best = 0;
+   for(size_t i = 1; i < ZIP_NUMTUNINGS; i++)
+   {
+      if(sizes[i] < sizes[best])
+         best = i;
+   }
+
+   for(size_t i = 0; i < ZIP_NUMTUNINGS; i++)
+   {
+      if(i != best)
+         Zip_ReleaseScratch(bufs[i]);
+   }
+
+   file->cbuf  = bufs[best];
+   file->cdata = file->cbuf->data;
+   level       = tries[best].level;
+
+   // anything which doesn't shrink gets stored
+   std::lock_guard<std::mutex> tuneGuard(zipTuneLock);
+   ziptunestats_t &stats = zipTuneStats[&Zip_findPolicy(file->name) - zipPolicies];
+
+   stats.usual = params;
+   ++stats.entries;
+   for(size_t i = 0; i < ZIP_NUMTUNINGS; i++)
+      stats.total[i] += (sizes[i] < file->len) ? sizes[i] : file->len;
+   stats.best += (sizes[best] < file->len) ? sizes[best] : file->len;
+
+   return sizes[best];
+}
+
+//
+// Zip_policyKey
+//
+// Name for a policy row in tuning files and reports.
+//
+static const char *Zip_policyKey(const zippolicy_t &policy)
+{
+   if(policy.prefix)
+      return policy.prefix;
+   if(policy.suffix)
+      return policy.suffix;
+   return "*";
+}
+
+//
+// Zip_tunedSettings
+//
+// The single setting which did best over all of a row's entries.
+//
+static const zipcompparams_t &Zip_tunedSettings(const ziptunestats_t &stats)
+{
+   size_t best = 0;
+   for(size_t i = 1; i < ZIP_NUMTUNINGS; i++)
+   {
+      if(stats.total[i] < stats.total[best])
+         best = i;
+   }
+
+   return best ? zipTuneCandidates[best - 1] : stats.usual;
+}
+
+//
+// Zip_PrintTuning
+//
+// Report the winning settings for each kind of entry.
+//
+static void Zip_PrintTuning()
+{
+   printf("Zip_PrintStats: autotuning results\n"
+          "  %-10s %7s %10s  %-22s %10s %10s\n", 
+          "kind", "entries", "usual", "best setting", "bytes", "per-entry");
+
+   for(size_t row = 0; row < earrlen(zipPolicies); row++)
+   {
+      const ziptunestats_t  &stats = zipTuneStats[row];
+      if(!stats.entries)
+         continue;
+
+      const zipcompparams_t &tuned = Zip_tunedSettings(stats);
+      qstring setting;
+
+      setting.Printf(0, "level %d mem %d %s", tuned.level, tuned.memLevel, 
+                     zipStrategyNames[tuned.strategy]);
+
+      uint64_t bytes = stats.total[0];
+      for(uint64_t total : stats.total)
+      {
+         if(total < bytes)
+            bytes = total;
+      }
+
+      printf("  %-10s %7u %10lu  %-22s %10lu %10lu\n", 
+             Zip_policyKey(zipPolicies[row]), stats.entries,
+             (unsigned long)stats.total[0], setting.constPtr(),
+             (unsigned long)bytes, (unsigned long)stats.best);
+   }
+}
+
+//
+// Zip_LoadTuning
+//
+// Read settings saved by Zip_SaveTuning. Each line holds a policy row's key,
+// then a level, memLevel and strategy name.
+//
+bool Zip_LoadTuning(const char *filename)
+{
+   char *buf;
+
+   if(!(buf = M_LoadStringFromFile(filename)))
+      return false;
+
+   char *line = buf;
+   while(line && *line)
+   {
+      char *next = strchr(line, '\n');
+      if(next)
+         *next++ = '\0';
+
+      char key[64], strategy[16];
+      int  level, memLevel;
+
+      if(sscanf(line, "%63s %d %d %15s", key, &level, &memLevel, strategy) == 4)
+      {
+         size_t row, st;
+
+         for(row = 0; row < earrlen(zipPolicies); row++)
+         {
+            if(!strcmp(Zip_policyKey(zipPolicies[row]), key))
+               break;
+         }
+         for(st = 0; st < earrlen(zipStrategyNames); st++)
+         {
+            if(!strcmp(zipStrategyNames[st], strategy))
+               break;
+         }
+
+         if(row < earrlen(zipPolicies) && st < earrlen(zipStrategyNames) &&
+            level >= 1 && level <= 9 && memLevel >= 1 && memLevel <= MAX_MEM_LEVEL)
+         {
+            zipTuned[row].level    = level;
+            zipTuned[row].memLevel = memLevel;
+            zipTuned[row].strategy = static_cast<int>(st);
+            zipHaveTuned[row]      = true;
+         }
+         else
+            printf("Zip_LoadTuning: ignoring bad line '%s'\n", line);
+      }
+
+      line = next;
+   }
+
+   efree(buf);
+
+   return true;
+}
+
+//
+// Zip_SaveTuning
+//
+// Write out the best settings found by -autotune for each kind of entry,
+// keeping any earlier results for kinds which weren't seen this time.
+//
+bool Zip_SaveTuning(const char *filename)
+{
+   qstring out;
+
+   for(size_t row = 0; row < earrlen(zipPolicies); row++)
+   {
+      const zipcompparams_t *tuned;
+
+      if(zipTuneStats[row].entries)
+         tuned = &Zip_tunedSettings(zipTuneStats[row]);
+      else if(zipHaveTuned[row])
+         tuned = &zipTuned[row];
+      else
+         continue;
+
+      qstring line;
+      line.Printf(0, "%s %d %d %s\n", Zip_policyKey(zipPolicies[row]),
+                  tuned->level, tuned->memLevel, 
+                  zipStrategyNames[tuned->strategy]);
+      out += line;
+   }
+
+   return M_WriteFile(filename, out.getBuffer(), out.length());
+}
+
+//=============================================================================
+//
+// Compression Cache
+//
+// Identical data turns up many times over in the output: sound effects that
+// are aliases of others, palettes, repeated sprite frames. Compressed results
+// are remembered by content hash and length, so that each distinct piece of
+// data only needs to be checksummed and deflated once. A hit is only trusted
+// once the data has been compared with what was compressed before.
+//
+
+// Limit on the compressed and source data kept by the cache
+#define ZIPCACHE_MAXBYTES (64*1024*1024)
+
+struct zipcacheentry_t
+{
+   int             hashkey;  // low bits of hash, for EHashTable
+   uint64_t        hash;     // content hash
+   uint32_t        len;      // uncompressed length
+   zipcompparams_t params;   // settings the data was compressed with
+   uint32_t        crc;      // CRC-32 of the data
+   uint32_t        clen;     // compressed length
+   bool            deflate;  // false if deflate didn't help
+   uint16_t        gpflags;  // general purpose flags
+   byte           *cdata;    // compressed data
+   const byte     *data;     // source data, to compare hits against
+   bool            owndata;  // if true, data is the cache's own copy
+
+   DLListItem<zipcacheentry_t> links;
+};
+
+static EHashTable<zipcacheentry_t, EIntHashKey, 
+                  &zipcacheentry_t::hashkey, &zipcacheentry_t::links> zipCache;
+
+static std::mutex zipCacheLock;
+static size_t     zipCacheBytes;
+static unsigned   zipCacheHits;
+static unsigned   zipCacheMisses;
+static size_t     zipCacheSaved;
+
+//
+// Zip_HashData
+//
+// Fast 64-bit hash of an entry's contents, read a word at a time. It only has
+// to be consistent within a single run.
+//
+static uint64_t Zip_HashData(const byte *data, size_t len)
+{
+   const uint64_t mul = 0x9E3779B97F4A7C15ULL;
+   uint64_t h = len * mul;
+
+   while(len >= 8)
+   {
+      uint64_t v;
+      memcpy(&v, data, 8);
+      h = (h ^ (v * mul)) * 0xFF51AFD7ED558CCDULL;
+      h ^= h >> 29;
+      data += 8;
+      len  -= 8;
+   }
+
+   uint64_t v = 0;
+   memcpy(&v, data, len);
+   h = (h ^ (v * mul)) * 0xC4CEB9FE1A85EC53ULL;
+   h ^= h >> 32;
+
+   return h;
+}
+
+//
+// Zip_findCacheEntry
+//
+// Must be called with zipCacheLock held.
+//
+static zipcacheentry_t *Zip_findCacheEntry(uint64_t hash, const byte *data,
+                                           uint32_t len, 
+                                           const zipcompparams_t &params)
+{
+   zipcacheentry_t *entry = NULL;
+   int key = static_cast<int>(hash & 0x7fffffff);
+
+   while((entry = zipCache.keyIterator(entry, key)))
+   {
+      if(entry->hash == hash && entry->len == len &&
+         entry->params.level    == params.level    &&
+         entry->params.memLevel == params.memLevel &&
+         entry->params.strategy == params.strategy &&
+         entry->params.ultra    == params.ultra    &&
+         entry->params.tune     == params.tune     &&
+         !memcmp(entry->data, data, len))
+         return entry;
+   }
+
+   return NULL;
+}
+
+//
+// Zip_LookupCache
+//
+// If data identical to this entry's has been compressed the same way before,
+// fill in the entry from the earlier results and return true.
+//
+static bool Zip_LookupCache(zipfile_t *file, uint64_t hash, 
+                            const zipcompparams_t &params)
+{
+   std::lock_guard<std::mutex> cacheGuard(zipCacheLock);
+   zipcacheentry_t *entry;
+
+   if(!(entry = Zip_findCacheEntry(hash, file->data, file->len, params)))
+   {
+      ++zipCacheMisses;
+      return false;
+   }
+
+   file->crc     = entry->crc;
+   file->deflate = entry->deflate;
+   file->gpflags = entry->gpflags;
+
+   if(entry->deflate)
+   {
+      // cache entries live until the archive is finished, so the data can
+      // be written straight from the cache
+      file->clen  = entry->clen;
+      file->cdata = entry->cdata;
+   }
+
+   ++zipCacheHits;
+   zipCacheSaved += file->len;
+
+   return true;
+}
+
+//
+// Zip_AddToCache
+//
+// Remember the results of preparing an entry.
+//
+static void Zip_AddToCache(const zipfile_t *file, uint64_t hash,
+                           const zipcompparams_t &params)
+{
+   std::lock_guard<std::mutex> cacheGuard(zipCacheLock);
+
+   // another thread may have gotten here first with the same data
+   if(Zip_findCacheEntry(hash, file->data, file->len, params))
+      return;
+
+   // Data which doesn't belong to the archive stays valid until it has been
+   // written out, so only the rest needs to be copied.
+   bool   borrow = (!file->owned && !file->diskfn);
+   size_t cost   = (file->deflate ? file->clen : 0) + (borrow ? 0 : file->len);
+
+   if(zipCacheBytes + cost > ZIPCACHE_MAXBYTES)
+      return;
+
+   auto entry = estructalloc(zipcacheentry_t, 1);
+
+   entry->hashkey = static_cast<int>(hash & 0x7fffffff);
+   entry->hash    = hash;
+   entry->len     = file->len;
+   entry->params  = params;
+   entry->crc     = file->crc;
+   entry->deflate = file->deflate;
+   entry->gpflags = file->gpflags;
+
+   if(file->deflate)
+   {
+      entry->clen  = file->clen;
+      entry->cdata = emalloc(byte *, file->clen);
+      memcpy(entry->cdata, file->cdata, file->clen);
+   }
+
+   if(borrow)
+      entry->data = file->data;
+   else
+   {
+      auto copy = emalloc(byte *, file->len);
+      memcpy(copy, file->data, file->len);
+      entry->data    = copy;
+      entry->owndata = true;
+   }
+
+   zipCacheBytes += cost;
+
+   if(!zipCache.isInitialized())
+      zipCache.initialize(1021);
+
+   zipCache.addObject(entry);
+}
+
+//
+// Zip_ClearCache
+//
+// Free everything in the compression cache.
+//
+static void Zip_ClearCache()
+{
+   std::lock_guard<std::mutex> cacheGuard(zipCacheLock);
+   zipcacheentry_t *entry;
+
+   while((entry = zipCache.tableIterator(static_cast<zipcacheentry_t *>(NULL))))
+   {
+      zipCache.removeObject(entry);
+      if(entry->cdata)
+         efree(entry->cdata);
+      if(entry->owndata)
+         efree(const_cast<byte *>(entry->data));
+      efree(entry);
+   }
+
+   zipCacheBytes = 0;
+}
+
+//=============================================================================
+//
+// Incremental Update
+//
+// When rebuilding over an existing archive, most entries come out exactly
+// as they did last time. Any entry whose name, size and CRC all match an
+// entry that was deflated the same way in the old archive has its compressed
+// bytes copied across as they are. The old archive is read where it is, and
+// the new one is written under a temporary name which only replaces it once
+// complete, so that a run which fails leaves the old archive as it was.
+//
+
+static ZipFile   *zipUpdateSource;
+static qstring    zipUpdatePath;   // the old archive, to be replaced
+static qstring    zipUpdateTemp;   // where the new archive is being written
+static std::mutex zipUpdateLock;   // reads from the old archive
+static unsigned   zipUpdateReused;
+static size_t     zipUpdateSaved;
+
+//
+// Zip_removeUpdateTemp
+//
+// Exit handler getting rid of a partly written archive if a run which was
+// updating one is ended by an error.
+//
+static void Zip_removeUpdateTemp()
+{
+   if(zipUpdateTemp.length())
+      remove(zipUpdateTemp.constPtr());
+}
+
+//
+// Zip_SetUpdateSource
+//
+// Get ready to reuse compressed data from the archive currently at filename,
+// which is about to be replaced.
+//
+bool Zip_SetUpdateSource(const char *filename)
+{
+   static bool exitHandlerSet;
+
+   FILE *f;
+   if(!(f = fopen(filename, "rb")))
+      return false; // nothing to update from
+
+   zipUpdateSource = new ZipFile();
+   if(!zipUpdateSource->readFromFile(f))
+   {
+      printf("Zip_SetUpdateSource: '%s' is not a valid zip; ignoring\n", 
+             filename);
+      delete zipUpdateSource; // closes f
+      zipUpdateSource = NULL;
+      return false;
+   }
+
+   zipUpdatePath = filename;
+   M_TempFileName(filename, zipUpdateTemp);
+
+   if(!exitHandlerSet)
+   {
+      atexit(Zip_removeUpdateTemp);
+      exitHandlerSet = true;
+   }
+
+   return true;
+}
+
+//
+// Zip_OutputPath
+//
+// Where an archive is actually to be written: if it is replacing the archive
+// being updated from, it goes to a temporary file first.
+//
+static const char *Zip_OutputPath(const char *filename)
+{
+   if(zipUpdateSource && zipUpdatePath == filename)
+      return zipUpdateTemp.constPtr();
+   
+   return filename;
+}
+
+//
+// Zip_CloseUpdateSource
+//
+// Done with the old archive once the new one has been written out; the new
+// one now takes its place.
+//
+static void Zip_CloseUpdateSource()
+{
+   if(!zipUpdateSource)
+      return;
+
+   delete zipUpdateSource;
+   zipUpdateSource = NULL;
+
+   qstring temp(zipUpdateTemp);
+   zipUpdateTemp.clear(); // it is no longer to be removed on exit
+
+   if(!M_ReplaceFile(temp.constPtr(), zipUpdatePath.constPtr()))
+   {
+      I_Error("Zip_CloseUpdateSource: cannot replace %s; new archive is "
+              "left at %s\n", zipUpdatePath.constPtr(), temp.constPtr());
+   }
+
+   zipUpdatePath.clear();
+}
+
+//
+// Zip_ReuseFromUpdate
+//
+// If the old archive has this entry deflated with the same settings and the
+// data is unchanged, fill in the entry from there. The entry's CRC is always
+// calculated if there is a candidate to compare against; haveCRC says so.
+//
+static bool Zip_ReuseFromUpdate(zipfile_t *file, const zipcompparams_t &params,
+                                bool &haveCRC)
+{
+   ZipLump *lump;
+
+   if(!zipUpdateSource || !(lump = zipUpdateSource->findLump(file->name)))
+      return false;
+
+   // nothing records whether the old entry got the same treatment
+   if(params.ultra || params.tune)
+      return false;
+
+   if(lump->method  != ZipFile::METHOD_DEFLATE || 
+      lump->size    != file->len                ||
+      lump->gpFlags != Zip_GPFlagsForLevel(params.level))
+      return false;
+
+   file->crc = M_CRC32HashData(file->data, file->len);
+   haveCRC   = true;
+
+   if(lump->crc != file->crc)
+      return false;
+
+   file->cbuf = Zip_GetScratch(lump->compressed);
+
+   {
+      std::lock_guard<std::mutex> updateGuard(zipUpdateLock);
+
+      lump->readRaw(file->cbuf->data);
+      ++zipUpdateReused;
+      zipUpdateSaved += file->len;
+   }
+
+   file->cdata   = file->cbuf->data;
+   file->clen    = lump->compressed;
+   file->gpflags = static_cast<uint16_t>(lump->gpFlags);
+
+   return true;
+}
+
+//
+// Zip_PrintStats
+//
+// Report how effective the compression cache and -update were.
+//
+void Zip_PrintStats()
+{
+   printf("Zip_PrintStats: compression cache had %u hits, %u misses "
+          "(%lu bytes not recompressed)\n", zipCacheHits, zipCacheMisses,
+          (unsigned long)zipCacheSaved);
+
+   if(zipUpdateReused)
+   {
+      printf("Zip_PrintStats: reused %u entries from previous archive "
+             "(%lu bytes not recompressed)\n", zipUpdateReused, 
+             (unsigned long)zipUpdateSaved);
+   }
+
+   if(zipCompressMode == ZIP_COMPRESS_ULTRA)
+   {
+      printf("Zip_PrintStats: -ultra improved on level 9 for %u entries "
+             "(%lu bytes saved)\n", zipUltraImproved, 
+             (unsigned long)zipUltraSaved);
+   }
+
+   if(zipAutotune)
+      Zip_PrintTuning();
+}
+
+//
+// Zip_ReadDiskFile
+//
+// Read a file on disk into memory temporarily to copy it into the zip file.
+//
+static void Zip_ReadDiskFile(zipfile_t *file)
+{
+   FILE *f;
+   long  size;
+
+   if(!(f = fopen(file->diskfn, "rb")))
+      I_Error("Zip_ReadDiskFile: cannot open file %s\n", file->diskfn);
+
+   // get size
+   if(fseek(f, 0, SEEK_END))
+      I_Error("Zip_ReadDiskFile: cannot seek to end of %s\n", file->diskfn);
+   size = ftell(f);
+   if(size <= 0)
+      return;
+   if(fseek(f, 0, SEEK_SET))
+      I_Error("Zip_ReadDiskFile: cannot seek back on %s\n", file->diskfn);
+
+   // read in the file
+   void *buffer = emalloc(void *, (size_t)size);
+   if(fread(buffer, 1, size, f) != size)
+      I_Error("Zip_ReadDiskFile: short read on file %s\n", file->diskfn);
+   fclose(f);
+
+   file->data = static_cast<const byte *>(buffer);
+   file->len  = static_cast<uint32_t    >(size);
+   file->clen = file->len;
+}
+
+//
+// Zip_FreeDiskBuffer
+//
+// Free temporary buffer used to load a file from disk.
+//
+static void Zip_FreeDiskBuffer(zipfile_t *file)
+{
+   if(file->data)
+   {
+      auto ptr = const_cast<byte *>(file->data);
+      efree(ptr);
+      file->data = NULL;
+   }
+}
+
+//
+// Zip_RunProducer
+//
+// Generate the data for an entry added with a producer, which isn't needed
+// any longer afterward.
+//
+static void Zip_RunProducer(zipfile_t *file)
+{
+   uint32_t len  = 0;
+   byte    *data = (*file->producer)(len);
+
+   delete file->producer;
+   file->producer = NULL;
+
+   file->data = data;
+   file->len  = data ? len : 0;
+   file->clen = file->len;
+}
+
+//
+// Zip_PrepareFile
+//
+// Do all of the work needed before an entry can be written out: load it from
+// disk if needed, calculate its CRC, and compress it. This touches nothing
+// but the entry itself, so different entries can be prepared concurrently.
+//
+static void Zip_PrepareFile(zipfile_t *file)
+{
+   // if it is a disk file, open up the file
+   if(file->diskfn)
+      Zip_ReadDiskFile(file);
+
+   // if it is generated, now is the time
+   if(file->producer)
+      Zip_RunProducer(file);
+
+   zipcompparams_t params;
+   uint64_t        hash    = 0;
+   bool            haveCRC = false;
+
+   // Can't deflate an empty file, and policy may say not to bother
+   if(!file->len || !file->data || !Zip_GetCompressParams(file, params))
+      file->deflate = false;
+
+   // has identical data been compressed already?
+   if(file->deflate)
+   {
+      hash = Zip_HashData(file->data, file->len);
+      if(Zip_LookupCache(file, hash, params))
+         return;
+
+      // is it unchanged since the archive being updated?
+      if(Zip_ReuseFromUpdate(file, params, haveCRC))
+      {
+         Zip_AddToCache(file, hash, params);
+         return;
+      }
+   }
+
+   // calculate the CRC now unless it can be done while deflating
+   bool fused = (file->deflate && zipFusedCRC && !haveCRC);
+
+   if(!haveCRC)
+   {
+      if(file->len && !fused)
+         file->crc = M_CRC32HashData(file->data, file->len);
+      else
+         file->crc = 0;
+   }
+
+   if(file->deflate)
+   {
+      auto tmpSize = compressBound(file->len);
+
+      int level = params.level;
+
+      if(params.tune)
+      {
+         tmpSize = Zip_CompressTuned(file, params, 
+                                     fused ? &file->crc : NULL, level);
+      }
+      else
+      {
+         file->cbuf  = Zip_GetScratch(tmpSize);
+         file->cdata = file->cbuf->data;
+
+         auto res = Zip_Compress(file->cbuf->data, &tmpSize, file->data, 
+                                 file->len, params, fused ? &file->crc : NULL);
+         if(res != Z_OK)
+            I_Error("ZIP_WriteFile: compress returned error code %d\n", res);
+      }
+
+      if(params.ultra)
+         tmpSize = Zip_CompressUltra(file, tmpSize);
+
+      if(tmpSize < file->len)
+      {
+         // write back compressed size
+         file->clen    = (uint32_t)tmpSize;
+         file->gpflags = Zip_GPFlagsForLevel(level);
+      }
+      else
+      {
+         // deflate didn't help, so store it instead
+         Zip_ReleaseScratch(file->cbuf);
+         file->cbuf    = NULL;
+         file->cdata   = NULL;
+         file->deflate = false;
+      }
+
+      Zip_AddToCache(file, hash, params);
+   }
+}
+
+// Size of a local file header, not counting the name which follows it
+#define ZIP_LOCAL_HEADER_SIZE 30
+
+// Alignment padding is an extra field holding the alignment, then zeroes
+#define ZIP_ALIGN_EXTRA_ID   0xD935
+#define ZIP_ALIGN_EXTRA_SIZE 6
+
+// Largest alignment which may be asked for
+#define ZIP_MAXALIGN 4096
+
+static const byte zipZeroes[ZIP_MAXALIGN] = { 0 };
+
+// Data descriptor following an entry: signature, CRC, and both sizes
+#define ZIP_DESCRIPTOR_SIZE 16
+
+// General purpose flag saying an entry has a data descriptor
+#define ZIP_GPF_DESCRIPTOR 0x0008
+
+//
+// Zip_PutUint16
+//
+static byte *Zip_PutUint16(byte *p, uint16_t num)
+{
+   p[0] = static_cast<byte>(num);
+   p[1] = static_cast<byte>(num >> 8);
+   return p + 2;
+}
+
+//
+// Zip_PutUint32
+//
+static byte *Zip_PutUint32(byte *p, uint32_t num)
+{
+   p[0] = static_cast<byte>(num);
+   p[1] = static_cast<byte>(num >> 8);
+   p[2] = static_cast<byte>(num >> 16);
+   p[3] = static_cast<byte>(num >> 24);
+   return p + 4;
+}
+
+//
+// Zip_SetAlignment
+//
+void Zip_SetAlignment(int alignment)
+{
+   if(alignment < 0 || alignment > ZIP_MAXALIGN || 
+      (alignment & (alignment - 1)))
+   {
+      I_Error("Zip_SetAlignment: alignment must be a power of two no greater "
+              "than %d\n", ZIP_MAXALIGN);
+   }
+
+   zipAlignment = (alignment > 1) ? alignment : 0;
+}
+
+//
+// Zip_SetDataDescriptors
+//
+void Zip_SetDataDescriptors(bool enable)
+{
+   zipDescriptors = enable;
+}
+
+//
+// Zip_HasDescriptor
+//
+// True if an entry's CRC and sizes follow its data. Only deflated entries get
+// a descriptor: streaming readers can't find the end of stored data without
+// its size up front, and a stored entry's CRC and sizes are always known
+// before its header is written anyway.
+//
+static bool Zip_HasDescriptor(const zipfile_t *file)
+{
+   return zipDescriptors && file->deflate;
+}
+
+//
+// Zip_EntryFlags
+//
+// General purpose flags for an entry as written to the file.
+//
+static uint16_t Zip_EntryFlags(const zipfile_t *file)
+{
+   return file->gpflags | (Zip_HasDescriptor(file) ? ZIP_GPF_DESCRIPTOR : 0);
+}
+
+//
+// Zip_SetExtraLen
+//
+// Once an entry's offset is known, work out how much padding is needed in its
+// local header so that stored data starts on an aligned boundary. Padding has
+// to be big enough to hold the extra field's own header, so add on however
+// many multiples of the alignment it takes.
+//
+static void Zip_SetExtraLen(zipfile_t *file)
+{
+   file->extralen = 0;
+
+   if(!zipAlignment || file->deflate || !file->len)
+      return;
+
+   long   start = file->offset + ZIP_LOCAL_HEADER_SIZE + (long)strlen(file->name);
+   size_t pad   = (zipAlignment - (size_t)(start % zipAlignment)) % zipAlignment;
+
+   while(pad < ZIP_ALIGN_EXTRA_SIZE)
+      pad += zipAlignment;
+
+   file->extralen = static_cast<uint16_t>(pad);
+}
+
+//
+// ziplocalheader_t
+//
+// Staging space for the fixed-size parts of an entry as it appears in the
+// file, and the pieces which make up the whole of it: the header, the name,
+// any alignment padding, the stored or deflated data, and any descriptor.
+//
+struct ziplocalheader_t
+{
+   byte               header[ZIP_LOCAL_HEADER_SIZE];
+   byte               extra[ZIP_ALIGN_EXTRA_SIZE];
+   byte               descriptor[ZIP_DESCRIPTOR_SIZE];
+   OutBuffer::piece_t pieces[6];
+   size_t             numpieces;
+};
+
+//
+// Zip_BuildLocalHeader
+//
+// Fill in the local file header for an entry which has been prepared and
+// given its place in the file.
+//
+static void Zip_BuildLocalHeader(const zipfile_t *file, ziplocalheader_t &lh)
+{
+   uint16_t    date, time;
+   uint16_t    namelen;
+   const byte *data;
+   uint32_t    len;
+   byte       *p = lh.header;
+
+   p = Zip_PutUint32(p, 0x04034b50); // local file header signature
+   p = Zip_PutUint16(p, 0x14);       // version needed to extract (2.0)
+
+   // general purpose bit flag and compression method
+   p = Zip_PutUint16(p, Zip_EntryFlags(file));
+   if(file->deflate)
+      p = Zip_PutUint16(p, 8); // compression method == deflate
+   else
+      p = Zip_PutUint16(p, 0); // compression method == store
+   
+   // Time is psxwadgen version #; date is PlayStation Doom release date.
+   time = (1 << 5) | (1 << 11);
+   date = 16 | (11 << 5) | (15 << 9); 
+   
+   p = Zip_PutUint16(p, time); // file time (1:01)
+   p = Zip_PutUint16(p, date); // file date (11/16/1995)
+
+   if(file->deflate)
+   {
+      data = file->cdata;
+      len  = file->clen;
+   }
+   else
+   {
+      data = file->data;
+      len  = file->len;
+   }
+
+   if(Zip_HasDescriptor(file))
+   {
+      // a streaming reader will find them after the data instead
+      p = Zip_PutUint32(p, 0);
+      p = Zip_PutUint32(p, 0);
+      p = Zip_PutUint32(p, 0);
+   }
+   else
+   {
+      p = Zip_PutUint32(p, file->crc);   // CRC-32
+      p = Zip_PutUint32(p, file->clen);  // compressed size
+      p = Zip_PutUint32(p, file->len);   // uncompressed size
+   }
+
+   namelen = (uint16_t)strlen(file->name);
+   p = Zip_PutUint16(p, namelen);        // filename length
+   p = Zip_PutUint16(p, file->extralen); // extra field length
+
+   lh.numpieces = 0;
+   lh.pieces[lh.numpieces].data   = lh.header;
+   lh.pieces[lh.numpieces++].size = ZIP_LOCAL_HEADER_SIZE;
+   lh.pieces[lh.numpieces].data   = file->name;
+   lh.pieces[lh.numpieces++].size = namelen;
+
+   if(file->extralen)
+   {
+      p = lh.extra;
+      p = Zip_PutUint16(p, ZIP_ALIGN_EXTRA_ID);
+      p = Zip_PutUint16(p, file->extralen - 4);
+      p = Zip_PutUint16(p, static_cast<uint16_t>(zipAlignment));
+
+      lh.pieces[lh.numpieces].data   = lh.extra;
+      lh.pieces[lh.numpieces++].size = ZIP_ALIGN_EXTRA_SIZE;
+      lh.pieces[lh.numpieces].data   = zipZeroes;
+      lh.pieces[lh.numpieces++].size = file->extralen - ZIP_ALIGN_EXTRA_SIZE;
+   }
+
+   lh.pieces[lh.numpieces].data   = data;
+   lh.pieces[lh.numpieces++].size = len;
+
+   if(Zip_HasDescriptor(file))
+   {
+      p = lh.descriptor;
+      p = Zip_PutUint32(p, 0x08074b50); // data descriptor signature
+      p = Zip_PutUint32(p, file->crc);
+      p = Zip_PutUint32(p, file->clen);
+      p = Zip_PutUint32(p, file->len);
+
+      lh.pieces[lh.numpieces].data   = lh.descriptor;
+      lh.pieces[lh.numpieces++].size = ZIP_DESCRIPTOR_SIZE;
+   }
+}
+
+//
+// Zip_EntrySize
+//
+// Space taken up in the file by a prepared entry and its local header.
+//
+static long Zip_EntrySize(const zipfile_t *file)
+{
+   size_t len = file->deflate ? file->clen : file->len;
+
+   if(Zip_HasDescriptor(file))
+      len += ZIP_DESCRIPTOR_SIZE;
+
+   return static_cast<long>(ZIP_LOCAL_HEADER_SIZE + strlen(file->name) + 
+                            file->extralen + len);
+}
+
+//
+// Zip_FinishFile
+//
+// Free everything an entry was holding on to once it has been written.
+//
+static void Zip_FinishFile(zipfile_t *file)
+{
+   // done with the compressed copy
+   if(file->cbuf)
+   {
+      Zip_ReleaseScratch(file->cbuf);
+      file->cbuf = NULL;
+   }
+   file->cdata = NULL;
+
+   // done with the source data too, if it belongs to the archive
+   if(file->owned && file->data)
+   {
+      auto ptr = const_cast<byte *>(file->data);
+      efree(ptr);
+      file->data = NULL;
+   }
+
+   // if was a disk file, try freeing the buffer
+   if(file->diskfn)
+      Zip_FreeDiskBuffer(file);
+}
+
+//
+// Zip_EmitFile
+//
+// Write the local file header and file data for a single entry which has
+// already been prepared.
+//
+static void Zip_EmitFile(zipfile_t *file, OutBuffer &ob)
+{
+   ziplocalheader_t lh;
+
+   file->offset = ob.GetPosition();
+   Zip_SetExtraLen(file);
+
+   // the header is only staged in the buffer, and goes out in the same write
+   // as the name and the data, which are written from where they are
+   Zip_BuildLocalHeader(file, lh);
+   ob.WriteVector(lh.pieces, lh.numpieces);
+
+   Zip_FinishFile(file);
+}
+
+//
+// Zip_EmitFileAt
+//
+// Write a prepared entry at the offset which has been reserved for it,
+// independently of anything else being written to the file.
+//
+static void Zip_EmitFileAt(zipfile_t *file, OutBuffer &ob)
+{
+   ziplocalheader_t lh;
+
+   Zip_BuildLocalHeader(file, lh);
+   if(!ob.WriteVectorAt(file->offset, lh.pieces, lh.numpieces))
+      I_Error("Zip_EmitFileAt: failed writing '%s'\n", file->name);
+
+   Zip_FinishFile(file);
+}
+
+//
+// Zip_WriteFile
+//
+// Write the local file header and file data for a single entry in the zip
+// archive.
+//
+static void Zip_WriteFile(zipfile_t *file, OutBuffer &ob)
+{
+   Zip_PrepareFile(file);
+   Zip_EmitFile(file, ob);
+}
+
+//=============================================================================
+//
+// Parallel Compression
+//
+
+//
+// ZipWriteQueue
+//
+// Entries pushed into the queue are prepared by a pool of worker threads, in
+// any order, while the thread which pushes them writes each one out strictly
+// in the order it was pushed. Only a limited number of entries may be in
+// flight at once, which bounds the memory held by compressed data that is
+// still waiting its turn to be written.
+//
+// In positional mode, space in the file is reserved for each entry as soon
+// as it has been prepared, and whichever thread is free writes it there
+// directly, so one slow entry doesn't hold up writing those behind it. The
+// central directory records where everything ended up. If space is reserved
+// in the order entries were pushed, the output is the same as in order mode.
+//
+class ZipWriteQueue
+{
+protected:
+   enum
+   {
+      SLOT_QUEUED,   // waiting to be prepared
+      SLOT_PREPARED, // ready to be written (or, if positional, reserved)
+      SLOT_RESERVED, // positional: space reserved, ready to be written
+      SLOT_WRITING,  // positional: being written
+      SLOT_WRITTEN   // positional: finished
+   };
+
+   OutBuffer &ob;
+
+   std::mutex              lock;
+   std::condition_variable workReady;  // signalled when there's work to claim
+   std::condition_variable fileReady;  // signalled when an entry is prepared
+
+   zipfile_t **slots;   // ring of in-flight entries
+   byte       *states;  // ring of entry states
+   size_t      window;  // maximum number of entries in flight
+   size_t      head;    // next entry to write (or retire, if positional)
+   size_t      next;    // next entry to prepare
+   size_t      tail;    // next free position
+   bool        quit;    // workers should exit
+   bool        spin;    // show progress spinner while writing
+
+   bool        positional;  // entries are written at reserved offsets
+   bool        ordered;     // positional space is reserved in push order
+   size_t      reserveNext; // next entry to reserve space for, if ordered
+   long        reserveEnd;  // end of the space reserved so far
+
+   PODCollection<std::thread *> workers;
+
+   void workerLoop();
+   bool prepareNext(std::unique_lock<std::mutex> &guard);
+   void reserve(size_t slot);
+   bool writeNextAt(std::unique_lock<std::mutex> &guard, bool owner);
+   void writeReady(std::unique_lock<std::mutex> &guard, bool wait);
+
+public:
+   ZipWriteQueue(OutBuffer &pOb, int numThreads, bool showProgress);
+   ~ZipWriteQueue();
+
+   void push(zipfile_t *file);
+   void finish();
+};
+
+//
+// ZipWriteQueue Constructor
+//
+// numThreads is the total number of threads to compress with, including the
+// one which pushes entries and writes them.
+//
+ZipWriteQueue::ZipWriteQueue(OutBuffer &pOb, int numThreads, bool showProgress)
+   : ob(pOb), lock(), workReady(), fileReady(), head(0), next(0), tail(0),
+     quit(false), spin(showProgress), reserveNext(0), reserveEnd(0), workers()
+{
+   window = static_cast<size_t>(numThreads) * 4;
+   slots  = ecalloc(zipfile_t **, window, sizeof(zipfile_t *));
+   states = ecalloc(byte *,       window, sizeof(byte));
+
+   positional = (zipWriteMode != ZIP_WRITE_INORDER);
+   ordered    = (zipWriteMode == ZIP_WRITE_POSITIONAL_ORDERED);
+
+   if(positional)
+   {
+      // everything from here on is written at explicit offsets
+      ob.Flush();
+      reserveEnd = ob.GetPosition();
+   }
+
+   for(int i = 1; i < numThreads; i++)
+      workers.add(new std::thread([this] () { workerLoop(); }));
+}
+
+//
+// ZipWriteQueue Destructor
+//
+ZipWriteQueue::~ZipWriteQueue()
+{
+   {
+      std::lock_guard<std::mutex> guard(lock);
+      quit = true;
+   }
+   workReady.notify_all();
+
+   for(std::thread *thread : workers)
+   {
+      thread->join();
+      delete thread;
+   }
+
+   efree(slots);
+   efree(states);
+}
+
+//
+// ZipWriteQueue::reserve
+//
+// Claim space in the file for a prepared entry. Called with the lock held.
+//
+void ZipWriteQueue::reserve(size_t slot)
+{
+   zipfile_t *file = slots[slot];
+
+   file->offset  = reserveEnd;
+   Zip_SetExtraLen(file);
+   reserveEnd   += Zip_EntrySize(file);
+   states[slot]  = SLOT_RESERVED;
+
+   workReady.notify_one();
+}
+
+//
+// ZipWriteQueue::prepareNext
+//
+// If any pushed entry has not been claimed yet, claim and prepare it. The
+// lock is dropped while the entry is being worked on. Returns false if there
+// was nothing to do.
+//
+bool ZipWriteQueue::prepareNext(std::unique_lock<std::mutex> &guard)
+{
+   if(next == tail)
+      return false;
+
+   size_t     slot = next++ % window;
+   zipfile_t *file = slots[slot];
+
+   guard.unlock();
+   Zip_PrepareFile(file);
+   guard.lock();
+
+   states[slot] = SLOT_PREPARED;
+
+   if(positional)
+   {
+      if(!ordered)
+         reserve(slot);
+      else
+      {
+         // this may complete a run of entries which were waiting on it
+         while(reserveNext != tail && 
+               states[reserveNext % window] == SLOT_PREPARED)
+         {
+            reserve(reserveNext++ % window);
+         }
+      }
+   }
+
+   fileReady.notify_all();
+
+   return true;
+}
+
+//
+// ZipWriteQueue::writeNextAt
+//
+// Positional mode: claim any entry which has space reserved and write it out.
+// Entries at the front of the queue are retired once written, making room for
+// more. Returns false if there was nothing to do.
+//
+bool ZipWriteQueue::writeNextAt(std::unique_lock<std::mutex> &guard, bool owner)
+{
+   size_t i;
+
+   for(i = head; i != tail; i++)
+   {
+      if(states[i % window] == SLOT_RESERVED)
+         break;
+   }
+
+   if(i == tail)
+      return false;
+
+   size_t     slot = i % window;
+   zipfile_t *file = slots[slot];
+
+   states[slot] = SLOT_WRITING;
+
+   guard.unlock();
+   if(owner && spin)
+      V_ProgressSpinner();
+   Zip_EmitFileAt(file, ob);
+   guard.lock();
+
+   states[slot] = SLOT_WRITTEN;
+
+   while(head != tail && states[head % window] == SLOT_WRITTEN)
+   {
+      slots[head % window] = NULL;
+      ++head;
+   }
+
+   fileReady.notify_all();
+
+   return true;
+}
+
+//
+// ZipWriteQueue::workerLoop
+//
+void ZipWriteQueue::workerLoop()
+{
+   std::unique_lock<std::mutex> guard(lock);
+
+   while(!quit)
+   {
+      // writing first frees up memory and room in the queue soonest
+      if(positional && writeNextAt(guard, false))
+         continue;
+      if(!prepareNext(guard))
+         workReady.wait(guard);
+   }
+}
+
+//
+// ZipWriteQueue::writeReady
+//
+// Write out prepared entries from the front of the queue. If wait is true,
+// keep going until the queue is empty, helping to prepare entries rather
+// than sitting idle.
+//
+// In positional mode, help write or prepare entries instead, either until
+// the queue is empty or, if not waiting, until there is room in it.
+//
+void ZipWriteQueue::writeReady(std::unique_lock<std::mutex> &guard, bool wait)
+{
+   if(positional)
+   {
+      while(wait ? head != tail : tail - head == window)
+      {
+         if(!writeNextAt(guard, true) && !prepareNext(guard))
+            fileReady.wait(guard);
+      }
+      return;
+   }
+
+   while(head != tail)
+   {
+      size_t slot = head % window;
+
+      if(states[slot] != SLOT_PREPARED)
+      {
+         if(!wait)
+            break;
+         if(!prepareNext(guard))
+            fileReady.wait(guard);
+         continue;
+      }
+
+      zipfile_t *file = slots[slot];
+
+      // only this thread ever touches the head entry once it is ready
+      guard.unlock();
+      if(spin)
+         V_ProgressSpinner();
+      Zip_EmitFile(file, ob);
+      guard.lock();
+
+      slots[slot] = NULL;
+      ++head;
+   }
+}
+
+//
+// ZipWriteQueue::push
+//
+// Add an entry to the queue. If the queue is full, entries are written out
+// until there is room.
+//
+void ZipWriteQueue::push(zipfile_t *file)
+{
+   std::unique_lock<std::mutex> guard(lock);
+
+   while(tail - head == window)
+   {
+      writeReady(guard, false);
+      if(tail - head == window && !prepareNext(guard))
+         fileReady.wait(guard);
+   }
+
+   slots[tail % window]  = file;
+   states[tail % window] = SLOT_QUEUED;
+   ++tail;
+   workReady.notify_one();
+
+   writeReady(guard, false);
+}
+
+//
+// ZipWriteQueue::finish
+//
+// Write out everything remaining in the queue.
+//
+void ZipWriteQueue::finish()
+{
+   std::unique_lock<std::mutex> guard(lock);
+   writeReady(guard, true);
+
+   // carry on after the last of the reserved space
+   if(positional && !ob.SkipTo(reserveEnd))
+      I_Error("ZipWriteQueue::finish: cannot seek in output file\n");
+}
+
+//
+// Zip_CreateStream
+//
+// Initialize a ziparchive_t structure which writes out its entries as they
+// are added.
+//
+void Zip_CreateStream(ziparchive_t *zip, const char *filename)
+{
+   Zip_Create(zip, filename);
+
+   zip->stream = new OutBuffer();
+   if(!zip->stream->CreateFile(Zip_OutputPath(filename), 16384, OutBuffer::LENDIAN))
+      I_Error("Zip_CreateStream: cannot open %s for writing\n", filename);
+
+   if(M_GetNumJobs() > 1)
+      zip->queue = new ZipWriteQueue(*zip->stream, M_GetNumJobs(), false);
+}
+
+//
+// Zip_StreamFile
+//
+// Send a newly added entry straight to a streaming archive's output.
+//
+static void Zip_StreamFile(ziparchive_t *zip, zipfile_t *file)
+{
+   if(zip->queue)
+      zip->queue->push(file);
+   else
+      Zip_WriteFile(file, *zip->stream);
+}
+
+//
+// Zip_WriteDirEntry
+//
+// Write the central directory entry for a single file in the zip archive.
+//
+static void Zip_WriteDirEntry(ziparchive_t *zip, zipfile_t *file, OutBuffer &ob)
+{
+   unsigned short time, date;
+   unsigned short namelen;
+
+   ob.WriteUint32(0x02014b50); // central file header signature
+   ob.WriteUint16(0x0B14);     // version made by 
+   ob.WriteUint16(0x14);       // version needed to extract (2.0)
+
+   // general purpose bit flag and compression method
+   ob.WriteUint16(Zip_EntryFlags(file));
+   if(file->deflate)
+      ob.WriteUint16(8); // compression method == deflate
+   else
+      ob.WriteUint16(0); // compression method == store
+
+   // Time is psxwadgen version #; date is PSX Doom release date.
+   time = (1 << 5) | (1 << 11);
+   date = 16 | (11 << 5) | (15 << 9); 
+   
    ob.WriteUint16(time);       // file time
    ob.WriteUint16(date);       // file date
    ob.WriteUint32(file->crc);  // CRC-32 (already calculated)
@@ -446,7 +2322,8 @@ static void Zip_WriteDirEntry(ziparchive_t *zip, zipfile_t *file, OutBuffer &ob)
    ob.WriteUint32(file->offset);  // local header offset
 
    // write the file name
-   ob.Write(file->name, namelen);
+   OutBuffer::piece_t piece = { file->name, namelen };
+   ob.WriteVector(&piece, 1);
 
    zip->dirlen += (46 + namelen);
 }
@@ -469,46 +2346,99 @@ static void Zip_WriteEndOfDir(ziparchive_t *zip, OutBuffer &ob)
 }
 
 //
-// Zip_Write
+// Zip_WriteCentralDir
 //
-// Output the zip archive to disk.
+// Write the central directory and end of central directory structure after
+// all of the file entries.
 //
-void Zip_Write(ziparchive_t *zip)
+static void Zip_WriteCentralDir(ziparchive_t *zip, OutBuffer &ob)
 {
-   OutBuffer ob;
    zipfile_t *curfile;
 
-   ob.CreateFile(zip->filename, 16384, OutBuffer::LENDIAN);
+   zip->diroffset = ob.GetPosition();
 
-   // write files
+   // write central directory
    curfile = zip->files;
 
    while(curfile)
    {
       V_ProgressSpinner();
-      Zip_WriteFile(curfile, ob);
+      Zip_WriteDirEntry(zip, curfile, ob);
       curfile = curfile->next;
    }
 
-   ob.Flush();
+   // write end of central directory
+   Zip_WriteEndOfDir(zip, ob);
+}
+
+//
+// Zip_Write
+//
+// Output the zip archive to disk.
+//
+void Zip_Write(ziparchive_t *zip)
+{
+   OutBuffer ob;
+   zipfile_t *curfile;
+
+   // streaming archives have already written out their entries
+   if(zip->stream)
+   {
+      if(zip->queue)
+      {
+         zip->queue->finish();
+         delete zip->queue;
+         zip->queue = NULL;
+      }
+
+      Zip_WriteCentralDir(zip, *zip->stream);
 
-   zip->diroffset = ob.Tell();
+      zip->stream->Close();
+      delete zip->stream;
+      zip->stream = NULL;
 
-   // write central directory
+      Zip_ClearCache();
+      Zip_FreeCompressionPools();
+      Zip_CloseUpdateSource();
+      return;
+   }
+
+   ob.CreateFile(Zip_OutputPath(zip->filename), 16384, OutBuffer::LENDIAN);
+
+   // write files
    curfile = zip->files;
 
-   while(curfile)
+   if(M_GetNumJobs() > 1)
    {
-      V_ProgressSpinner();
-      Zip_WriteDirEntry(zip, curfile, ob);
-      curfile = curfile->next;
+      // compress on worker threads, then write in order
+      ZipWriteQueue queue(ob, M_GetNumJobs(), true);
+
+      while(curfile)
+      {
+         queue.push(curfile);
+         curfile = curfile->next;
+      }
+
+      queue.finish();
+   }
+   else
+   {
+      while(curfile)
+      {
+         V_ProgressSpinner();
+         Zip_WriteFile(curfile, ob);
+         curfile = curfile->next;
+      }
    }
 
-   // write end of central directory
-   Zip_WriteEndOfDir(zip, ob);
+   Zip_WriteCentralDir(zip, ob);
 
    // close the file
    ob.Close();
+
+   Zip_ClearCache();
+   Zip_FreeCompressionPools();
+   Zip_CloseUpdateSource();
 }
 
 #ifndef NO_UNIT_TESTS
@@ -27,8 +27,19 @@
 #ifndef ZIP_WRITE_H__
 #define ZIP_WRITE_H__
 
+#include <functional>
+
 #include "doomtype.h"
 
+class OutBuffer;
+class ZipWriteQueue;
+struct zipscratch_t;
+
+// Generates the contents of an entry when it is about to be written. Returns
+// data allocated from the zone heap, which the archive frees once written,
+// and sets len to its size. May be called on a worker thread.
+typedef std::function<byte *(uint32_t &len)> zipproducer_t;
+
 //
 // zipfile - a single file to be added to the zip
 //
@@ -45,7 +56,13 @@ struct zipfile_t
    uint32_t    extattr; // external attributes
    uint16_t    intattr; // internal attributes
    bool        deflate; // if true, use deflate compression
+   uint16_t    gpflags; // general purpose flags (compression level)
+   bool        owned;   // if true, data is freed once it has been written
    const char *diskfn;  // if non-NULL, path of a file to read in and write
+   zipproducer_t *producer; // if non-NULL, generates data when needed
+   uint16_t    extralen; // length of local header padding, once placed
+   const byte *cdata;   // compressed data, while waiting to be written
+   zipscratch_t *cbuf;  // pooled buffer holding cdata, if not borrowed
 };
 
 //
@@ -59,6 +76,9 @@ struct ziparchive_t
    long        diroffset; // offset of central directory
    uint16_t    fcount;    // count of files
    uint32_t    dirlen;    // length of central directory
+
+   OutBuffer     *stream; // if non-NULL, entries are written as they're added
+   ZipWriteQueue *queue;  // compression queue used while streaming
 };
 
 // Zip File Types
@@ -72,6 +92,13 @@ enum ziptype_e
 // Initialize a zip archive structure.
 void Zip_Create(ziparchive_t *zip, const char *filename);
 
+// Initialize a zip archive structure in streaming mode. The output file is
+// opened immediately, and each entry is compressed and written out as soon as
+// it is added, so that only its central directory record is kept in memory.
+// Entries added with owned == true have their data freed once written; any
+// other data must remain valid until Zip_Write is called.
+void Zip_CreateStream(ziparchive_t *zip, const char *filename);
+
 // Add a new file or directory entry to a zip archive.
 // zip      - an initialized ziparchive structure
 // name     - name of the file within the archive, including any subdirectories
@@ -80,9 +107,12 @@ void Zip_Create(ziparchive_t *zip, const char *filename);
 // fileType - one of the ziptype_e enumeration values
 // deflate  - if true, the file will be compressed using zlib deflate;
 //            otherwise, "store" method will be used (direct copy)
+// owned    - if true, the archive takes ownership of data, which must have
+//            been allocated from the zone heap, and frees it once written
 // Returns: A new zipfile_t structure.
 zipfile_t *Zip_AddFile(ziparchive_t *zip, const char *name, const byte *data, 
-                       uint32_t len, ziptype_e fileType, bool deflate);
+                       uint32_t len, ziptype_e fileType, bool deflate,
+                       bool owned = false);
 
 // Add a file on disk as an entry to a zip archive. The file will not be
 // buffered in memory until the zip file is being written out, and then only
@@ -95,7 +125,84 @@ zipfile_t *Zip_AddFile(ziparchive_t *zip, const char *name, const byte *data,
 zipfile_t *Zip_AddFile(ziparchive_t *zip, const char *name, 
                        const char *path, bool deflate);
 
-// Call to write the zip archive to disk.
+// Add an entry whose data is generated only once the archive is written out,
+// and freed as soon as it has been. When compressing on more than one thread,
+// producers run on worker threads a limited number of entries ahead of the
+// one being written, so they must be safe to run concurrently.
+// zip      - an initialized ziparchive structure
+// name     - name of the file within the archive, including any subdirectories
+// producer - function which generates the entry's data
+// deflate  - if true, file will be deflated; otherwise, stored.
+// Returns: A new zipfile_t structure.
+zipfile_t *Zip_AddFile(ziparchive_t *zip, const char *name, 
+                       const zipproducer_t &producer, bool deflate);
+
+// Move all entries from src onto the end of zip, in order. This allows
+// entries to be gathered into separate archives and then merged. If zip is
+// streaming, the entries are written out.
+void Zip_AppendArchive(ziparchive_t *zip, ziparchive_t *src);
+
+// Compression modes
+enum zipcompress_e
+{
+   ZIP_COMPRESS_RELEASE, // best compression for each kind of entry (default)
+   ZIP_COMPRESS_FAST,    // quick compression, for throwaway builds
+   ZIP_COMPRESS_STORE,   // store everything without compression
+   ZIP_COMPRESS_ULTRA    // as release, but also try an exhaustive encoder
+};
+
+// Select how entries marked for deflate are actually compressed. Levels for
+// each kind of entry come from a policy table keyed by entry name.
+void Zip_SetCompressMode(zipcompress_e mode);
+
+// Override the zlib level (0-9) for all deflated entries; 0 stores them.
+// Pass -1 to go back to the policy table.
+void Zip_SetCompressLevel(int level);
+
+// If enabled, the CRC of each deflated entry is calculated as its data is
+// fed to the compressor, rather than in a separate pass beforehand.
+void Zip_SetFusedCRC(bool enable);
+
+// Ways of writing out entries when compressing on more than one thread
+enum zipwritemode_e
+{
+   ZIP_WRITE_INORDER,           // one thread writes entries in order
+   ZIP_WRITE_POSITIONAL,        // entries written at offsets reserved as ready
+   ZIP_WRITE_POSITIONAL_ORDERED // as above, but offsets reserved in order
+};
+
+void Zip_SetWriteMode(zipwritemode_e mode);
+
+// Pad local headers so that the data of every stored entry starts at a
+// multiple of alignment bytes in the file (a power of two; 0 or 1 for none).
+// Entries which are better mapped than decompressed are then stored as well.
+void Zip_SetAlignment(int alignment);
+
+// Try a number of zlib settings for every deflated entry, keep the smallest
+// result, and gather totals for each kind of entry. The summary is printed by
+// Zip_PrintStats.
+void Zip_SetAutotune(bool enable);
+
+// Use, or save, the best setting found by -autotune for each kind of entry.
+bool Zip_LoadTuning(const char *filename);
+bool Zip_SaveTuning(const char *filename);
+
+// Write each deflated entry's CRC and sizes in a data descriptor after its
+// data, as done by streaming zip writers, rather than in its local header.
+// Stored entries always have them in the header.
+void Zip_SetDataDescriptors(bool enable);
+
+// Reuse compressed entries from the existing archive at filename, which the
+// next archive written is going to replace. Returns false if there isn't one.
+// The new archive is written to a temporary file, which is only moved over
+// the old one once it is complete.
+bool Zip_SetUpdateSource(const char *filename);
+
+// Print statistics on the work done writing out archives.
+void Zip_PrintStats();
+
+// Call to write the zip archive to disk. For a streaming archive, this
+// writes out any remaining entries and the central directory.
 void Zip_Write(ziparchive_t *zip);
 
 #ifndef NO_UNIT_TESTS